@@ -55,15 +55,34 @@ static char prog_id[] = "$Id: nswing.c 9936 2016-11-17 17:57:28Z j $";
  *     C:\programs\compa_libs\netcdf_GIT\compileds\VC12_64\lib\netcdf.lib /DI_AM_C 
  *     /DHAVE_NETCDF /nologo /D_CRT_SECURE_NO_WARNINGS /fp:precise /Ox
  *
+ * or, on Linux/OSX
+ *	gcc -O2 nswing.c -DI_AM_C -DHAVE_NETCDF -lnetcdf -lm -fopenmp -DHAVE_OPENMP
+ *
+ * Multi-threading backend is selected at compile time. -DHAVE_OPENMP (plus /openmp or -fopenmp) uses OpenMP,
+ * -DHAVE_PTHREAD (plus -lpthread) uses POSIX threads. Without any of them the Windows build uses its native
+ * threads and the others run single threaded. With POSIX (also alongside OpenMP) or Windows threads the output
+ * grids and netCDF slices are written by a background thread while the time loop goes on.
+ *
  *	Rewritten in C, mexified, added number options, etc... By
  *	Joaquim Luis - 2013
  *
  */
 
 #if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
-#	define DO_MULTI_THREAD	/* ISTO TEM DE SER AUTOMATIZADO, OU VIA COMPILA */
+#	define DO_MULTI_THREAD	/* Native Windows threads */
 #else
 #	define strtok_s strtok_r
+#	ifdef HAVE_PTHREAD
+#		define DO_MULTI_THREAD	/* POSIX threads */
+#	endif
+#endif
+
+#if HAVE_OPENMP
+#	undef DO_MULTI_THREAD	/* OpenMP does the threads management itself */
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#	define DO_SIMD		/* Build AVX2 and AVX-512 versions of the moment kernels and pick one at run time */
 #endif
 
 #define I_AM_MEX        /* Build as a MEX */
@@ -72,11 +91,16 @@ static char prog_id[] = "$Id: nswing.c 9936 2016-11-17 17:57:28Z j $";
 #	undef I_AM_MEX
 #endif
 
+#if !defined(I_AM_MEX) && (defined(WIN32) || defined(_WIN32) || defined(_WIN64) || defined(HAVE_PTHREAD))
+#	define DO_ASYNC_WRITE	/* Output files are written by a background thread (MEX API calls must stay in the main one) */
+#endif
+
 #include <float.h>
 #include <math.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <signal.h>
 
 #ifdef I_AM_MEX
 #	include "mex.h"
@@ -116,12 +140,26 @@ union {uint64_t i; double d;} loc_nan = {0x7ff8000000000000};
 #if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
 #	include <windows.h>
 #	include <process.h>
+#	include <io.h>
 #endif
 
 #if HAVE_OPENMP
 #include <omp.h>
 #endif
 
+#if defined(HAVE_PTHREAD) && !(defined(WIN32) || defined(_WIN32) || defined(_WIN64))
+#	include <pthread.h>
+#	include <unistd.h>
+#elif !(defined(WIN32) || defined(_WIN32) || defined(_WIN64))
+#	include <unistd.h>
+#endif
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(_WIN64))
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#endif
+
 #define	FALSE	0
 #define	TRUE	1
 #ifndef M_PI
@@ -151,8 +189,23 @@ union {uint64_t i; double d;} loc_nan = {0x7ff8000000000000};
 #define EPS1 1e-1
 
 static double EPS4 = EPS4_;		/* Kinda trick to be able to change EPS4 via a command line option */
+static volatile sig_atomic_t chk_signal = 0;	/* -K. The SIGUSR1 or SIGTERM that asked for a checkpoint */
+static int grd_mmap = FALSE;	/* -G...+m. write_grd_bin() fills a memory mapping of the file instead of using fwrite */
+
+/* Type of the state arrays (water level, fluxes, depths, velocities and bathymetry). Build
+   with -DSINGLE_PRECISION to store and update them in float, which halves the memory and the
+   memory traffic of the solver. Output files are written in float in either case. */
+#ifdef SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
 
 #define MAXRUNUP -50 	/* Do not waste time computing flood above this altitude */
+#define DEEP_WATER 100	/* Depth below which a cell is taken as never drying */
+#define CELL_DRY   0	/* Permanent land (above MAXRUNUP). Never computed */
+#define CELL_COAST 1	/* Land or shallow water that may be flooded or dry out */
+#define CELL_DEEP  2	/* Deeper than DEEP_WATER */
 #define V_LIMIT   20	/* Upper limit of maximum velocity */
 
 #define CNULL	((char *)NULL)
@@ -172,12 +225,73 @@ static double EPS4 = EPS4_;		/* Kinda trick to be able to change EPS4 via a comm
 #	define irint(x) ((int)rint(x))
 #endif
 
+#define MAX_THREADS 64	/* Upper limit of threads used to split the grids (64 is the WaitForMultipleObjects limit) */
+#define TILE_NX 256		/* Width  of the tiles the grids are split into when multi-threading */
+#define TILE_NY 32		/* Height of the tiles. 256 x 32 doubles is 64 kB per array, so a tile fits in L2 */
+#define FUSED_BAND_NY 16	/* Minimum height of the bands of rows swept by the fused kernel */
+#define ACTIVE_PAD 3		/* Reach, in cells, of one time step. The moment reads 2 cells away the mass, that reads 1 */
+#define SIMD_CHUNK 64		/* Number of cells of a row processed at a time by the vectorized moment kernels */
+#define WAKE_RING 2		/* Width, in parent cells, of the band on each side of a nested grid border watched by -J+a */
+#define SCEN_PACK 4		/* Number of -Fb scenarios advanced by one sweep of the packed linear kernels */
+#define OUT_SLOTS 4		/* Number of output files (or netCDF slices) that may wait for the writer thread */
+#define CHK_ALIGN 64		/* -K. Each array of a checkpoint file starts at a multiple of this many bytes */
+#define CHK_WMAX      1		/* Optional contents of a checkpoint. Those of the whole run */
+#define CHK_VMAX      2
+#define CHK_MAREGS    4
+#define CHK_TRACERS   8
+#define CHK_VEX      16		/* And those of each level */
+#define CHK_VEY      32
+#define CHK_LBEACH   64
+#define CHK_SBEACH  128
+#define CHK_STOPPED   3		/* Exit status of a run stopped by SIGTERM after saving its checkpoint */
+#define FMAP_READ   0		/* Modes of map_file(). Read only, the pages are shared with other processes */
+#define FMAP_WRITE  1		/* Create (or truncate) the file and map it read-write */
+#define FMAP_COPY   2		/* Writable, but the changes are private (copy on write) and never reach the file */
+#define DOM_ALIGN 4096		/* -Y. Each bathymetry of a domain file starts on a new memory page */
+#define IN_DOMAIN(nest,p) ((nest)->dom_map && (char *)(p) >= (nest)->dom_map && (char *)(p) < (nest)->dom_map + (nest)->dom_size)
+
+/* Bits of nest->kflags[lev]. They tell which of the options that the kernels test in the inner loop are on at each level */
+#define KF_CORIOLIS     1	/* -C */
+#define KF_FRICTION     2	/* Manning coefficient of this level != 0 */
+#define KF_VEL_X        4	/* Save the x velocity of this level */
+#define KF_VEL_Y        8	/* Save the y velocity of this level */
+#define KF_LONG_BEACH  16	/* Save the "long beach" mask of this level */
+#define KF_SHORT_BEACH 32	/* Save the "short beach" mask of this level */
+
+#if defined(_MSC_VER)
+#	define FORCE_INLINE __forceinline
+#elif defined(__GNUC__) || defined(__clang__)
+#	define FORCE_INLINE __attribute__((always_inline)) inline
+#else
+#	define FORCE_INLINE inline
+#endif
+
 #define ijs(i,j,n) ((i) + (j)*n)
 #define ijc(i,j) ((i) + (j)*n_ptmar)
 #define ij_grd(col,row,hdr) ((col) + (row)*hdr.nx)
 
 typedef void (*PFV) ();		/* PFV declares a pointer to a function returning void */
 
+/* Make a copy of the kernel BODY with its flag arguments frozen to constants, so that the compiler drops the tests
+   on them (and the dead branches) from the inner loop */
+#define KERNEL_VARIANT(name, body, ...) \
+static void name(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) { \
+	body(nest, lev, row_start, row_end, col_start, col_end, __VA_ARGS__); \
+}
+/* The 8 variants of a moment kernel, indexed by (Coriolis | friction << 1 | velocity << 2) */
+#define MOMENT_VARIANTS(name) \
+KERNEL_VARIANT(name##_v0, name##_body, 0, 0, 0)	KERNEL_VARIANT(name##_v1, name##_body, 1, 0, 0) \
+KERNEL_VARIANT(name##_v2, name##_body, 0, 1, 0)	KERNEL_VARIANT(name##_v3, name##_body, 1, 1, 0) \
+KERNEL_VARIANT(name##_v4, name##_body, 0, 0, 1)	KERNEL_VARIANT(name##_v5, name##_body, 1, 0, 1) \
+KERNEL_VARIANT(name##_v6, name##_body, 0, 1, 1)	KERNEL_VARIANT(name##_v7, name##_body, 1, 1, 1) \
+static PFV name##_variants[8] = {(PFV)name##_v0, (PFV)name##_v1, (PFV)name##_v2, (PFV)name##_v3, \
+                                 (PFV)name##_v4, (PFV)name##_v5, (PFV)name##_v6, (PFV)name##_v7};
+/* The 4 variants of a mass kernel, indexed by (long_beach | short_beach << 1) */
+#define MASS_VARIANTS(name) \
+KERNEL_VARIANT(name##_v0, name##_body, 0, 0)	KERNEL_VARIANT(name##_v1, name##_body, 1, 0) \
+KERNEL_VARIANT(name##_v2, name##_body, 0, 1)	KERNEL_VARIANT(name##_v3, name##_body, 1, 1) \
+static PFV name##_variants[4] = {(PFV)name##_v0, (PFV)name##_v1, (PFV)name##_v2, (PFV)name##_v3};
+
 struct tracers {        /* For tracers (oranges) */
 	double *x;          /* x coordinate */
 	double *y;          /* y coordinate */
@@ -225,28 +339,55 @@ struct nestContainer {         /* Container for the nestings */
 	int    out_momentum;       /* To know if save the momentum in the 3D netCDF grid. Mutually exclusive with out_velocity_x|y */
 	int    isGeog;             /* 0 == Cartesian, otherwise Geographic coordinates */
 	int    writeLevel;         /* Store info about which level is (if) to be writen [0] */
+	int    n_threads;          /* Number of threads among which the tiles of each grid are distributed */
+	struct thread_pool *pool;  /* Persistent worker threads (NULL when running single threaded) */
+	struct out_queue *out;     /* Queue of the background writer (NULL when the files are written by the main loop) */
+	char  *dom_map;            /* Map of the domain file whose pages are the bathymetries (NULL when they were read) */
+	size_t dom_size;
+	int    fused_openb;        /* Tell fused_sweep() to apply the open boundary condition */
+	int    simd_level;         /* 0 -> scalar moment kernels, 2 -> AVX2, 3 -> AVX-512 */
+	int    track_active;       /* If true, the kernels of level 0 only visit the box where the water is not at rest */
 	int    bnc_pos_nPts;       /* Number of points in a external boundary condition file */
 	int    bnc_var_nTimes;     /* Number of time steps in the external boundary condition file */
 	int    bnc_border[4];      /* Each will be set to TRUE if boundary condition on that border W->0, S->1, E->2, N->3 */
 	int    level[10];          /* 0 Will mean base level, others the nesting level */
+	int    parent[10];         /* Grid in which each nested grid is nested. Siblings share the same parent */
+	int    n_children[10];     /* Number of grids nested in each grid */
+	int    keeps_max[10];      /* TRUE if the sub-steps of this grid update the max grids of writeLevel */
+	int    n_nested;           /* Number of nested grids */
+	int    in_task;            /* TRUE while run_levels() runs siblings concurrently. Kernels then use one thread */
+	struct kaba_grid *kb;      /* Prisms of a -Fk grid computed concurrently (NULL when they go one after another) */
+	int    n_pack;             /* Number of scenarios in the state arrays, interleaved per node ([node][scenario]). Normally 1 */
+	int    new_state[10];      /* TRUE when the _d arrays hold a step that update() did not move to the _a ones yet */
+	int    asleep[10];         /* TRUE while a nested grid waits for the wave to reach its borders (-J+a) */
+	int    act_step[10];       /* Number of steps done since the active box tracking (re)started */
+	int    act_row0[10], act_row1[10], act_col0[10], act_col1[10];	/* Active box [row0, row1[ x [col0, col1[ */
+	int    kflags[10];         /* KF_* bits of each level. Pick the variant of the kernels. Set by kernel_flags() */
 	int    LLrow[10], LLcol[10], ULrow[10], ULcol[10], URrow[10], URcol[10], LRrow[10], LRcol[10];
 	int    incRatio[10];
 	short  *long_beach[10];    /* Mask arrays for storing the "dry beaches" */
 	short  *short_beach[10];   /* Mask arrays for storing the "dry beaches" */
+	unsigned char *cell_class[10];         /* CELL_DRY, CELL_COAST or CELL_DEEP. Set by classify_cells() */
+	int    *wet_first[10], *wet_last[10];  /* Per row span [first, last[ out of which all cells are permanent land */
 	float  *work, *wmax;       /* Auxiliary pointers (not direcly allocated) to compute max level of nested grids */
 	float  *vmax;              /* Pointer to array storing the max velocity */
 	double run_jump_time;      /* Time to hold before letting the nested grids start to iterate */
+	double wake_eta;           /* |eta| on the parent cells around a nested grid that lets it start to iterate. 0 -> always run */
 	double lat_min4Coriolis;   /* South latitute when computing the Coriolis effect on a cartesian grid */
 	double manning_depth;      /* Do not use manning if depth is deeper than this value */
+	double linear_depth;       /* Cells deeper than this go through the linear deep water kernels. 0 -> never */
+	double dt_base;            /* The -t time step. The adaptive steps of the base level are multiples of it */
+	int    adapt_dt;           /* Max multiple of dt_base that the base level step may grow to. 0 -> fixed dt */
 	double manning[10];        /* Manning coefficient. Set to zero if no friction */
 	double LLx[10], LLy[10], ULx[10], ULy[10], URx[10], URy[10], LRx[10], LRy[10];
 	double dt[10];                             /* Time step at current level               */
-	double *bat[10];                           /* Bathymetry of current level              */
-	double *fluxm_a[10],  *fluxm_d[10];        /* t-1/2 & t+1/2 fluxes arrays along X      */
-	double *fluxn_a[10],  *fluxn_d[10];        /* t-1/2 & t+1/2 fluxes arrays along Y      */
-	double *htotal_a[10], *htotal_d[10];       /* t-1/2 & t+1/2 total water depth         */
-	double *vex[10],  *vey[10];                /* X,Y velocity components                  */
-	double *etaa[10], *etad[10];               /* t-1/2 & t+1/2 water height (eta) arrays */
+	real   *bat[10];                           /* Bathymetry of current level              */
+	real   *fric[10];                          /* 4.9 * manning^2 of each node. NULL if no friction */
+	real   *fluxm_a[10],  *fluxm_d[10];        /* t-1/2 & t+1/2 fluxes arrays along X      */
+	real   *fluxn_a[10],  *fluxn_d[10];        /* t-1/2 & t+1/2 fluxes arrays along Y      */
+	real   *htotal_a[10], *htotal_d[10];       /* t-1/2 & t+1/2 total water depth         */
+	real   *vex[10],  *vey[10];                /* X,Y velocity components                  */
+	real   *etaa[10], *etad[10];               /* t-1/2 & t+1/2 water height (eta) arrays */
 	double *edge_col[10], *edge_colTmp[10];
 	double *edge_row[10], *edge_rowTmp[10];
 	double *edge_col_P[10], *edge_col_Ptmp[10];
@@ -262,6 +403,72 @@ struct nestContainer {         /* Container for the nestings */
 	struct grd_header hdr[10];
 };
 
+struct kaba_grid {             /* The prisms of a -Fk grid (or the -Fb scenarios) are independent runs. Compute n_lanes of them at a time */
+	int    n_lanes;            /* Number of prisms computed at the same time. Each has its own copy of the container */
+	int    first;              /* Number of the prism computed by lane 0 in the current batch */
+	int    n_runs;             /* Total number of prisms or scenarios */
+	int    n_pack;             /* Number of scenarios per lane (1, or SCEN_PACK with the packed kernels) */
+	int    n_cols;             /* Number of columns of the prisms grid */
+	int    type;               /* do_Kaba. See kaba_source() */
+	int    n_cycles, cumint;   /* Number of steps and the interval between maregraph samples */
+	int    n_samples;          /* Number of samples of each maregraph */
+	int    n_mareg, writeLevel;
+	int    do_fused;
+	int    *lane_id;           /* 0, 1, ..., n_lanes - 1. The LEVS argument of run_levels() */
+	unsigned int *lcum_p;      /* Linear indices of the maregraphs in the writeLevel grid */
+	real   **mar;              /* Maregraphs of the prism of each lane (of each scenario of a pack), one time after another */
+	double *fault;             /* -Fb. The 9 fault parameters (as in -F) of each scenario. NULL for the prisms */
+	double dt, dx, dy;
+	double x_min, x_max, y_min, y_max;   /* Limits of the first prism */
+	double x_inc, y_inc;       /* Steps between prisms */
+	struct srf_header hdr;     /* Header of the base grid (for kaba_source()) */
+	struct nestContainer *lane;
+};
+
+struct checkpoint {            /* -K|-I. Head of a checkpoint file. The state arrays follow (see checkpoint_io()) */
+	char   magic[8];           /* "NSWCHK01" */
+	int    real_size;          /* sizeof(real) of the exe that wrote it */
+	int    n_levels;           /* Base grid plus the nested grids */
+	int    nx[10], ny[10];
+	int    arrays[10];         /* CHK_VEX, ... bits of the optional arrays of each level */
+	int    contents;           /* CHK_WMAX, ... bits of the optional arrays of the run */
+	int    k;                  /* Next cycle to compute */
+	int    n_mareg, n_oranges;
+	unsigned int count_maregs, count_time_maregs;	/* Samples in the netCDF maregraphs buffers */
+	int    new_state[10], asleep[10], act_step[10];
+	int    act_row0[10], act_row1[10], act_col0[10], act_col1[10];
+	int64_t mareg_pos;         /* Length of the ascii maregraphs file */
+	double dt[10];
+	double time_h;
+};
+
+struct domain_head {           /* -Y. Head of a domain file. The bathymetries follow, each at a multiple of DOM_ALIGN */
+	char    magic[8];          /* "NSWDOM1" */
+	int     real_size;         /* sizeof(real) of the build that wrote it. The bathymetries are of that type */
+	int     n_grids;           /* Base grid plus the nested ones */
+	int     nx[10], ny[10];
+	int     parent[10];        /* Grid where each nested grid sits */
+	int     LLrow[10], LLcol[10], URrow[10], URcol[10];	/* Corners of each nested grid in its parent */
+	double  x_min[10], x_max[10], y_min[10], y_max[10], z_min[10], z_max[10], x_inc[10], y_inc[10];
+	int64_t offset[10];        /* Position in the file of the bathymetry of each grid (positive down) */
+	int64_t off_class[10];     /* -Y+c only (0 otherwise). Cell classes, wet spans (wet_first then wet_last) */
+	int64_t off_wet[10];       /* and friction factors of each grid, as classify_cells() and friction_factor() */
+	int64_t off_fric[10];      /* left them */
+	uint64_t key;              /* -Y+c only. Hash of the inputs (that also names the file) */
+	int     n_inputs;          /* and size of each input file, checked too before a cache is used */
+	int64_t in_size[24];
+};
+
+struct ascii_chunk {           /* A piece of the values of a DSAA grid, cut at a line end (see read_grd_ascii) */
+	char   *p0, *p1;           /* First and one past the last byte of the piece */
+	size_t  first;             /* Index in WORK of its first value */
+	size_t  n;                 /* Number of values in it */
+	size_t  nm;                /* Size of WORK. Values past it are ignored */
+	int     counting;          /* TRUE -> only count the values. FALSE -> convert them into WORK */
+	int     sign;
+	real   *work;
+};
+
 /* Argument struct for threading */
 typedef struct {
 	struct nestContainer *nest;   /* Pointer to a nestContainer struct */
@@ -269,45 +476,168 @@ typedef struct {
 	int lev;                      /* Level of nested grid */
 } ThreadArg;
 
+#if defined(DO_MULTI_THREAD) || defined(DO_ASYNC_WRITE)
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+#		define MUTEX_T             CRITICAL_SECTION
+#		define COND_T              CONDITION_VARIABLE
+#		define THREAD_T            HANDLE
+#		define MUTEX_LOCK(m)       EnterCriticalSection(m)
+#		define MUTEX_UNLOCK(m)     LeaveCriticalSection(m)
+#		define COND_WAIT(c, m)     SleepConditionVariableCS(c, m, INFINITE)
+#		define COND_SIGNAL(c)      WakeConditionVariable(c)
+#		define COND_BROADCAST(c)   WakeAllConditionVariable(c)
+#		define ATOMIC_NEXT(p)      (InterlockedIncrement(p) - 1)
+#	else
+#		define MUTEX_T             pthread_mutex_t
+#		define COND_T              pthread_cond_t
+#		define THREAD_T            pthread_t
+#		define MUTEX_LOCK(m)       pthread_mutex_lock(m)
+#		define MUTEX_UNLOCK(m)     pthread_mutex_unlock(m)
+#		define COND_WAIT(c, m)     pthread_cond_wait(c, m)
+#		define COND_SIGNAL(c)      pthread_cond_signal(c)
+#		define COND_BROADCAST(c)   pthread_cond_broadcast(c)
+#		define ATOMIC_NEXT(p)      __sync_fetch_and_add(p, 1)
+#	endif
+#endif
+
+#ifdef DO_MULTI_THREAD
+/* Worker threads created once in main() and parked between the calls to run_tiles() */
+struct thread_pool {
+	int       n_workers;          /* Number of workers. The calling thread also computes tiles so this is n_threads - 1 */
+	int       n_pending;          /* Number of workers that did not finish the current job yet */
+	int       lev;                /* Level of the grid of the current job */
+	int       n_tiles, n_tiles_x; /* Total number of tiles and number of tiles along x of the current job */
+	int       tile_ny, tile_nx;   /* Tiles size of the current job */
+	volatile long next_tile;      /* Next tile to be computed. Threads grab tiles from it until they are exhausted */
+	PFV       kernel;             /* Function of the current job */
+	int       *task_lev;          /* If not NULL, the job is KERNEL(nest, task_lev[i]) for each i < n_tiles (see run_levels) */
+	int       generation;         /* Incremented at each new job so that parked workers know they have work */
+	int       quit;               /* Set to TRUE to tell the workers to exit */
+	MUTEX_T   lock;
+	COND_T    work_ready;         /* Signaled by run_rows() when a new job is posted */
+	COND_T    work_done;          /* Signaled by the last worker to finish a job */
+	THREAD_T  threads[MAX_THREADS];
+	ThreadArg args[MAX_THREADS];
+};
+#endif
+
+#ifdef DO_ASYNC_WRITE
+#define OUT_GRD    0			/* Kinds of output jobs. A Surfer grid (write_grd_bin) */
+#define OUT_VARA   1			/* A slice of a netCDF float variable */
+#define OUT_VARA_D 2			/* One value of a netCDF double variable (the time of a slice) */
+
+/* An output job. The main loop copies what is to be written into BUF and the writer thread does the I/O */
+struct out_job {
+	int     kind;               /* One of OUT_GRD, OUT_VARA or OUT_VARA_D */
+	int     ncid, varid;        /* netCDF file and variable of the OUT_VARA* jobs */
+	size_t  start[3], count[3];
+	double  value;              /* The value of an OUT_VARA_D job */
+	char    name[256];          /* File name of an OUT_GRD job */
+	double  x_min, y_min, x_inc, y_inc;
+	unsigned int nx, ny;        /* Size of an OUT_GRD job. BUF holds only those nodes */
+	size_t  n_alloc;            /* Allocated size of BUF. The buffers are reused by the following jobs of the slot */
+	float  *buf;
+};
+
+/* Ring of OUT_SLOTS jobs between the main loop and the writer thread. When it is full the main loop waits */
+struct out_queue {
+	int     head;               /* Slot of the next job to be posted */
+	int     tail;               /* Slot of the job being written */
+	int     n_queued;           /* Number of jobs posted and not yet written */
+	int     quit;               /* Set to TRUE to tell the writer to exit once the queue is empty */
+	MUTEX_T lock;
+	COND_T  posted;             /* Signaled when a job is posted */
+	COND_T  written;            /* Signaled when a job is written */
+	THREAD_T thread;
+	struct out_job jobs[OUT_SLOTS];
+};
+#endif
+
 void no_sys_mem(char *where, unsigned int n);
 int  count_col(char *line);
 int  read_grd_info_ascii(char *file, struct srf_header *hdr);
 int  read_header_bin (FILE *fp, struct srf_header *hdr);
 int  write_grd_bin(char *name, double x_min, double y_min, double x_inc, double y_inc, unsigned int i_start, 
                    unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work);
-int  read_grd_ascii (char *file, struct srf_header *hdr, double *work, int sign);
-int  read_grd_bin(char *file, struct srf_header *hdr, double *work, int sign);
+void *map_file(char *name, size_t *size, int mode);
+void unmap_file(void *p, size_t size);
+int  write_domain(char *file, struct nestContainer *nest, int nNg, struct domain_head *K);
+int  read_domain(char *file, struct nestContainer *nest, struct srf_header *hdr, struct domain_head *K);
+int  check_domain(struct nestContainer *nest, int nNg);
+uint64_t hash_file(char *name, uint64_t h, struct domain_head *K);
+uint64_t hash_bytes(const void *p, size_t n, uint64_t h);
+void write_cache(char *file, struct nestContainer *nest, int nNg, struct domain_head *K);
+int  read_grd_ascii (char *file, struct srf_header *hdr, real *work, int sign);
+void ascii_chunk(struct ascii_chunk *C);
+void run_ascii_chunks(struct ascii_chunk *C, int n);
+double ascii_value(char *p, char *end);
+int  read_grd_bin(char *file, struct srf_header *hdr, real *work, int sign);
 int  read_maregs(struct grd_header hdr, char *file, unsigned int *lcum_p, char *names[]);
+int  read_scenarios(char *file, double **fault, char ***names);
+void write_maregs_header(FILE *fp, struct nestContainer *nest, unsigned int *lcum_p, char *names[], int n_mareg, int lev);
+int  run_scenarios(struct nestContainer *nest, struct kaba_grid *kb, int n_scen, char *scen_names[],
+                   char *mareg_names[], char *fname, char hist[], int out_nc, float *work, double *t);
 int  read_tracers(struct grd_header hdr, char *file, struct tracers *oranges);
 int  count_n_maregs(char *file);
 int  decode_R(char *item, double *w, double *e, double *s, double *n);
 int  check_region(double w, double e, double s, double n);
 double ddmmss_to_degree (char *text);
-void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d, double *etad, struct nestContainer *nest);
+void openb(struct grd_header hdr, real *bat, real *fluxm_a, real *fluxn_a, real *etad, struct nestContainer *nest);
+void openb_rows(struct grd_header hdr, real *bat, real *fluxm_a, real *fluxn_a, real *etad, struct nestContainer *nest,
+                int row_start, int row_end);
+void openb_strided(struct grd_header hdr, real *bat, real *fluxm_a, real *fluxn_a, real *etad, struct nestContainer *nest,
+                   int row_start, int row_end, int stride, int s);
 void wave_maker(struct nestContainer *nest);
 void wall_it(struct nestContainer *nest);
 void wall_two(struct nestContainer *nest, int ot1, int ot2, int in1, int in2);
 int  initialize_nestum(struct nestContainer *nest, int isGeog, int lev);
+int  classify_cells(struct nestContainer *nest, int lev);
+int  kernel_flags(struct nestContainer *nest, int lev);
+int  friction_factor(struct nestContainer *nest, int lev, char *fname);
 int  intp_lin (double *x, double *y, int n, int m, double *u, double *v);
 void inisp(struct nestContainer *nest);
 void inicart(struct nestContainer *nest);
-void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2, char *what, int lev, int i_time);
+void interp_edges(struct nestContainer *nest, real *flux_L1, real *flux_L2, char *what, int lev, int i_time);
 void sanitize_nestContainer(struct nestContainer *nest);
 void nestify(struct nestContainer *nest, int nNg, int recursionLevel, int isGeog);
+void nestify_children(struct nestContainer *nest, int nNg, int lev_P, int isGeog);
+void nestify_task(struct nestContainer *nest, int lev);
+void nest_family(struct nestContainer *nest, int nNg);
+void run_levels(PFV task, struct nestContainer *nest, int *levs, int n);
 void resamplegrid(struct nestContainer *nest, int nNg);
+void resample_level(struct nestContainer *nest, int lev);
+int  wave_near_nest(struct nestContainer *nest, int lev, real *eta, int whole);
+void nest_sleep(struct nestContainer *nest, int nNg);
 void edge_communication(struct nestContainer *nest, int lev, int i_time);
-void mass(struct nestContainer *nest, int lev);
-void mass_sp(struct nestContainer *nest, int lev);
+void mass(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void mass_sp(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void run_tiles(PFV kernel, struct nestContainer *nest, int lev);
+void run_blocks(PFV kernel, struct nestContainer *nest, int lev, int tile_ny, int tile_nx);
+void run_tile(PFV kernel, struct nestContainer *nest, int lev, int tile, int n_tiles_x, int tile_ny, int tile_nx);
+void fused_conservation(struct nestContainer *nest, int m, int with_openb);
+void fused_sweep(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void fused_seams(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
 void mass_conservation(struct nestContainer *nest, int isGeog, int m);
 void moment_conservation(struct nestContainer *nest, int isGeog, int m);
 void update(struct nestContainer *nest, int lev);
-void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr);
-void upscale_(struct nestContainer *nest, double *out, int lev, int i_tsr);
+void active_region(struct nestContainer *nest, int lev);
+double cfl_time_step(struct nestContainer *nest, int lev, int row0, int row1, int col0, int col1);
+int  adapt_time_step(struct nestContainer *nest, int max_mult);
+void upscale(struct nestContainer *nest, real *out, int lev, int i_tsr);
+void upscale_(struct nestContainer *nest, real *out, int lev, int i_tsr);
 void replicate(struct nestContainer *nest, int lev);
-void moment_M(struct nestContainer *nest, int lev);
-void moment_N(struct nestContainer *nest, int lev);
-void moment_sp_M(struct nestContainer *nest, int lev);
-void moment_sp_N(struct nestContainer *nest, int lev);
+void moment_M(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_N(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_sp_M(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_M_simd(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_N_simd(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_M_split(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_N_split(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void mass_pack(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_M_pack(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+void moment_N_pack(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
+int  GetSIMDLevel(void);
+void moment_sp_N(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end);
 void free_arrays(struct nestContainer *nest, int isGeog, int lev);
 int  check_paternity(struct nestContainer *nest);
 int  check_binning(double x0P, double x0D, double dxP, double dxD, double tol, double *suggest);
@@ -318,15 +648,29 @@ void power(struct nestContainer *nest, float *work, int lev);
 void vtm (double lat0, double *t_c1, double *t_c2, double *t_c3, double *t_c4, double *t_e2, double *t_M0);
 void deform (struct srf_header hdr, double x_inc, double y_inc, int isGeog, double fault_length,
              double fault_width, double th, double dip, double rake, double d, double top_depth,
-             double xl, double yl, double *z);
+             double xl, double yl, real *z);
 void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min, double x_max,
-	             double y_min, double y_max, int type, double *z);
+	             double y_min, double y_max, int type, real *z);
+void kaba_reset(struct nestContainer *nest, int nNg);
+int  kaba_lanes(struct nestContainer *nest, struct kaba_grid *kb);
+void kaba_lanes_free(struct kaba_grid *kb);
+int  checkpoint_rw(FILE *fp, void *p, size_t n, int writing);
+int  checkpoint_io(FILE *fp, struct nestContainer *nest, int nNg, struct checkpoint *chk, float *wmax, float *vmax,
+                   float *maregs, double *maregs_t, struct tracers *oranges, int writing);
+void checkpoint_head(struct nestContainer *nest, int nNg, struct checkpoint *chk);
+int  write_checkpoint(char *file, struct nestContainer *nest, int nNg, struct checkpoint *chk, float *wmax,
+                      float *vmax, float *maregs, double *maregs_t, struct tracers *oranges);
+int  read_checkpoint(char *file, struct nestContainer *nest, int nNg, struct checkpoint *chk, float *wmax,
+                     float *vmax, float *maregs, double *maregs_t, struct tracers *oranges);
+void checkpoint_signal(int sig);
+void kaba_lane(struct nestContainer *nest, int i);
+void pack_lane(struct nestContainer *nest, int i);
 void tm (double lon, double lat, double *x, double *y, double central_meridian, double t_c1,
          double t_c2, double t_c3, double t_c4, double t_e2, double t_M0);
 double uscal(double x1, double x2, double x3, double c, double cc, double dp);
 double udcal(double x1, double x2, double x3, double c, double cc, double dp);
 unsigned int gmt_bcr_prep (struct grd_header hdr, double xx, double yy, double wx[], double wy[]);
-double GMT_get_bcr_z(double *grd, struct grd_header hdr, double xx, double yy);
+double GMT_get_bcr_z(real *grd, struct grd_header hdr, double xx, double yy);
 void update_max(struct nestContainer *nest);
 void update_max_velocity(struct nestContainer *nest);
 
@@ -347,19 +691,40 @@ int write_maregs_nc(struct nestContainer *nest, char *fname, float *work, double
 int write_greens_nc(struct nestContainer *nest, char *fname, float *work, size_t *start, size_t *count,
                     double *t, unsigned int *lcum_p, char *names[], char hist[], int *ids, int n_maregs,
                     unsigned int n_times, int lev);
+int synth_greens(char *arg, int verbose);
 void err_trap_(int status);
 #endif
 
-#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
 /* Prototypes for threading related functions */
-unsigned __stdcall MT_cart(void *Arg_p);
-unsigned __stdcall MT_sp(void *Arg_p);
+#ifdef DO_MULTI_THREAD
+void pool_worker(ThreadArg *Arg);
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+unsigned __stdcall MT_rows(void *Arg_p);
+#	else
+void *MT_rows(void *Arg_p);
+#	endif
+#endif
 int GetLocalNThread(void);
+void start_pool(struct nestContainer *nest);
+void stop_pool(struct nestContainer *nest);
+#ifdef DO_ASYNC_WRITE
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+unsigned __stdcall out_writer(void *Arg_p);
+#	else
+void *out_writer(void *Arg_p);
+#	endif
+struct out_job *out_slot(struct out_queue *q, size_t n);
+void out_post(struct out_queue *q);
+#endif
+void start_writer(struct nestContainer *nest);
+void stop_writer(struct nestContainer *nest);
+void out_sync(struct nestContainer *nest);
+void out_grd(struct nestContainer *nest, char *name, double x_min, double y_min, double x_inc, double y_inc,
+             unsigned int i_start, unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work);
+#ifdef HAVE_NETCDF
+void out_vara(struct nestContainer *nest, int ncid, int varid, int ndims, size_t *start, size_t *count, float *work);
+void out_vara_d(struct nestContainer *nest, int ncid, int varid, size_t start, double value);
 #endif
-
-/* Function pointers to M & N moment components */
-PFV call_moment[2];
-PFV call_moment_sp[2];
 
 int Return(int code) {		/* To handle return codes between MEX and standalone code */
 #ifdef I_AM_MEX
@@ -380,7 +745,7 @@ int main(int argc, char **argv) {
 #endif
 
 	int     writeLevel = 0;              /* If save grids, will hold the saving level (when nesting) */
-	int     i, j, k, n;
+	int     i, j, k, n, k_stop, n_step;
 	int     start_i;                     /* Where the loop over argc starts: MEX -> 0; STANDALONE -> 1 */
 	int     grn = 0, cumint = 0, decimate_max = 1, iprc, r_bin_b, r_bin_f, r_bin_mM, r_bin_mN;
 	int     w_bin = TRUE, cumpt = FALSE, error = FALSE, do_2Dgrids = FALSE, do_maxs = FALSE;
@@ -395,20 +760,25 @@ int main(int argc, char **argv) {
 	int     do_HotStart = FALSE;         /* For when doing a Hot Start */
 	int     n_arg_no_char = 0;
 	int     ncid, ncid_most[3], z_id = -1, ids[13], ids_ha[6], ids_ua[6], ids_va[6], ids_most[3];
-	int     ncid_3D[3], ids_z[10], ids_3D[3], ncid_Mar, ids_Mar[8];
+	int     ncid_3D[3], ids_z[10], ids_3D[3], ncid_Mar = 0, ids_Mar[8];
 	int     n_of_cycles = 1010;          /* Default number of cycles to compute */
 	int     num_of_nestGrids = 0;        /* Number of nesting grids */
 	int     bat_in_input = FALSE, source_in_input = FALSE, write_grids = FALSE, isGeog = FALSE;
 	int     maregs_in_input = FALSE, out_momentum = FALSE, got_R = FALSE;
+	int     exit_code = 0;               /* CHK_STOPPED when a SIGTERM stopped the run */
+	int     dom_grids = 0;               /* Number of grids in the domain file given as bathymetry (0 if a grid) */
+	int     dom_cached = FALSE;          /* The domain, with its tables, came from the -Y+c cache */
 	int     with_land = FALSE, IamCompiled = FALSE, do_nestum = FALSE, saveNested = FALSE, verbose = FALSE;
+	int     do_fused = FALSE;
 	int     out_velocity = FALSE, out_velocity_x = FALSE, out_velocity_y = FALSE, out_velocity_r = FALSE;
 	int     out_maregs_velocity = FALSE;
 	int     KbGridCols = 1, KbGridRows = 1; /* Number of rows & columns IF computing a grid of 'Kabas' */
+	int     kb_lanes = 1;                /* Number of 'Kabas' of the grid computed at the same time */
 	int     cntKabas = 0;                /* Counter of the number of Kabas (prisms) already processed */
-	int     n_mareg, n_ptmar, n_oranges, pos_prhs;
+	int     n_mareg = 0, n_ptmar, n_oranges, pos_prhs;
 	unsigned int *lcum_p = NULL, lcum = 0, ij, nx, ny;
 	unsigned int i_start, j_start, i_end, j_end, count_maregs_timeout = 0, count_time_maregs_timeout = 0;
-	size_t	start0 = 0, count0 = 1, len, start1_A[2] = {0,0}, count1_A[2];
+	size_t	start0 = 0, len, start1_A[2] = {0,0}, count1_A[2];
 	size_t  start1_M[3] = {0,0,0}, count1_M[3], start_Mar[3] = {0,0,0}, count_Mar[2];
 	char   *bathy   = NULL;              /* Name pointer for bathymetry file */
 	char   	hcum[256]   = "";            /* Name of the cumulative hight file */
@@ -419,13 +789,20 @@ int main(int argc, char **argv) {
 	char   *fname3D  = NULL;             /* Name pointer for the 3D netCDF file */
 	char   *fonte    = NULL;             /* Name pointer for tsunami source file */
 	char   *bnc_file = NULL;             /* Name pointer for a boundary condition file */
+	char   *dom_out  = NULL;             /* Name pointer for the -Y domain file to write */
+	char   *cache_dir = NULL;            /* -Y+c directory of the domain cache */
+	char    cache_file[1024] = "";       /* Cache file of this domain, named after the hash of its inputs */
+	struct domain_head dom_key;          /* The key of that cache (hash and sizes of the inputs) */
 	char    fname_mask_lbeach[256] = ""; /* Name pointer for the "long_beach" mask grid */
 	char    fname_mask_sbeach[256] = ""; /* Name pointer for the "short_beach" mask grid */
 	char    tracers_infile[256] = "", tracers_outfile[256] = "";	/* Names for in and out tracers files */
 	char    stem[256] = "", prenome[128] = "", str_tmp[128] = "", fname_momentM[256] = "", fname_momentN[256] = "";
 	char    history[512] = {""};         /* To hold the full command call to be saved in nc files as History */
-	char   *pch;
+	char   *pch, *ntoken, *endp;
 	char   *nesteds[10] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+	char   *fname_manning[10] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};	/* Grids of Manning coeffs */
+	char   *str_manning = NULL;          /* Copy of the -X argument */
+	int     n_manning = 0;               /* Number of coefficients (or grids) in it */
 	char    txt[128];                    /* Auxiliary variable */
 
 	float  *work = NULL, *workMax = NULL, *vmax = NULL, *wmax = NULL, *time_p = NULL;
@@ -437,9 +814,16 @@ int main(int argc, char **argv) {
 	double  time_jump = 0, time0, time_for_anuga, prc;
 	double  dt = 0;                     /* Time step for Base level grid */
 	double  dx, dy, ds, dtCFL, etam, one_100, t;
-	double *eta_for_maregs, *vx_for_maregs, *vy_for_maregs, *htotal_for_maregs, *fluxm_for_maregs, *fluxn_for_maregs;
-	double *vx_for_oranges, *vy_for_oranges, *fluxm_for_oranges, *fluxn_for_oranges, *htotal_for_oranges;	/* For tracers */
+	real   *eta_for_maregs, *vx_for_maregs, *vy_for_maregs, *htotal_for_maregs, *fluxm_for_maregs, *fluxn_for_maregs;
+	real   *vx_for_oranges, *vy_for_oranges, *fluxm_for_oranges, *fluxn_for_oranges, *htotal_for_oranges;	/* For tracers */
 	double  f_dip, f_azim, f_rake, f_slip, f_length, f_width, f_topDepth, x_epic, y_epic;	/* For Okada initial condition */
+	double *scen_fault = NULL;           /* -Fb. The 9 fault parameters of each scenario */
+	char   *scen_file = NULL, **scen_names = NULL;
+	char   *greens_arg = NULL;
+	char   *chk_file = NULL, *chk_resume = NULL;	/* -K and -I checkpoint files */
+	int     chk_int = 0, k_first = 0, k_chk = 0;	/* -K interval, first cycle and cycle of the last checkpoint */
+	struct  checkpoint chk;
+	int     n_scen = 0;                  /* Number of -Fb scenarios */
 	double  add_const = 0, time_h = 0;
 	double  dxKb = 0, dyKb = 0;         /* Grid steps for when computing a grid of 'Kabas' */
 	double  z_offset = 0;	/* To apply to bathymetry to simulate a tide */
@@ -462,20 +846,16 @@ int main(int argc, char **argv) {
 #endif
 	clock_t tic;
 
-	call_moment[0] = (PFV)moment_M;
-	call_moment[1] = (PFV)moment_N;
-	call_moment_sp[0] = (PFV)moment_sp_M;
-	call_moment_sp[1] = (PFV)moment_sp_N;
+	sanitize_nestContainer(&nest);
+	nest.simd_level = GetSIMDLevel();
 
-#ifdef DO_MULTI_THREAD
-	if ((k = GetLocalNThread()) == 1) {
+#if defined(DO_MULTI_THREAD) || HAVE_OPENMP
+	if ((nest.n_threads = GetLocalNThread()) == 1) {
 		mexPrintf("NSWING: This version of the program is build for multi-threading but "
 		           "this machine has only one core. Don't know what will happen here.\n"); 
 	}
 #endif
 
-	sanitize_nestContainer(&nest);
-
 #ifdef I_AM_MEX
 	argc = nrhs;
 	for (i = 0; i < nrhs; i++) {		/* Check input to find how many arguments are of type char */
@@ -539,7 +919,7 @@ int main(int argc, char **argv) {
 			nest.hdr[k+1].x_inc = head[7];		nest.hdr[k+1].y_inc = head[8];
 
 			nm = nest.hdr[k+1].nx * nest.hdr[k+1].ny;
-			if ((nest.bat[k+1] = (double *)mxCalloc((size_t)nm, sizeof(double)) ) == NULL) 
+			if ((nest.bat[k+1] = (real *)mxCalloc((size_t)nm, sizeof(real)) ) == NULL) 
 				{no_sys_mem("(bat)", nm); Return(-1);}
 			for (i = 0; i < nest.hdr[k+1].ny; i++) {
 				for (j = 0; j < nest.hdr[k+1].nx; j++)
@@ -711,6 +1091,17 @@ int main(int argc, char **argv) {
 							mxFree(lost_str2);
 						}
 					}
+					else if (argv[i][2] == 'b') {	/* A batch of fault scenarios, one per line of this file */
+						scen_file = &argv[i][3];
+						do_Okada  = TRUE;
+					}
+					else if (argv[i][2] == 'g') {	/* Sum the Green's functions of a -Fk file. No simulation */
+						greens_arg = &argv[i][3];
+#ifndef HAVE_NETCDF
+						mexPrintf("NSWING: Error, -Fg needs the netCDF file of -Fk but this exe was not linked to netCDF.\n");
+						error++;
+#endif
+					}
 					else {
 						do_Okada = TRUE;
 						n = sscanf(&argv[i][2], "%lf/%lf/%lf/%lf/%lf/%lf/%lf/%lf/%lf", 
@@ -733,6 +1124,10 @@ int main(int argc, char **argv) {
 						grn = atoi(&pch[1]);
 						pch[0] = '\0';		/* Strip the ",num" part */
 					}
+					if (argv[i][1] == 'G' && (pch = strstr(stem,"+m")) != NULL) {
+						grd_mmap = TRUE;	/* Write the grids through a memory mapping */
+						memmove(pch, &pch[2], strlen(&pch[2]) + 1);
+					}
 					if ((pch = strstr(stem,"+")) != NULL) {
 						writeLevel = atoi(pch++);
 						if (writeLevel < 0) writeLevel = 0;
@@ -749,6 +1144,16 @@ int main(int argc, char **argv) {
 							strcat(fname3D, ".nc");		/* If no 2 or 3 letters extension, add .nc */
 					}
 					break;
+				case 'I':	/* Resume the run that wrote this -K checkpoint */
+					chk_resume = &argv[i][2];
+					break;
+				case 'K':	/* Checkpoint file and interval */
+					chk_file = strdup(&argv[i][2]);		/* A copy because the ,<int> is cut off */
+					if ((pch = strrchr(chk_file, ',')) != NULL) {
+						chk_int = atoi(&pch[1]);
+						pch[0] = '\0';
+					}
+					break;
 				case 'H':	/* Hot start stuff */
 					if (!argv[i][2])					/* Output momentum grids */
 						out_momentum = TRUE;
@@ -772,11 +1177,18 @@ int main(int argc, char **argv) {
 						}
 					}
 					break;
-				case 'J':	/* Jumping options. Accept either -Jn, -J+m, -Jn+m or -Jn -J+m */
+				case 'J':	/* Jumping options. Accept either -Jn, -J+m, -Jn+m or -Jn -J+m. Or +a[<eta>] for the m */
 					sscanf(&argv[i][2], "%s", str_tmp);
 					if ((pch = strstr(str_tmp,"+")) != NULL) {
-						sscanf((++pch), "%lf", &nest.run_jump_time);
-						pch--;
+						if (pch[1] == 'a') {	/* Start each nested grid when the wave gets near its borders */
+							nest.wake_eta = (pch[2]) ? atof(&pch[2]) : 0.001;
+							if (nest.wake_eta <= 0) {
+								mexPrintf("NSWING: Error -J option. The wave height of +a<eta> must be > 0\n");
+								error++;
+							}
+						}
+						else
+							sscanf(&pch[1], "%lf", &nest.run_jump_time);
 						pch[0] = '\0';		/* Put the string end where before was the '+' char */
 					}
 					if (argv[i][2])
@@ -824,6 +1236,9 @@ int main(int argc, char **argv) {
 					else
 						max_level = TRUE;
 					break;
+				case 'P':	/* Fuse mass and moment computations in one single pass */
+					do_fused = TRUE;
+					break;
 				case 'N':	/* Number of cycles to compute */
 					n_of_cycles = atoi(&argv[i][2]);
 					break;
@@ -890,7 +1305,14 @@ int main(int argc, char **argv) {
 					break;
 				case 't':	/* Time step of simulation */ 
 					dt = atof(&argv[i][2]);
-					nest.dt[0] = dt;
+					nest.dt[0] = nest.dt_base = dt;
+					if ((pch = strstr(&argv[i][2], "+a")) != NULL) {	/* Adaptive time step */
+						nest.adapt_dt = (pch[2]) ? atoi(&pch[2]) : 8;
+						if (nest.adapt_dt < 2) {
+							mexPrintf("NSWING: Error -t option. The maximum growth of the time step must be > 1\n");
+							error++;
+						}
+					}
 					break;
 				case 'T':	/* File with time interval (n steps), maregraph positions and optional output fname */
 					if (cumpt) {
@@ -931,29 +1353,36 @@ int main(int argc, char **argv) {
 					}
 #endif
 					break;
-				case 'X':		/* Manning coeffs */
-					k = 0;
-					sscanf(&argv[i][2], "%s", str_tmp);
-					if ((pch = strstr(str_tmp,"+")) != NULL) {
+				case 'Y':		/* Save the bathymetries in a domain file to give in place of the grids later */
+					if (!strncmp(&argv[i][2], "+c", 2))		/* Or keep the whole domain in a cache directory */
+						cache_dir = &argv[i][4];
+					else
+						dom_out = &argv[i][2];
+					if ((dom_out && !dom_out[0]) || (cache_dir && (!cache_dir[0] || strlen(cache_dir) > 990))) {
+						mexPrintf("NSWING: Error, -Y option, the name of the domain file or cache directory is missing (or too long)\n");
+						error++;
+					}
+					break;
+				case 'X':		/* Manning coeffs, or names of grids with one coefficient per node */
+					str_manning = strdup(&argv[i][2]);	/* Keep it. fname_manning[] will point inside it */
+					if ((pch = strstr(str_manning,"+")) != NULL) {
 						nest.manning_depth = -atof(++pch);	/* Reverse sense right away because bat will be pos down */
 						pch--;	pch[0] = '\0';		/* Remove traces of this option in string */
 					}
-					if ((pch = strstr(str_tmp,",")) != NULL) {
-						char t[16] = "";
-						pch[0] = '\0';
-						nest.manning[k++] = atof(str_tmp);
-						strcpy(t, ++pch);
-						while ((pch = strstr(t,",")) != NULL) {
-							pch[0] = '\0';
-							nest.manning[k++] = atof(t);
-							strcpy(t, ++pch);
+					k = 0;
+					pch = (char *)strtok_s(str_manning, ",", &ntoken);
+					while (pch != NULL && k < 10) {
+						nest.manning[k] = strtod(pch, &endp);
+						if (endp == pch || *endp != '\0') {	/* Not a number, so take it as a grid name */
+							fname_manning[k] = pch;
+							nest.manning[k] = 1;		/* Only says that this level has friction */
 						}
-						nest.manning[k] = atof(t);	/* Last one doesn't end with a comma so was skipped above */
+						k++;
+						pch = (char *)strtok_s(NULL, ",", &ntoken);
 					}
-					else
-						nest.manning[k] = atof(&argv[i][2]);
 
-					if (k == 0)			/* Only one set. Replicate it to the others (being used or not) */
+					n_manning = k;
+					if (k == 1 && !fname_manning[0])	/* Only one coefficient. Replicate it to the others (being used or not) */
 						for (n = 1; n < 10; n++)
 							nest.manning[n] = nest.manning[0];
 					break;
@@ -963,6 +1392,13 @@ int main(int argc, char **argv) {
 				case 'V':
 					verbose = TRUE;
 					break;
+				case 'W':	/* Linear approximation in water deeper than this */
+					nest.linear_depth = (argv[i][2]) ? atof(&argv[i][2]) : DEEP_WATER;
+					if (nest.linear_depth <= 0) {
+						mexPrintf("NSWING: Error, -W option, the depth must be positive\n");
+						error++;
+					}
+					break;
 				case '1':
 					nesteds[0] = &argv[i][2];
 					break;
@@ -1005,18 +1441,24 @@ int main(int argc, char **argv) {
 #endif
 
 #ifdef I_AM_MEX
-		mexPrintf("nswing(bat,hdr_bat,deform,hdr_deform, [-1<bat_lev1>], [-2<bat_lev2>], [-3<...>] [maregs], [-G|Z<name>[+lev],<int>],\n");
+		mexPrintf("nswing(bat,hdr_bat,deform,hdr_deform, [-1<bat_lev1>], [-2<bat_lev2>], [-3<...>] [maregs], [-G|Z<name>[+lev][+m],<int>],\n");
 		mexPrintf("       [-A<fname.sww>], [-B<BCfile>], [-C], [-D], [-E[p][m][,decim]], [-Fdip/strike/rake/slip/length/width/topDepth/x_epic/y_epic],\n");
-		mexPrintf("       [-Fk[c]<w/e/s/n>], [-H], [-H<momentM,momentN>[,t]], [-J<time_jump>[+run_time_jump]], [-L[name1,name2]],,\n");
-		mexPrintf("       [-M[-|+[<maskname>]]], [-N<n_cycles>], [-R<w/e/s/n>], [-S[x|y|n][+m][+s]], [-O<int>,<outmaregs>],\n");
-		mexPrintf("       [-Q<z_offset>], [-S[x|y|n][+m][+s]], [-T<int>,<mareg>[,<outmaregs[+n]>]], [-X<manning0[,...]>] -t<dt> [-f]\n");
+		mexPrintf("       [-Fb<scenarios>], [-Fg<greens.nc>,<heights>[,<out>][+m]], [-Fk[c]<w/e/s/n>], [-H], [-H<momentM,momentN>[,t]], [-I<chkfile>],\n");
+		mexPrintf("       [-J<time_jump>[+run_time_jump|+a[<eta>]]], [-K<chkfile>[,<int>]], [-L[name1,name2]],\n");
+		mexPrintf("       [-M[-|+[<maskname>]]], [-N<n_cycles>], [-P], [-R<w/e/s/n>], [-S[x|y|n][+m][+s]], [-O<int>,<outmaregs>],\n");
+		mexPrintf("       [-Q<z_offset>], [-S[x|y|n][+m][+s]], [-T<int>,<mareg>[,<outmaregs[+n]>]], [-W[<depth>]], [-X<manning0|grid0[,...]>], [-Y<domain>|+c<dir>] -t<dt>[+a[<n>]] [-f]\n");
 #else
-		mexPrintf("nswing bathy.grd initial.grd [-1<bat_lev1>] [-2<bat_lev2>] [-3<...>] [-G|Z<name>[+lev],<int>] [-A<fname.sww>]\n");
+		mexPrintf("nswing bathy.grd initial.grd [-1<bat_lev1>[,...]] [-2<bat_lev2>[,...]] [-3<...>] [-G|Z<name>[+lev][+m],<int>] [-A<fname.sww>]\n");
 		mexPrintf("       [-B<BCfile>] [-C] [-D] [-E[p][m][,decim]] [-Fdip/strike/rake/slip/length/width/topDepth/x_epic/y_epic]\n"); 
-		mexPrintf("       [-Fk[c]<w/e/s/n>] [-H] [-H<momentM,momentN>[,t]] [-J<time_jump>[+run_time_jump]] [-L[name1,name2]]\n");
-		mexPrintf("       [-M[-|+[<maskname>]]] [-N<n_cycles>] [-R<w/e/s/n>] [-S[x|y|n][+m][+s]] [-T<int>,<mareg>[,<outmaregs[+n]>]]\n");
-		mexPrintf("       [-Q<z_offset>] [-X<manning0[,...]>] -t<dt> [-f]\n");
+		mexPrintf("       [-Fb<scenarios>] [-Fg<greens.nc>,<heights>[,<out>][+m]] [-Fk[c]<w/e/s/n>] [-H] [-H<momentM,momentN>[,t]] [-I<chkfile>]\n");
+		mexPrintf("       [-J<time_jump>[+run_time_jump|+a[<eta>]]] [-K<chkfile>[,<int>]] [-L[name1,name2]]\n");
+		mexPrintf("       [-M[-|+[<maskname>]]] [-N<n_cycles>] [-P] [-R<w/e/s/n>] [-S[x|y|n][+m][+s]] [-T<int>,<mareg>[,<outmaregs[+n]>]]\n");
+		mexPrintf("       [-Q<z_offset>] [-W[<depth>]] [-X<manning0|grid0[,...]>] [-Y<domain>|+c<dir>] -t<dt>[+a[<n>]] [-f]\n");
 #endif
+		mexPrintf("\t-1 <bat_lev1> Bathymetry of a nested grid. -2, -3, ... for grids nested in the grid(s) of the level above.\n");
+		mexPrintf("\t   Give several comma separated grids to have siblings (e.g. harbours) at the same level. Each must\n");
+		mexPrintf("\t   be inside one grid of the level above and not overlap its siblings. Siblings are computed in\n");
+		mexPrintf("\t   parallel. The +lev of -G counts the nested grids in the order they are given.\n");
 		mexPrintf("\t-A <name> save result as a .SWW ANUGA format file\n");
 		mexPrintf("\t-n basename for MOST triplet files (no extension)\n");
 		mexPrintf("\t-B name of a BoundaryCondition ASCII file\n");
@@ -1032,20 +1474,39 @@ int main(int argc, char **argv) {
 		mexPrintf("\t-F dip/strike/rake/slip/length/width/topDepth/x_epic/y_epic\n");
 		mexPrintf("\t   Fault parameters describing Dip,Azimuth,Rake,Slip(m),lenght,height and depth from sea-bottom\n");
 		mexPrintf("\t   x_epic, y_epic X and Y coordinates of begining of fault trace. All dimensions must be in km.\n");
+		mexPrintf("\t-Fb<file> Run a batch of scenarios on the same grids, which are loaded only once. Each line of <file>\n");
+		mexPrintf("\t   has the -F parameters (dip/strike/.../y_epic) and, optionally, a name. Only the maregraphs are\n");
+		mexPrintf("\t   saved (-T), one file per scenario named <outmaregs>_<name>.<ext> (name defaults to the line number).\n");
+		mexPrintf("\t   With several threads, each thread computes a different scenario.\n");
+		mexPrintf("\t-Fg<greens.nc>,<heights>[,<outmaregs>][+m] Do not simulate. Build the maregraphs of a source made of\n");
+		mexPrintf("\t   the prisms of a -Fk file <greens.nc> by adding their maregraphs, scaled by the prism heights in\n");
+		mexPrintf("\t   <heights> (one 'x y height' per line, at any point of the prism). Exact only when -Fk used -L.\n");
+		mexPrintf("\t   <outmaregs> defaults to <heights> with '_synth.dat' appended. Append +m to write also the\n");
+		mexPrintf("\t   max water level at each maregraph, and its time, to <outmaregs> with a '_max' suffix.\n");
 		mexPrintf("\t-Fk<west/east/south/north> Build a prism source with these limits and height of 1 meter.\n");
 		mexPrintf("\t-Fkc<x/y/nx/ny>. Alternatively, provide the prism size as center at x/y and nx/ny half-widths cell number.\n");
 		mexPrintf("\t-Fk.../RxC. Loops over a matrix of size R x C satrting at Lower Left Corner given by w/e/s/n.\n");
 		mexPrintf("\t-Fk.../dx[/dy]. Given the w/e/s/n region (Pixel registration) loop over the number of prisms\n");
 		mexPrintf("\t   obtained by dividing the regin in increments of dx/dy (if not given defaults dy = dx).\n");
 		mexPrintf("\t   The use of -Fk sets the output maregraph file to netCDF format, unless rows = cols = 1.\n");
+		mexPrintf("\t   When no grids are saved (only the maregraphs), each thread computes a different prism.\n");
 		mexPrintf("\t-G <stem> write grids at the <int> intervals. Append file prefix. Files will be called <stem>#.grd\n");
 		mexPrintf("\t   When doing nested grids, append +lev to save that particular level (only one level is allowed)\n");
+		mexPrintf("\t   Append +m to write the grids by copying them into a memory mapping of the files.\n");
 		mexPrintf("\t-H write grids with the momentum. i.e velocity times water depth.\n");
 		mexPrintf("\t-H <fname_momentM,fname_momentN>[,t] Do Hot start using these moment grids. Optional 't' is the\n");
 		mexPrintf("\t   time of hot start. (Need also surface displacement corresponding to the time of these grids.)\n");
+		mexPrintf("\t-I <chkfile> Resume the run that wrote the -K checkpoint <chkfile>. All other options must be the\n");
+		mexPrintf("\t   same as in that run (use -N to extend it). Outputs continue from where the checkpoint was taken.\n");
 		mexPrintf("\t-J <time_jump> Do not write grids or maregraphs for times before time_jump in seconds.\n");
 		mexPrintf("\t   When doing nested grids, append +<time> to NOT start computations of nested grids before this\n");
 		mexPrintf("\t   time has elapsed. Any of these forms is allowed: -Jt1, -J+t2, -Jt1+t2 or -Jt1 -J+t2\n");
+		mexPrintf("\t   Use +a[<eta>] instead of +<time> to start each nested grid only when |eta| on the cells\n");
+		mexPrintf("\t   of its parent along its borders exceeds <eta> [Default 0.001 m]. Till then it is not computed.\n");
+		mexPrintf("\t-K <chkfile>[,<int>] Save the whole state of the run in <chkfile> every <int> cycles, so that it can\n");
+		mexPrintf("\t   be resumed with -I. It is also saved on SIGUSR1 and on SIGTERM, which then stops the run with\n");
+		mexPrintf("\t   the exit status 3, so that a batch scheduler does not take it as completed.\n");
+		mexPrintf("\t   Not with -Fk, -Fb, -A, -Z nor the MOST output.\n");
 		mexPrintf("\t-L Use linear approximation in moment conservation equations (faster but less good).\n");
 		mexPrintf("\t-L <in_fname>,<out_fname> Do Lagragian tracers, where <in_fname> is the file name of the tracers\n");
 		mexPrintf("\t   initial position and <out_fname> the file name to hold the results.\n");
@@ -1061,6 +1522,8 @@ int main(int argc, char **argv) {
 #ifdef I_AM_MEX
 		mexPrintf("\t-O <int>,<outfname> interval at which maregraphs are writen to the <outfname> maregraph file.\n");
 #endif
+		mexPrintf("\t-P Compute the mass and moment equations in one single pass over memory. Faster on large grids.\n");
+		mexPrintf("\t   Ignored when using nested grids or a boundary condition file.\n");
 		mexPrintf("\t-Q <z_offset> Apply a vertical offset to ALL bathymetry grids. Use it to simulate tide.\n");
 		mexPrintf("\t-R output grids only in the sub-region enclosed by <west/east/south/north>\n");
 		mexPrintf("\t-S write grids with the velocity. Grid names are appended with _U and _V sufixes.\n");
@@ -1076,11 +1539,27 @@ int main(int argc, char **argv) {
 #ifdef I_AM_MEX
 		mexPrintf("\t   Warning: this option cannot be used when maregraphs were transmitted in input.\n");
 #endif
+		mexPrintf("\t-W <depth> Use the linear approximation, without friction, where the water is deeper than <depth>\n");
+		mexPrintf("\t   meters [Default 100]. Only the shallower cells run the full nonlinear equations. Faster on\n");
+		mexPrintf("\t   ocean wide grids, but the far field gets no advection nor friction.\n");
 		mexPrintf("\t-X <maning0[,maning1[,...]][+<depth>]> Manning friction coefficients. If only one provided, use it for all\n");
 		mexPrintf("\t   nesting levels (if applyable), otherwise specify one for each nesting level separated by commas.\n");
 		mexPrintf("\t   Append +<depth> to only apply Manning at depths shallower than depth (pos up).\n");
+		mexPrintf("\t   Any of the coefficients may instead be the name of a grid, with the same rows and columns as the\n");
+		mexPrintf("\t   bathymetry of its level, holding a Manning coefficient for each node. A grid is not replicated\n");
+		mexPrintf("\t   to the other levels, so with nested grids give then one coefficient or grid per level.\n");
+		mexPrintf("\t-Y <domain> Save the bathymetries of the base and nested grids, as the solver uses them, in the file\n");
+		mexPrintf("\t   <domain>. Give it later in place of the bathymetry grid, and without the -1, -2, ..., to start\n");
+		mexPrintf("\t   with no grid reading nor conversion: its pages are mapped and shared by all runs on the machine.\n");
+		mexPrintf("\t   It is tied to the precision of the build that wrote it. Not with -B.\n");
+		mexPrintf("\t   -Y+c<dir> keeps instead the whole domain (bathymetries after -Q and -B, cell classes and\n");
+		mexPrintf("\t   friction factors) in the cache directory <dir>, under a hash of the grids, -B, -Q, -W and -X.\n");
+		mexPrintf("\t   The first run saves it, the next ones with the same inputs map it and skip its setup.\n");
 		mexPrintf("\t-Z Same as -G but saves result in a 3D netCDF file.\n");
-		mexPrintf("\t-t <dt> Time step for simulation.\n");
+		mexPrintf("\t-t <dt>[+a[<n>]] Time step for simulation. Append +a to let the time step grow, up to n times dt\n");
+		mexPrintf("\t   [Default 8], while the maximum of sqrt(g*h)+|u| over the moving water allows it (Courant < 0.5).\n");
+		mexPrintf("\t   Nested grids keep an integer number of steps per step of their parent. The output intervals\n");
+		mexPrintf("\t   are still counted in steps of dt. Not with -B nor with tracers (-L<file>).\n");
 		mexPrintf("\t-f To use when grids are in geographical coordinates.\n");
 #ifdef I_AM_MEX
 		mexPrintf("\t-e To be used from the Mirone stand-alone version.\n");
@@ -1090,6 +1569,17 @@ int main(int argc, char **argv) {
 #endif
 	}
 
+	if (greens_arg) {		/* -Fg needs none of the rest */
+#ifdef HAVE_NETCDF
+		if (synth_greens(greens_arg, verbose)) Return(-1);
+#endif
+#ifdef I_AM_MEX
+		return;
+#else
+		return(0);
+#endif
+	}
+
 	do_maxs = (max_level || max_energy || max_power);
 	do_2Dgrids = (write_grids || out_velocity || out_velocity_x || out_velocity_y || out_velocity_r || out_momentum
 	              || max_level || max_velocity || max_energy || out_power || max_power || nest.do_long_beach
@@ -1117,11 +1607,45 @@ int main(int argc, char **argv) {
 	if (do_Kaba && fonte)
 		mexPrintf("WARNING: Source file is ignored when -Fk option is used.\n");
 
+	if (scen_file) {
+		if ((n_scen = read_scenarios(scen_file, &scen_fault, &scen_names)) < 1)
+			error++;
+		else {		/* The first scenario is also the source of the main container, which is never run */
+			f_dip    = scen_fault[0];	f_azim  = scen_fault[1];	f_rake     = scen_fault[2];
+			f_slip   = scen_fault[3];	f_length = scen_fault[4];	f_width = scen_fault[5];
+			f_topDepth = scen_fault[6];	x_epic  = scen_fault[7];	y_epic     = scen_fault[8];
+		}
+		if (!cumpt || grn || max_level || max_energy || max_power || max_velocity || do_tracers || bnc_file ||
+		    do_HotStart || out_maregs_velocity || do_Kaba || nest.adapt_dt) {
+			mexPrintf("NSWING: Error -Fb option. The scenarios only save maregraphs (-T). They cannot be used with -G, -Z,\n");
+			mexPrintf("        max grids, tracers, -B, -Fk, hot start, maregraph velocities or the adaptive time step.\n");
+			error++;
+		}
+	}
+
+	if ((chk_file && !chk_file[0]) || (chk_resume && !chk_resume[0])) {
+		mexPrintf("NSWING: Error -K or -I option. Must provide the name of the checkpoint file.\n");
+		error++;
+	}
+	if ((chk_file || chk_resume) && (do_Kaba || scen_file || out_sww || out_most || out_3D)) {
+		mexPrintf("NSWING: Error -K or -I option. Checkpoints cannot be used with -Fk, -Fb nor the netCDF grids outputs.\n");
+		error++;
+	}
+	if (chk_resume && do_HotStart) {
+		mexPrintf("NSWING: Error -I option. A checkpoint already has the start state. Do not use -H with it.\n");
+		error++;
+	}
+
 	if (dt <= 0) {
 		mexPrintf("NSWING: Error -t option. Time step of simulation not provided or negative.\n");
 		error++;
 	}
 
+	if (nest.adapt_dt && (bnc_file || do_tracers)) {
+		mexPrintf("NSWING: Error -t option. The adaptive time step (+a) cannot be used with -B nor with tracers.\n");
+		error++;
+	}
+
 	if (out_sww && fname_sww == NULL) {
 		mexPrintf("NSWING: Error -A option. Must provide a name for the .SWW file.\n");
 		error++;
@@ -1159,7 +1683,7 @@ int main(int argc, char **argv) {
 		}
 
 		n_ptmar = n_of_cycles / cumint + 1;
-		if (!error && (fp = fopen (hcum, "w")) == NULL) {
+		if (!error && !n_scen && (fp = fopen (hcum, (chk_resume) ? "r+" : "w")) == NULL) {	/* -Fb writes one file per scenario */
 			mexPrintf("%s: Unable to create file %s - exiting\n", "nswing", hcum);
 			Return(-1);
 		}
@@ -1192,7 +1716,36 @@ int main(int argc, char **argv) {
 			Return(-1);
 		}
 
-		r_bin_b = read_grd_info_ascii(bathy, &hdr_b);	/* To know how what memory to allocate */
+		if (cache_dir) {		/* Name the cache after everything that goes into the domain */
+			uint64_t key = 0x6e7377696e67ULL;
+			double   opts[14];
+			int      sizes[2] = {(int)sizeof(real), isGeog};
+			memset(&dom_key, 0, sizeof(struct domain_head));
+			key = hash_file(bathy, key, &dom_key);
+			for (k = 0; k < 10 && nesteds[k]; k++) {
+				char *str_nest = strdup(nesteds[k]), *fname;
+				key = hash_bytes(&k, sizeof(int), key);		/* The level of the grids that follow */
+				for (fname = (char *)strtok_s(str_nest, ",", &ntoken); fname; fname = (char *)strtok_s(NULL, ",", &ntoken))
+					key = hash_file(fname, key, &dom_key);
+				free(str_nest);
+			}
+			for (k = 0; k < 10; k++)
+				if (fname_manning[k] && (k == 0 || fname_manning[k] != fname_manning[k-1]))
+					key = hash_file(fname_manning[k], key, &dom_key);
+			if (bnc_file) key = hash_file(bnc_file, key, &dom_key);
+			for (k = 0; k < 10; k++) opts[k] = nest.manning[k];
+			opts[10] = nest.linear_depth;
+			opts[11] = (do_HotStart) ? 0 : z_offset;
+			opts[12] = MAXRUNUP;	opts[13] = DEEP_WATER;
+			key = hash_bytes(opts, sizeof(opts), key);
+			key = hash_bytes(sizes, sizeof(sizes), key);
+			dom_key.key = key;
+			sprintf(cache_file, "%s/%08x%08x.dom", cache_dir, (unsigned int)(key >> 32), (unsigned int)key);
+			if ((dom_grids = read_domain(cache_file, &nest, &hdr_b, &dom_key)) < 0) Return(-1);
+			dom_cached = (dom_grids > 0);
+		}
+		if (!dom_cached && (dom_grids = read_domain(bathy, &nest, &hdr_b, NULL)) < 0) Return(-1);
+		r_bin_b = (dom_grids) ? 1 : read_grd_info_ascii(bathy, &hdr_b);	/* To know how what memory to allocate */
 		if (r_bin_b < 0) {
 			mexPrintf("NSWING: %s Invalid bathymetry grid. Possibly it is in the Surfer 7 format\n", bathy); 
 			Return(-1);
@@ -1246,42 +1799,87 @@ int main(int argc, char **argv) {
 		mexPrintf("NSWING: Warning: dt > dtCFL / 2 is normaly not good enough. "
 		                   "This may cause troubles. Consider using ~ %.3f\n", dtCFL/2); 
 
+	if (dom_out && bnc_file) {
+		mexPrintf("NSWING: Error, -Y cannot be used with -B. The domain file would keep the walls of the boundary\n");
+		error++;
+	}
+	if (dom_grids && !dom_cached && nesteds[0]) {
+		mexPrintf("NSWING: Error, %s is a domain file. It already has the nested grids, so drop the -1, -2, ...\n", bathy);
+		error++;
+	}
+
 	if (error) Return(-1);
 
-	if (n_arg_no_char == 0) {		/* Read the nesting grids (when we have them ofc) */
-		int r_bin;
+	if (dom_grids) {		/* The nested grids came with the domain file */
+		num_of_nestGrids = dom_grids - 1;
+		do_nestum = (num_of_nestGrids) ? TRUE : FALSE;
+	}
+	else if (n_arg_no_char == 0) {		/* Read the nesting grids (when we have them ofc) */
+		int r_bin, lev, g, kk, k0 = 0, k1 = 1;	/* [k0, k1[ are the grids of the level above */
 		double dx, dy;		/* Local variables to not interfere with the base level ones */
+		char  *fname, *str_nest;
 		struct	srf_header hdr;
 
 		num_of_nestGrids = 0;
-		while (nesteds[num_of_nestGrids] != NULL) {
-			if ((r_bin = read_grd_info_ascii(nesteds[num_of_nestGrids], &hdr)) < 0) {
-				mexPrintf("NSWING: %s Invalid bathymetry grid. Possibly it is in the Surfer 7 format\n",
-					nesteds[num_of_nestGrids]); 
-				Return(-1);
-			}
-			if ((nest.bat[num_of_nestGrids+1] = (double *)mxCalloc((size_t)hdr.nx*(size_t)hdr.ny, sizeof(double)) ) == NULL) 
-				{no_sys_mem("(bat)", hdr.nx*hdr.ny); Return(-1);}
-
-			if (!r_bin) {
-				if (read_grd_ascii(nesteds[num_of_nestGrids], &hdr, nest.bat[num_of_nestGrids+1], -1))
+		for (lev = 0; lev < 9 && nesteds[lev] != NULL; lev++) {
+			str_nest = strdup(nesteds[lev]);	/* Do not chop argv[], the history still wants it */
+			fname = (char *)strtok_s(str_nest, ",", &ntoken);	/* Siblings are comma separated */
+			while (fname) {
+				if ((g = num_of_nestGrids + 1) > 9) {
+					mexPrintf("NSWING: Error, no more than 9 nested grids are allowed\n");
 					Return(-1);
-			}
-			else {
-				if (read_grd_bin(nesteds[num_of_nestGrids], &hdr, nest.bat[num_of_nestGrids+1], -1))
+				}
+				if ((r_bin = read_grd_info_ascii(fname, &hdr)) < 0) {
+					mexPrintf("NSWING: %s Invalid bathymetry grid. Possibly it is in the Surfer 7 format\n", fname);
 					Return(-1);
-			}
+				}
+				if ((nest.bat[g] = (real *)mxCalloc((size_t)hdr.nx*(size_t)hdr.ny, sizeof(real)) ) == NULL) 
+					{no_sys_mem("(bat)", hdr.nx*hdr.ny); Return(-1);}
+
+				if (!r_bin) {
+					if (read_grd_ascii(fname, &hdr, nest.bat[g], -1))
+						Return(-1);
+				}
+				else {
+					if (read_grd_bin(fname, &hdr, nest.bat[g], -1))
+						Return(-1);
+				}
 
-			dx = (hdr.x_max - hdr.x_min) / (hdr.nx - 1);
-			dy = (hdr.y_max - hdr.y_min) / (hdr.ny - 1);
-			nest.hdr[num_of_nestGrids+1].nx = hdr.nx;
-			nest.hdr[num_of_nestGrids+1].ny = hdr.ny;
-			nest.hdr[num_of_nestGrids+1].nm = (unsigned int)hdr.nx * (unsigned int)hdr.ny;
-			nest.hdr[num_of_nestGrids+1].x_inc = dx;           nest.hdr[num_of_nestGrids+1].y_inc = dy;
-			nest.hdr[num_of_nestGrids+1].x_min = hdr.x_min;    nest.hdr[num_of_nestGrids+1].x_max = hdr.x_max;
-			nest.hdr[num_of_nestGrids+1].y_min = hdr.y_min;    nest.hdr[num_of_nestGrids+1].y_max = hdr.y_max;
-			nest.hdr[num_of_nestGrids+1].z_min = hdr.z_min;    nest.hdr[num_of_nestGrids+1].z_max = hdr.z_max;
-			num_of_nestGrids++;
+				dx = (hdr.x_max - hdr.x_min) / (hdr.nx - 1);
+				dy = (hdr.y_max - hdr.y_min) / (hdr.ny - 1);
+				nest.hdr[g].nx = hdr.nx;
+				nest.hdr[g].ny = hdr.ny;
+				nest.hdr[g].nm = (unsigned int)hdr.nx * (unsigned int)hdr.ny;
+				nest.hdr[g].x_inc = dx;           nest.hdr[g].y_inc = dy;
+				nest.hdr[g].x_min = hdr.x_min;    nest.hdr[g].x_max = hdr.x_max;
+				nest.hdr[g].y_min = hdr.y_min;    nest.hdr[g].y_max = hdr.y_max;
+				nest.hdr[g].z_min = hdr.z_min;    nest.hdr[g].z_max = hdr.z_max;
+
+				nest.parent[g] = 0;
+				if (lev) {		/* The parent is the grid of the level above that contains this one */
+					for (kk = k0; kk < k1; kk++) {
+						if (hdr.x_min > nest.hdr[kk].x_min && hdr.x_max < nest.hdr[kk].x_max &&
+						    hdr.y_min > nest.hdr[kk].y_min && hdr.y_max < nest.hdr[kk].y_max) break;
+					}
+					if (kk == k1) {
+						mexPrintf("NSWING: Error, nested grid %s is not inside any of the grids of the level above\n", fname);
+						Return(-1);
+					}
+					nest.parent[g] = kk;
+				}
+				for (kk = k1; kk < g; kk++) {		/* Siblings cannot overlap. They would both upscale there */
+					if (nest.parent[kk] == nest.parent[g] &&
+					    hdr.x_min <= nest.hdr[kk].x_max && hdr.x_max >= nest.hdr[kk].x_min &&
+					    hdr.y_min <= nest.hdr[kk].y_max && hdr.y_max >= nest.hdr[kk].y_min) {
+						mexPrintf("NSWING: Error, nested grids %d and %d of the same parent overlap\n", kk, g);
+						Return(-1);
+					}
+				}
+				num_of_nestGrids++;
+				fname = (char *)strtok_s(NULL, ",", &ntoken);
+			}
+			free(str_nest);
+			k0 = k1;	k1 = num_of_nestGrids + 1;
 		}
 		do_nestum = (num_of_nestGrids) ? TRUE : FALSE;
 	}
@@ -1289,6 +1887,23 @@ int main(int argc, char **argv) {
 	/* Check if nesting grids fit nicely within each others */
 	if (do_nestum && check_paternity(&nest)) Return(-1);
 
+	if (n_manning == 1 && fname_manning[0] && num_of_nestGrids) {	/* A Manning grid fits only its own level */
+		mexPrintf("NSWING: Error, -X option, with a Manning grid give also one coefficient (or grid) for each nested level\n");
+		Return(-1);
+	}
+
+	if (do_fused && (do_nestum || bnc_file)) {
+		mexPrintf("NSWING: Warning, -P option is ignored when using nested grids or a boundary condition file.\n");
+		do_fused = FALSE;
+	}
+
+	nest.track_active = (bnc_file == NULL);	/* The wave maker would change the borders behind the tracker's back */
+
+	/* The prisms of a -Fk grid are independent runs. When only their maregraphs are saved, compute one per thread */
+	if (do_Kaba && KbGridRows * KbGridCols > 1 && cumpt && !grn && !do_maxs && !max_velocity && !do_tracers &&
+	    !bnc_file && !nest.adapt_dt)
+		kb_lanes = MIN(nest.n_threads, KbGridRows * KbGridCols - 1);
+
 	if (writeLevel > num_of_nestGrids) {
 		mexPrintf("Requested save grid level is higher that actual number of nested grids. Using last\n");
 		writeLevel = num_of_nestGrids;
@@ -1343,7 +1958,9 @@ int main(int argc, char **argv) {
 		}
 	}
 	else {			/* If bathymetry & source where not given as arguments, load them */
-		if (!r_bin_b)					/* Read bathymetry */
+		if (dom_grids)					/* Bathymetry is already in the pages of the domain file */
+			;
+		else if (!r_bin_b)				/* Read bathymetry */
 			read_grd_ascii(bathy, &hdr_b, nest.bat[0], -1);
 		else
 			read_grd_bin(bathy, &hdr_b, nest.bat[0], -1);
@@ -1420,9 +2037,6 @@ int main(int argc, char **argv) {
 			/* Select which vx/vy will be used to compute the lagragian tracers */
 			vx_for_oranges     = nest.vex[writeLevel];
 			vy_for_oranges     = nest.vey[writeLevel];
-			fluxm_for_oranges  = nest.fluxm_d[writeLevel];
-			fluxn_for_oranges  = nest.fluxn_d[writeLevel];
-			htotal_for_oranges = nest.htotal_d[writeLevel];
 		}
 	}
 
@@ -1490,13 +2104,18 @@ int main(int argc, char **argv) {
 			if (initialize_nestum(&nest, isGeog, k))
 				Return(-1);
 		}
+		nest_family(&nest, num_of_nestGrids);
 		nest.time_h = time_h;
 		/* TEMP trick to NOT do initial interpolation of nested grids. For TESTING purposes only. */
 		if (nest.run_jump_time > 0 && nest.run_jump_time < nest.dt[0])
 			nest.run_jump_time = 0;		/* So that we don't trigger resamplegrid in nestify() */
 		else
 			resamplegrid(&nest, num_of_nestGrids);	/* Resample eta(s) in descendent grids to avoid initial jumps at borders */
+		if (nest.wake_eta > 0)
+			nest_sleep(&nest, num_of_nestGrids);	/* Those with no wave around wait for it */
 	}
+	if (dom_grids && check_domain(&nest, num_of_nestGrids)) Return(-1);
+	if (dom_out && write_domain(dom_out, &nest, num_of_nestGrids, NULL)) Return(-1);	/* Before -Q changes the bathymetries */
 
 #ifdef HAVE_NETCDF
 	if (out_sww) {
@@ -1572,12 +2191,8 @@ int main(int argc, char **argv) {
 	}
 
 	if (cumpt) {               /* Select which etad/vx/vy will be used to output maregrapghs */
-		eta_for_maregs    = nest.etad[writeLevel];
-		vx_for_maregs     = nest.vex[writeLevel];
-		vy_for_maregs     = nest.vey[writeLevel];
-		fluxm_for_maregs  = nest.fluxm_d[writeLevel];
-		fluxn_for_maregs  = nest.fluxn_d[writeLevel];
-		htotal_for_maregs = nest.htotal_d[writeLevel];
+		vx_for_maregs     = nest.vex[writeLevel];	/* The eta, flux and htotal ones are swapped by update() */
+		vy_for_maregs     = nest.vey[writeLevel];	/* so they are picked up at each time step */
 
 		if (out_maregs_nc) {    /* Allocate an array to hold the maregraph data which will be written to a nc file at the end */
 			if ((maregs_array = (float *) mxCalloc((size_t)(n_ptmar * n_mareg), sizeof(float))) == NULL)
@@ -1589,7 +2204,7 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (z_offset != 0 && !do_HotStart) {				/* If we have a tide offset, apply it. */
+	if (z_offset != 0 && !do_HotStart && !dom_cached) {	/* If we have a tide offset, apply it (a cached domain has it) */
 		for (k = 0; k == num_of_nestGrids; k++) {
 			for (ij = 0; ij < nest.hdr[k].nm; ij++)
 				nest.bat[k][ij] += -z_offset;			/* -z_offset because here bathy is already positive down */
@@ -1607,9 +2222,9 @@ int main(int argc, char **argv) {
 				k, nest.LLx[k], nest.LRx[k], nest.LLy[k], nest.URy[k]);
 				mexPrintf("Layer %d inserting index (one based) LL: (row,col) = %d\t%d\t\tUR: (row,col) = %d\t%d\n",
 				k, nest.LLrow[k]+2, nest.LLcol[k]+2, nest.URrow[k], nest.URcol[k]);
-				mexPrintf("\tTime step ratio to parent grid = %d\n", (int)(nest.dt[k-1] / nest.dt[k]));
-				if (k > 1)
-					mexPrintf("\t\tdt(parent) = %g\tdt(doughter) = %g\n", nest.dt[k-1], nest.dt[k]);
+				mexPrintf("\tTime step ratio to parent grid (%d) = %d\n", nest.parent[k], (int)(nest.dt[nest.parent[k]] / nest.dt[k]));
+				if (nest.parent[k] > 0)
+					mexPrintf("\t\tdt(parent) = %g\tdt(doughter) = %g\n", nest.dt[nest.parent[k]], nest.dt[k]);
 			}
 		}
 		mexPrintf ("dtCFL = %.4f\tCourant number (sqrt(g*h)*dt / max(dx,dy)) = %g\n", dtCFL, 1/dtCFL * dt);
@@ -1620,6 +2235,8 @@ int main(int argc, char **argv) {
 		if (time_jump)      mexPrintf("Hold on %.3f seconds before starting to save results.\n", time_jump);
 		if (nest.run_jump_time)
 			mexPrintf("Holding on %.3f seconds before start running the nested grids.\n", nest.run_jump_time);
+		if (nest.wake_eta > 0 && do_nestum)
+			mexPrintf("Start running each nested grid when the wave reaches %g m near its borders.\n", nest.wake_eta);
 		if (do_maxs) {
 			if (max_energy)
 				mexPrintf("Output maximum Energy with a decimation of %d\n", decimate_max);
@@ -1628,12 +2245,24 @@ int main(int argc, char **argv) {
 		}
 		if (nest.do_linear)
 			mexPrintf("Using Linear approximation\n");
+		if (!nest.do_linear && nest.linear_depth > 0)
+			mexPrintf("Using Linear approximation in water deeper than %g m\n", nest.linear_depth);
+		if (nest.adapt_dt)
+			mexPrintf("Using an adaptive time step of up to %d x %g s\n", nest.adapt_dt, dt);
 		if (do_tracers)
 			mexPrintf("Computing tracers from file %s \n", tracers_infile);
 		if (do_Kaba)
 			mexPrintf("Computing a grid of prisms with size %d (rows) x %d (cols)\n", KbGridRows, KbGridCols);
+		if (kb_lanes > 1)
+			mexPrintf("\tAfter the first one, %d prisms are computed at a time\n", kb_lanes);
+		if (n_scen)
+			mexPrintf("Running %d scenarios from %s\n", n_scen, scen_file);
 		if (EPS4 != EPS4_)
 			mexPrintf("Using a modified EPS4 const of %g\n", EPS4);
+		if (nest.n_threads > 1)
+			mexPrintf("Distributing the tiles of the grids among %d threads\n", nest.n_threads);
+		if (nest.simd_level)
+			mexPrintf("Using the %s vectorized moment equations\n", (nest.simd_level == 3) ? "AVX-512" : "AVX2");
 #ifdef LIMIT_DISCHARGE
 		mexPrintf("\nUsing DISCHARGE limit to minimize sources of instability\n");
 #endif
@@ -1655,6 +2284,16 @@ int main(int argc, char **argv) {
 		max_velocity = FALSE;             /* Prevent the equivalent code in main loop to be executed */ 
 	}
 
+	for (k = 0; k <= num_of_nestGrids; k++) {	/* The bathymetries are final by now */
+		if (!nest.cell_class[k] && classify_cells(&nest, k)) Return(-1);	/* Unless they came from the cache */
+		if (!nest.fric[k] && friction_factor(&nest, k, fname_manning[k])) Return(-1);
+		nest.kflags[k] = kernel_flags(&nest, k);
+	}
+	if (cache_dir && !dom_cached) write_cache(cache_file, &nest, num_of_nestGrids, &dom_key);
+	if (str_manning) free(str_manning);
+
+	start_pool(&nest);		/* Threads are created only once and live until the end */
+
 	tic = clock();
 
 	/* --------------------------------------------------------------------------------------- */
@@ -1662,15 +2301,81 @@ int main(int argc, char **argv) {
 
 	one_100 = (double)(n_of_cycles) / 100.0;
 
+	if (n_scen) {		/* -Fb. The domain is loaded. Now run the scenarios on it instead of the main loop */
+		struct kaba_grid kb;
+		memset(&kb, 0, sizeof(struct kaba_grid));
+		kb.n_runs = n_scen;
+		/* Linear runs with none of the extra terms of the kernels advance SCEN_PACK scenarios per sweep */
+		kb.n_pack = (n_scen > 1 && nest.do_linear && !isGeog && !do_nestum && nest.linear_depth == 0 &&
+		             nest.kflags[0] == 0) ? SCEN_PACK : 1;
+		kb.n_lanes = MIN(nest.n_threads, (n_scen + kb.n_pack - 1) / kb.n_pack);
+		if (verbose && kb.n_pack > 1)
+			mexPrintf("\tThe scenarios are computed in packs of %d\n", kb.n_pack);
+		kb.n_cycles = n_of_cycles;	kb.cumint = cumint;			kb.n_samples = (n_of_cycles - 1) / cumint + 1;
+		kb.n_mareg = n_mareg;		kb.writeLevel = writeLevel;	kb.do_fused = do_fused;
+		kb.lcum_p = lcum_p;			kb.dt = dt;		kb.dx = dx;		kb.dy = dy;		kb.hdr = hdr_b;
+		kb.fault = scen_fault;
+		if (run_scenarios(&nest, &kb, n_scen, scen_names, mareg_names, hcum, history, out_maregs_nc,
+		                  maregs_array, maregs_timeout)) Return(-1);
+		if (out_maregs_nc) {
+			mxFree(maregs_array);	mxFree(maregs_array_t);	mxFree(maregs_timeout);
+		}
+		goto EndScenarios;		/* Jump over the main loop and the writing of its results */
+	}
+
+	if (chk_file || chk_resume) {	/* What a checkpoint of this run holds besides the grids state */
+		memset(&chk, 0, sizeof(struct checkpoint));
+		chk.n_mareg   = (cumpt) ? n_mareg : 0;
+		chk.n_oranges = (do_tracers) ? n_oranges : 0;
+		chk.contents  = ((do_maxs || nest.do_max_level) ? CHK_WMAX : 0) | ((vmax) ? CHK_VMAX : 0) |
+		                ((cumpt && out_maregs_nc) ? CHK_MAREGS : 0) | ((do_tracers) ? CHK_TRACERS : 0);
+	}
+	if (chk_resume) {		/* -I. Continue from where the checkpoint was taken */
+		if (read_checkpoint(chk_resume, &nest, num_of_nestGrids, &chk, wmax, vmax, maregs_array,
+		                    maregs_timeout, oranges)) Return(-1);
+		if (chk.k >= n_of_cycles) {
+			mexPrintf("NSWING: The run of checkpoint %s already did %d cycles. Use a larger -N to extend it.\n",
+			          chk_resume, chk.k);
+			Return(-1);
+		}
+		k_first = k_chk = chk.k;
+		time_h  = nest.time_h;
+		count_maregs_timeout = chk.count_maregs;	count_time_maregs_timeout = chk.count_time_maregs;
+		if (cumpt && !out_maregs_nc) {		/* Drop what was written after the checkpoint */
+			fflush(fp);
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+			_chsize(_fileno(fp), (long)chk.mareg_pos);
+#else
+			ftruncate(fileno(fp), (off_t)chk.mareg_pos);
+#endif
+			fseek(fp, 0L, SEEK_END);
+		}
+		if (nest.adapt_dt) {		/* The coefficients that carry dt */
+			if (isGeog) inisp(&nest);
+			else if (nest.do_Coriolis) inicart(&nest);
+		}
+		if (verbose) mexPrintf("Resuming at cycle %d (time = %g s) from %s\n", k_first, time_h, chk_resume);
+	}
+#ifndef I_AM_MEX
+	if (chk_file) {
+		signal(SIGTERM, checkpoint_signal);
+#ifdef SIGUSR1
+		signal(SIGUSR1, checkpoint_signal);
+#endif
+	}
+#endif
+
+	start_writer(&nest);		/* The outputs of the loop(s) are written while it goes on */
+
 LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop. Sorry but have to. */
 	/* --------------------------------------------------------------------------------------- */
 	/* Begin main iteration */
 	/* --------------------------------------------------------------------------------------- */
-	for (k = iprc = 0; k < n_of_cycles; k++) {
+	for (k = k_first, iprc = 0; k < n_of_cycles; k++) {
 
 		if (k > iprc * one_100) {		/* Waitbars stuff */ 
 			prc = (double)iprc / 100.;
-			iprc++;
+			iprc = MAX(iprc + 1, (int)(k / one_100));	/* Adaptive steps may jump over several percents */
 			prc = (double)(k+1) / (double)n_of_cycles;
 #ifdef I_AM_MEX
 			if (!IamCompiled) {
@@ -1686,13 +2391,30 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 #endif
 		}
 
+		/* ------------------------------------------------------------------------------------ */
+		/* update eta and fluxes with the results of the previous step */
+		/* ------------------------------------------------------------------------------------ */
+		update(&nest, 0);
+		active_region(&nest, 0);
+
+		if (nest.adapt_dt) {	/* Take n_step steps of dt at once, but do not skip any cycle that has output */
+			k_stop = n_of_cycles - 1;
+			if (grn)   k_stop = MIN(k_stop, (k + grn - 1) / grn * grn);
+			if (cumpt) k_stop = MIN(k_stop, (k + cumint - 1) / cumint * cumint);
+			if (max_energy || max_power) k_stop = MIN(k_stop, (k + decimate_max - 1) / decimate_max * decimate_max);
+			n_step = adapt_time_step(&nest, MIN(nest.adapt_dt, k_stop - k + 1));
+			k      += n_step - 1;		/* Number of the cycle this step ends on */
+			time_h += (n_step - 1) * dt;
+			nest.time_h = time_h;
+		}
+
 		/* ------------------------------------------------------------------------------------ */
 		/* mass conservation */
 		/* ------------------------------------------------------------------------------------ */
-		if (isGeog == 0)
-			mass(&nest, 0);
+		if (do_fused)		/* Mass, open boundary and moment in one single pass */
+			fused_conservation(&nest, 0, (k != 0));
 		else
-			mass_sp(&nest, 0);
+			mass_conservation(&nest, isGeog, 0);
 
 		/* ------------------------------------------------------------------------------------ */
 		/* Case of open boundary condition or wave maker */
@@ -1703,60 +2425,37 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 			if (interp_bnc(&nest, time_h)) bnc_file = NULL;
 			wave_maker(&nest);   /* Boundary condition was already set (after reading bnc_file) */
 		}
-		else if (k)
-			openb(nest.hdr[0], nest.bat[0], nest.fluxm_d[0], nest.fluxn_d[0], nest.etad[0], &nest);
+		else if (k && !do_fused)
+			openb(nest.hdr[0], nest.bat[0], nest.fluxm_a[0], nest.fluxn_a[0], nest.etad[0], &nest);
 
 		/* ------------------------------------------------------------------------------------ */
 		/* If Nested grids we have to do the nesting work */
 		/* ------------------------------------------------------------------------------------ */
-		if (do_nestum) nestify(&nest, num_of_nestGrids, 1, isGeog);
+		if (do_nestum) nestify_children(&nest, num_of_nestGrids, 0, isGeog);
 
 		/* ------------------------------------------------------------------------------------ */
 		/* momentum conservation */
 		/* ------------------------------------------------------------------------------------ */
-		moment_conservation(&nest, isGeog, 0);
+		if (!do_fused) moment_conservation(&nest, isGeog, 0);
 
-		/* ------------------------------------------------------------------------------------ */
-		/* update eta and fluxes */
-		/* ------------------------------------------------------------------------------------ */
-		update(&nest, 0);
+		nest.new_state[0] = TRUE;		/* update() will move it to the _a arrays at the start of next step */
 
 		/* ------------------------------------------------------------------------------------ */
 		/* If want time series at maregraph positions */
 		/* ------------------------------------------------------------------------------------ */
 		if (cumpt && (k % cumint == 0)) {
+			eta_for_maregs    = nest.etad[writeLevel];
+			fluxm_for_maregs  = nest.fluxm_d[writeLevel];
+			fluxn_for_maregs  = nest.fluxn_d[writeLevel];
+			htotal_for_maregs = nest.htotal_d[writeLevel];
 			if (out_maregs_nc) {
 				maregs_timeout[count_time_maregs_timeout++] = time_h + dt/2;
 				for (ij = 0; ij < n_mareg; ij++)
 					maregs_array[count_maregs_timeout++] = (float)eta_for_maregs[lcum_p[ij]];
 			}
 			else {
-				if (k == 0) {		/* Write also the maregraphs coordinates (at grid nodes) */
-					int ix, iy, n;
-					char *txt[4], t0[16], t1[16], t2[16], t3[16], *txt_X, *txt_Y, fmt[8];	/* for the headers */
-					txt[0] = mxCalloc((size_t)n_mareg, 16); txt[1] = mxCalloc((size_t)n_mareg, 16);
-					txt[2] = mxCalloc((size_t)n_mareg, 16); txt[3] = mxCalloc((size_t)n_mareg, 16);
-					txt_X  = mxCalloc((size_t)(n_mareg*10+4), 1);	txt_Y = mxCalloc((size_t)(n_mareg*10+4), 1);
-					sprintf(txt[0], "#\t"); sprintf(txt[1], "#\t"); sprintf(txt[2], "#\t"); sprintf(txt[3], "#\t");
-					sprintf(txt_X, "# X\t");	sprintf(txt_Y, "# Y\t");
-					if (isGeog)
-						strcpy(fmt, "\t%.5f");
-					else
-						strcpy(fmt, "\t%.2f");
-					for (n = 0; n < n_mareg; n++) {
-						ix = lcum_p[n] % nest.hdr[writeLevel].nx;
-						iy = lcum_p[n] / nest.hdr[writeLevel].nx;
-						sprintf(t0, "%8s",  mareg_names[n]);
-						sprintf(t1, fmt, nest.hdr[writeLevel].x_min + ix * nest.hdr[writeLevel].x_inc);	/* Xs */
-						sprintf(t2, fmt, nest.hdr[writeLevel].y_min + iy * nest.hdr[writeLevel].y_inc);	/* Ys */
-						sprintf(t3, "\t%.1f", nest.bat[writeLevel][lcum_p[n]]); 	/* Zs (from grid) */
-						strcat(txt[0], t0);		strcat(txt[1], t1);		strcat(txt[2], t2);		strcat(txt[3], t3);
-						strcat(txt_X, t1);		strcat(txt_Y, t2);
-					}
-					fprintf(fp, "%s\n%s\n%s\n%s\n%s\n%s\n", txt[0], txt[1], txt[2], txt[3], txt_X, txt_Y);
-					fprintf(fp, ">XY\n");		/* So that the file can be opened directly with dag-n-drop to Mirone */
-					mxFree(txt[0]);	mxFree(txt[1]);	mxFree(txt[2]);	mxFree(txt[3]);	mxFree(txt_X);	mxFree(txt_Y);
-				}
+				if (k == 0)		/* Write also the maregraphs coordinates (at grid nodes) */
+					write_maregs_header(fp, &nest, lcum_p, mareg_names, n_mareg, writeLevel);
 				fprintf (fp, "%.3f", (time_h + dt/2));
 				if (out_maregs_velocity) {
 					double vx, vy;
@@ -1784,6 +2483,9 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 			unsigned int ix, jy, itmp, ij_c;
 			double vx, vy, vx1, vx2, vy1, vy2, dx, dy;
 			double v_LLx, v_LLy, v_LRx, v_LRy, v_ULx, v_ULy, v_URx, v_URy;
+			fluxm_for_oranges  = nest.fluxm_d[writeLevel];
+			fluxn_for_oranges  = nest.fluxn_d[writeLevel];
+			htotal_for_oranges = nest.htotal_d[writeLevel];
 			for (n = 0; n < n_oranges; n++) {
 				ix = (int)((oranges[n].x[k-1] - nest.hdr[writeLevel].x_min) / nest.hdr[writeLevel].x_inc);
 				jy = (int)((oranges[n].y[k-1] - nest.hdr[writeLevel].y_min) / nest.hdr[writeLevel].y_inc);
@@ -1856,23 +2558,23 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 					//strcat(prenome, &stem[len]);    /* Put back the given extension */
 				}
 
-				write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
-				              nest.hdr[writeLevel].nx, wmax);
+				out_grd(&nest, prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
+				        nest.hdr[writeLevel].nx, wmax);
 			}
 
 			if (nest.do_long_beach) {           /* In this case the calculations were done in mass() */
 				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++)
 					wmax[ij] = nest.long_beach[writeLevel][ij];	/* Implicitly convert from short int to float */
 
-				write_grd_bin(fname_mask_lbeach, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
-				              nest.hdr[writeLevel].nx, wmax);
+				out_grd(&nest, fname_mask_lbeach, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
+				        nest.hdr[writeLevel].nx, wmax);
 			}
 			if (nest.do_short_beach) {          /* In this case the calculations were done in mass() */
 				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++)
 					wmax[ij] = nest.short_beach[writeLevel][ij];/* Implicitly convert from short int to float */
 
-				write_grd_bin(fname_mask_sbeach, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
-				              nest.hdr[writeLevel].nx, wmax);
+				out_grd(&nest, fname_mask_sbeach, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
+				        nest.hdr[writeLevel].nx, wmax);
 			}
 
 			if (max_velocity || nest.do_max_velocity) { /* Maximum velocity is treated differently */
@@ -1885,8 +2587,8 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 					strcat(strncpy(prenome, stem, len), "_max_speed");
 					strcat(prenome, &stem[len]);        /* Put back the given extension */
 				}
-				write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
-				              nest.hdr[writeLevel].nx, vmax);
+				out_grd(&nest, prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end,
+				        nest.hdr[writeLevel].nx, vmax);
 			}
 		}
 		/* -------------------------------------------------------------------------------- */
@@ -1900,7 +2602,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) {
 					work[ij] = (float)nest.etad[writeLevel][ij];
 					if (nest.bat[writeLevel][ij] < 0) {
-						if ((work[ij] = (float)(nest.etaa[writeLevel][ij] + nest.bat[writeLevel][ij])) < 0)
+						if ((work[ij] = (float)(nest.etad[writeLevel][ij] + nest.bat[writeLevel][ij])) < 0)
 							work[ij] = 0;
 					}
 				}
@@ -1913,7 +2615,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 
 			if (write_grids) {
 				sprintf(prenome, "%s%05d.grd", stem, irint(time_h));
-				write_grd_bin(prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+				out_grd(&nest, prenome, xMinOut, yMinOut, dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
 			}
 
 			if (out_momentum && !out_3D) {
@@ -1924,14 +2626,14 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 
 				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) work[ij] = (float)nest.fluxm_d[writeLevel][ij];
 
-				write_grd_bin(strcat(prenome,"_Uh.grd"), xMinOut, yMinOut, dx, dy, 
-				              i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+				out_grd(&nest, strcat(prenome,"_Uh.grd"), xMinOut, yMinOut, dx, dy, 
+				        i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
 
 				for (ij = 0; ij < nest.hdr[writeLevel].nm; ij++) work[ij] = (float)nest.fluxn_d[writeLevel][ij];
 
 				prenome[strlen(prenome) - 7] = '\0';	/* Remove the _Uh.grd' so that we can add '_Vh.grd' */
-				write_grd_bin(strcat(prenome,"_Vh.grd"), xMinOut, yMinOut, dx, dy, 
-				              i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+				out_grd(&nest, strcat(prenome,"_Vh.grd"), xMinOut, yMinOut, dx, dy, 
+				        i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
 			}
 
 			if (out_velocity && !out_3D) {
@@ -1944,8 +2646,8 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 							work[ij] = 0;
 					}
 
-					write_grd_bin(strcat(prenome,"_U.grd"), xMinOut + nest.hdr[writeLevel].x_inc/2, yMinOut,
-					              dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+					out_grd(&nest, strcat(prenome,"_U.grd"), xMinOut + nest.hdr[writeLevel].x_inc/2, yMinOut,
+					        dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
 					prenome[strlen(prenome)-6] = '\0';	/* Remove the _U.grd' so that we can add '_V.grd' */
 				}
 				if (out_velocity_y) {
@@ -1955,8 +2657,8 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 							work[ij] = 0;
 					}
 
-					write_grd_bin(strcat(prenome,"_V.grd"), xMinOut, yMinOut + nest.hdr[writeLevel].y_inc/2,
-					              dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
+					out_grd(&nest, strcat(prenome,"_V.grd"), xMinOut, yMinOut + nest.hdr[writeLevel].y_inc/2,
+					        dx, dy, i_start, j_start, i_end, j_end, nest.hdr[writeLevel].nx, work);
 				}
 			}
 
@@ -1967,7 +2669,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 					first_anuga_time = FALSE;
 				}
 				time_for_anuga = time_h - time0;	/* I think ANUGA wants time starting at zero */
-				err_trap (nc_put_vara_double (ncid, ids[6], &start0, &count0, &time_for_anuga));
+				out_vara_d(&nest, ncid, ids[6], start0, time_for_anuga);
 
 				write_anuga_slice(&nest, ncid, ids[7], i_start, j_start, i_end, j_end, tmp_slice, start1_A, count1_A,
 				                  stage_range, 1, with_land, writeLevel);
@@ -1981,9 +2683,9 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 
 			if (out_most) {
 				/* Here we'll use the start0 computed above */
-				err_trap (nc_put_vara_double (ncid_most[0], ids_ha[4], &start0, &count0, &time_h));
-				err_trap (nc_put_vara_double (ncid_most[1], ids_ua[4], &start0, &count0, &time_h));
-				err_trap (nc_put_vara_double (ncid_most[2], ids_va[4], &start0, &count0, &time_h));
+				out_vara_d(&nest, ncid_most[0], ids_ha[4], start0, time_h);
+				out_vara_d(&nest, ncid_most[1], ids_ua[4], start0, time_h);
+				out_vara_d(&nest, ncid_most[2], ids_va[4], start0, time_h);
 
 				write_most_slice(&nest, ncid_most, ids_most, i_start, j_start, i_end, j_end,
 				                 tmp_slice, start1_M, count1_M, actual_range, TRUE, writeLevel);
@@ -1991,7 +2693,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 			}
 			else if (out_3D) {
 				/* Here we'll use the start0 computed above */
-				err_trap(nc_put_vara_double(ncid_3D[0], ids_z[2], &start0, &count0, &time_h));
+				out_vara_d(&nest, ncid_3D[0], ids_z[2], start0, time_h);
 				write_most_slice(&nest, ncid_3D, ids_3D, i_start, j_start, i_end, j_end,
 				                 work, start1_M, count1_M, actual_range, FALSE, writeLevel);
 				start1_M[0]++;		/* Increment for the next slice */
@@ -2002,8 +2704,26 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 		}
 		time_h += dt;
 		nest.time_h = time_h;
+
+		if (chk_file && k < n_of_cycles - 1 && (chk_signal || (chk_int && k + 1 - k_chk >= chk_int))) {
+			chk.k = k_chk = k + 1;
+			chk.count_maregs = count_maregs_timeout;	chk.count_time_maregs = count_time_maregs_timeout;
+			if (cumpt && !out_maregs_nc) {
+				fflush(fp);
+				chk.mareg_pos = (int64_t)ftell(fp);
+			}
+			out_sync(&nest);	/* The outputs up to now must be complete when the checkpoint is */
+			write_checkpoint(chk_file, &nest, num_of_nestGrids, &chk, wmax, vmax, maregs_array, maregs_timeout, oranges);
+			if (chk_signal == SIGTERM) {
+				mexPrintf("\nNSWING: Stopped by SIGTERM after %d cycles. Resume with -I%s\n", k + 1, chk_file);
+				exit_code = CHK_STOPPED;
+				goto EndScenarios;
+			}
+			chk_signal = 0;
+		}
 	}
 	/* ------------------------------- END MAIN LOOP --------------------------------------- */
+	out_sync(&nest);		/* The netCDF files below are closed by this thread */
 
 #ifdef HAVE_NETCDF
 	if (out_sww) {          /* Uppdate range values and close SWW file */
@@ -2057,7 +2777,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 
 	if (out_maregs_nc) {    /* Write the maregs in a netCDF file */
 		if (do_Kaba) {
-			int    k, kp, km, nKabas, RC[2];
+			int    k, kp, km, kl, nKabas, RC[2];
 			size_t strt, cnt, row, col;
 			double x1, x2, y1, y2, BB[8];
 
@@ -2086,27 +2806,45 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 			strt = (size_t)(cntKabas - 1);
 			//err_trap(nc_put_vara_int(ncid_Mar, ids_Mar[2], &strt, &count0, &cntKabas));	/* Update unlimited var */
 
+			if (cntKabas < nKabas && kb_lanes > 1) {	/* The other prisms, kb_lanes at a time */
+				struct kaba_grid kb;
+				kb.n_lanes = kb_lanes;		kb.n_cols = KbGridCols;		kb.type = do_Kaba;
+				kb.n_runs = nKabas;			kb.n_pack = 1;
+				kb.n_cycles = n_of_cycles;	kb.cumint = cumint;			kb.n_samples = count_time_maregs_timeout;
+				kb.n_mareg = n_mareg;		kb.writeLevel = writeLevel;	kb.do_fused = do_fused;
+				kb.lcum_p = lcum_p;			kb.dt = dt;		kb.dx = dx;		kb.dy = dy;		kb.hdr = hdr_b;
+				kb.fault = NULL;
+				kb.x_min = kaba_xmin;		kb.x_max = kaba_xmax;		kb.x_inc = dxKb;
+				kb.y_min = kaba_ymin;		kb.y_max = kaba_ymax;		kb.y_inc = dyKb;
+				if (kaba_lanes(&nest, &kb)) Return(-1);
+
+				for (kb.first = cntKabas; kb.first < nKabas; kb.first += kb_lanes) {
+					n = MIN(kb_lanes, nKabas - kb.first);
+					fprintf(stderr, "Computing prisms %d to %d out of %d\n", kb.first + 1, kb.first + n, nKabas);
+					run_levels((PFV)kaba_lane, &nest, kb.lane_id, n);
+					for (kl = 0; kl < n; kl++) {	/* Only this thread writes, and in the order of the prisms */
+						for (km = k = 0; km < n_mareg; km++)
+							for (kp = 0; kp < count_time_maregs_timeout; kp++)
+								maregs_array_t[k++] = (float)kb.mar[kl][kp*n_mareg + km];
+						start_Mar[0]++;
+						err_trap(nc_put_vara_float(ncid_Mar, ids_Mar[4], start_Mar, count_Mar, maregs_array_t));
+					}
+				}
+				kaba_lanes_free(&kb);
+				nest.kb  = NULL;
+				cntKabas = nKabas;
+			}
+
 			if (cntKabas < nKabas) {	/* While not all nodes in KabaGrid GOTO ... */
-				unsigned int nm, lev;
 				sprintf(txt, "%g/%g/%g/%g", x1, x2, y1, y2);	/* Region string to be stored in the nc file */
 				kaba_source(hdr_b, dx, dy, x1, x2, y1, y2, do_Kaba, nest.etaa[0]);
-				/* --------------------------------- Reset these ----------------------------------*/
-				count_maregs_timeout = 0;	count_time_maregs_timeout = 0;	nest.time_h = time_h = 0;
-				for (lev = 0; lev <= num_of_nestGrids; lev++) {
-					nm = nest.hdr[lev].nm;
-					memset(nest.etad[lev],     0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxm_a[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxm_d[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxn_a[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.fluxn_d[lev],  0, (size_t)(nm * sizeof(double)));
-					memset(nest.htotal_a[lev], 0, (size_t)(nm * sizeof(double)));
-					memset(nest.htotal_d[lev], 0, (size_t)(nm * sizeof(double)));
-				}
-				/* ------------------------------------------------------------------------------- */
+				count_maregs_timeout = 0;	count_time_maregs_timeout = 0;	time_h = 0;
+				kaba_reset(&nest, num_of_nestGrids);
 				fprintf(stderr, "Computing prism %d out of %d (row = %d\tcol = %d)\t%s\n",
 				        cntKabas+1, KbGridRows * KbGridCols, row+1, col+1, txt);
 				goto LoopKabas;			/* A LOOP HERE */
 			}
+			BB[0] = kaba_xmin;			BB[2] = kaba_ymin;	/* Locals of this block do not survive the GOTO */
 			BB[1] = kaba_xmin + KbGridCols*dxKb;			BB[3] = kaba_ymin + KbGridRows*dyKb;
 			BB[4] = dxKb;           BB[5] = dyKb;
 			BB[6] = KbGridRows;     BB[7] = KbGridCols;
@@ -2138,6 +2876,7 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 		}
 	}
 
+EndScenarios:
 #ifdef I_AM_MEX
 	if (!IamCompiled) {
 		*ptr_wb = 1.0;
@@ -2149,15 +2888,18 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 	/* Clean up allocated memory. */
 	mxDestroyArray(rhs[0]);		mxDestroyArray(rhs[1]);		mxDestroyArray(rhs[2]);
 #else
-	fprintf(stderr, "\t100 %%\tCPU secs/ticks = %.3f\n", (double)(clock() - tic));
+	if (exit_code != CHK_STOPPED)
+		fprintf(stderr, "\t100 %%\tCPU secs/ticks = %.3f\n", (double)(clock() - tic));
 #endif
 
 	if (cumpt) {
-		fclose (fp);
+		if (!n_scen) fclose (fp);
 		if (cum_p) mxFree((void *) cum_p);
 		if (time_p)mxFree((void *) time_p);	 
 	}
 
+	stop_pool(&nest);
+	stop_writer(&nest);
 	free_arrays(&nest, isGeog, num_of_nestGrids);
 	if (vmax) mxFree (vmax);
 	if (wmax) mxFree (wmax);
@@ -2168,9 +2910,15 @@ LoopKabas:		/* When computing a grid of Kabas we use a GOTO to simulate a loop.
 		for (k = 0; k < n_mareg; k++) free(mareg_names[k]);	/* They were allocated with strdup() */
 		mxFree(mareg_names);
 	}
+	if (scen_names) {
+		for (k = 0; k < n_scen; k++) free(scen_names[k]);
+		mxFree(scen_names);
+	}
+	if (scen_fault) mxFree(scen_fault);
+	if (chk_file) free(chk_file);
 
 #ifndef I_AM_MEX
-	return 0;
+	return (exit_code);
 #endif
 }
 
@@ -2187,12 +2935,28 @@ void sanitize_nestContainer(struct nestContainer *nest) {
 	nest->out_velocity_x = FALSE;
 	nest->out_velocity_y = FALSE;
 	nest->do_Coriolis    = FALSE;
+	nest->n_threads      = 1;
+	nest->pool           = NULL;
+	nest->out            = NULL;
+	nest->in_task        = FALSE;
+	nest->kb             = NULL;
+	nest->dom_map        = NULL;
+	nest->dom_size       = 0;
+	nest->n_pack         = 1;
+	nest->n_nested       = 0;
+	nest->fused_openb    = FALSE;
+	nest->simd_level     = 0;
+	nest->track_active   = FALSE;
 	nest->bnc_var_nTimes = 0;
 	nest->bnc_pos_nPts   = 0;
 	nest->bnc_border[0]  = nest->bnc_border[1] = nest->bnc_border[2] = nest->bnc_border[3] = FALSE;
 	nest->run_jump_time  = 0;
+	nest->wake_eta       = 0;
 	nest->lat_min4Coriolis = -100;
 	nest->manning_depth = 8000;   /* Default, if manning, and use already the z pos down */
+	nest->linear_depth  = 0;
+	nest->dt_base       = 0;
+	nest->adapt_dt      = 0;
 	nest->bnc_pos_x = NULL;
 	nest->bnc_pos_y = NULL;
 	nest->bnc_var_t = NULL;
@@ -2200,6 +2964,13 @@ void sanitize_nestContainer(struct nestContainer *nest) {
 	nest->bnc_var_zTmp = NULL;
 	for (i = 0; i < 10; i++) {
 		nest->level[i] = -1;      /* Will be set to the due level number for existing nesting levels */
+		nest->parent[i] = i - 1;  /* A single chain of nested grids unless told otherwise */
+		nest->n_children[i] = 0;
+		nest->keeps_max[i] = TRUE;
+		nest->new_state[i] = FALSE;
+		nest->asleep[i] = FALSE;
+		nest->act_step[i] = nest->act_row0[i] = nest->act_row1[i] = nest->act_col0[i] = nest->act_col1[i] = 0;
+		nest->kflags[i] = 0;
 		nest->manning[i] = 0;
 		nest->LLrow[i] = nest->LLcol[i] = nest->ULrow[i] = nest->ULcol[i] =
 		nest->URrow[i] = nest->URcol[i] = nest->LRrow[i] = nest->LRcol[i] =
@@ -2209,9 +2980,12 @@ void sanitize_nestContainer(struct nestContainer *nest) {
 		nest->dt[i] = 0;
 		nest->long_beach[i]  = NULL;
 		nest->short_beach[i] = NULL;
+		nest->cell_class[i] = NULL;
+		nest->fric[i] = NULL;
+		nest->wet_first[i] = nest->wet_last[i] = NULL;
 		nest->bat[i] = NULL;
 		nest->fluxm_a[i] = nest->fluxm_d[i] = NULL;
-		nest->fluxn_a[i] = nest->fluxm_d[i] = NULL;
+		nest->fluxn_a[i] = nest->fluxn_d[i] = NULL;
 		nest->htotal_a[i] = nest->htotal_d[i] = NULL;
 		nest->etaa[i] = nest->etad[i] = NULL;
 		nest->vex[i] = nest->vey[i] = NULL;
@@ -2233,27 +3007,27 @@ int check_paternity(struct nestContainer *nest) {
 
 	while (nest->level[k] > 0) {
 		/* Check nesting at LowerLeft corner */
-		if (check_binning(nest->hdr[k-1].x_min, nest->hdr[k].x_min, nest->hdr[k-1].x_inc,
-		                  nest->hdr[k].x_inc, nest->hdr[k-1].x_inc / 4, &suggest)) {
+		if (check_binning(nest->hdr[nest->parent[k]].x_min, nest->hdr[k].x_min, nest->hdr[nest->parent[k]].x_inc,
+		                  nest->hdr[k].x_inc, nest->hdr[nest->parent[k]].x_inc / 4, &suggest)) {
 			mexPrintf("Lower left corner of doughter grid does not obey to the nesting rules.\n"
 				"X_MIN should be (in grid registration):\n\t%f\n", suggest);
 			error++;
 		}
-		if (check_binning(nest->hdr[k-1].y_min, nest->hdr[k].y_min, nest->hdr[k-1].y_inc,
-		                  nest->hdr[k].y_inc, nest->hdr[k-1].y_inc / 4, &suggest)) {
+		if (check_binning(nest->hdr[nest->parent[k]].y_min, nest->hdr[k].y_min, nest->hdr[nest->parent[k]].y_inc,
+		                  nest->hdr[k].y_inc, nest->hdr[nest->parent[k]].y_inc / 4, &suggest)) {
 			mexPrintf("Lower left corner of doughter grid does not obey to the nesting rules.\n"
 				"Y_MIN should be (in grid registration):\n\t%f\n", suggest);
 			error++;
 		}
 		/* Check nesting at UpperRight corner */
-		if (check_binning(nest->hdr[k-1].x_min, nest->hdr[k].x_max, nest->hdr[k-1].x_inc,
-		                  -nest->hdr[k].x_inc, nest->hdr[k-1].x_inc / 4, &suggest)) {
+		if (check_binning(nest->hdr[nest->parent[k]].x_min, nest->hdr[k].x_max, nest->hdr[nest->parent[k]].x_inc,
+		                  -nest->hdr[k].x_inc, nest->hdr[nest->parent[k]].x_inc / 4, &suggest)) {
 			mexPrintf("Upper right corner of doughter grid does not obey to the nesting rules.\n"
 				"X_MAX should be (in grid registration):\n\t%f\n", suggest);
 			error++;
 		}
-		if (check_binning(nest->hdr[k-1].y_min, nest->hdr[k].y_max, nest->hdr[k-1].y_inc,
-		                  -nest->hdr[k].y_inc, nest->hdr[k-1].y_inc / 4, &suggest)) {
+		if (check_binning(nest->hdr[nest->parent[k]].y_min, nest->hdr[k].y_max, nest->hdr[nest->parent[k]].y_inc,
+		                  -nest->hdr[k].y_inc, nest->hdr[nest->parent[k]].y_inc / 4, &suggest)) {
 			mexPrintf("Upper right corner of doughter grid does not obey to the nesting rules.\n"
 				"Y_MAX should be (in grid registration):\n\t%f\n", suggest);
 			error++;
@@ -2287,18 +3061,18 @@ int check_binning(double x0P, double x0D, double dxP, double dxD, double tol, do
 int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	/* Initialize the nest struct. */
 
-	int row, col, i, nSizeIncX, nSizeIncY, n;
+	int row, col, i, nSizeIncX, nSizeIncY, n, lev_P = MAX(nest->parent[lev], 0);
 	unsigned int nm = nest->hdr[lev].nm;
 	double dt, scale;
 	double xoff, yoff, xoff_P, yoff_P;		/* Offsets to move from grid to pixel registration (zero if grid in pix reg) */
-	struct grd_header hdr = nest->hdr[lev-1];
+	struct grd_header hdr = nest->hdr[lev_P];
 
 	if (lev > 0) {
 		/* -------------------- Check that this grid is nestifiable -------------------- */
 		nSizeIncX = irint(hdr.x_inc / nest->hdr[lev].x_inc);
 		if ((hdr.x_inc / nest->hdr[lev].x_inc) - nSizeIncX > 1e-5) {
-			mexPrintf("NSWING ERROR: X increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev-1);
-			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) X increments = %d\n", lev, lev-1, nSizeIncX);
+			mexPrintf("NSWING ERROR: X increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev_P);
+			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) X increments = %d\n", lev, lev_P, nSizeIncX);
 			mexPrintf("\tActual  ratio as a floating point = %f\n\tDifference between the two cannot exceed 1e-5\n",
 			          hdr.x_inc / nest->hdr[lev].x_inc);
 			return(-1);
@@ -2306,19 +3080,19 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 
 		nSizeIncY = irint(hdr.y_inc / nest->hdr[lev].y_inc);
 		if ((hdr.y_inc / nest->hdr[lev].y_inc) - nSizeIncY > 1e-5) {
-			mexPrintf("NSWING ERROR: Y increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev-1);
-			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) Y increments = %d\n", lev, lev-1, nSizeIncY);
+			mexPrintf("NSWING ERROR: Y increments of inner (%d) and outer (%d) grids are incompatible.\n", lev, lev_P);
+			mexPrintf("\tInteger ratio of parent (%d) to doughter (%d) Y increments = %d\n", lev, lev_P, nSizeIncY);
 			mexPrintf("\tActual  ratio as a floating point = %f\n\tDifference between the two cannot exceed 1e-5\n",
 			          hdr.y_inc / nest->hdr[lev].y_inc);
 			return(-1);
 		}
 
 		if (nSizeIncX != nSizeIncY) {
-			mexPrintf("NSWING ERROR: X/Y increments of inner (%d) and outer (%d) grid do not divide equaly.\n", lev, lev-1);
-			mexPrintf("\tinc_x(%d) = %f\t inc_x(%d) = %f.\n", lev-1, hdr.x_inc, lev, nest->hdr[lev].x_inc);
-			mexPrintf("\tinc_y(%d) = %f\t inc_y(%d) = %f.\n", lev-1, hdr.y_inc, lev, nest->hdr[lev].y_inc);
-			mexPrintf("\tRatio of X increments (round(inc_x(%d) / inc_x(%d)) = %d.\n", lev-1, lev, nSizeIncX);
-			mexPrintf("\tRatio of Y increments (round(inc_y(%d) / inc_y(%d)) = %d.\n", lev-1, lev, nSizeIncY);
+			mexPrintf("NSWING ERROR: X/Y increments of inner (%d) and outer (%d) grid do not divide equaly.\n", lev, lev_P);
+			mexPrintf("\tinc_x(%d) = %f\t inc_x(%d) = %f.\n", lev_P, hdr.x_inc, lev, nest->hdr[lev].x_inc);
+			mexPrintf("\tinc_y(%d) = %f\t inc_y(%d) = %f.\n", lev_P, hdr.y_inc, lev, nest->hdr[lev].y_inc);
+			mexPrintf("\tRatio of X increments (round(inc_x(%d) / inc_x(%d)) = %d.\n", lev_P, lev, nSizeIncX);
+			mexPrintf("\tRatio of Y increments (round(inc_y(%d) / inc_y(%d)) = %d.\n", lev_P, lev, nSizeIncY);
 			return(-1);
 		}
 
@@ -2328,30 +3102,32 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 		/* Compute the run time step interval for this level */
 		scale = (isGeog) ? 111000 : 1;		/* To get the incs in meters */
 		dt = 0.5 * MIN(nest->hdr[lev].x_inc, nest->hdr[lev].y_inc) * scale / sqrt(NORMAL_GRAV * fabs(nest->hdr[lev].z_min));
-		nest->dt[lev] = nest->dt[lev-1] / ceil(nest->dt[lev-1] / dt);
+		nest->dt[lev] = nest->dt[lev_P] / ceil(nest->dt[lev_P] / dt);
 	}
 
 	nest->level[lev] = lev;
+	nest->act_row1[lev] = nest->hdr[lev].ny;	/* The active box starts with the whole grid */
+	nest->act_col1[lev] = nest->hdr[lev].nx;
 
 	/* Allocate the working arrays */
-	if (nest->bat[lev] == NULL && (nest->bat[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if (nest->bat[lev] == NULL && (nest->bat[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(bat)", nm); return(-1);}
 
-	if ((nest->etaa[lev] = (double *)     mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->etaa[lev] = (real *)       mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(etaa)", nm); return(-1);}
-	if ((nest->etad[lev] = (double *)     mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->etad[lev] = (real *)       mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(etad)", nm); return(-1);}
-	if ((nest->fluxm_a[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxm_a[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxm_a)", nm); return(-1);}
-	if ((nest->fluxm_d[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxm_d[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxm_d)", nm); return(-1);}
-	if ((nest->fluxn_a[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxn_a[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxn_a)", nm); return(-1);}
-	if ((nest->fluxn_d[lev] = (double *)  mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->fluxn_d[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(fluxn_d)", nm); return(-1);}
-	if ((nest->htotal_a[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->htotal_a[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(htotal_a)", nm); return(-1);}
-	if ((nest->htotal_d[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+	if ((nest->htotal_d[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 		{no_sys_mem("(htotal_d)", nm); return(-1);}
 
 	if (nest->do_long_beach && (lev == nest->writeLevel)) {
@@ -2364,11 +3140,11 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	}
 
 	if (nest->out_velocity_x && (lev == nest->writeLevel)) {
-		if ((nest->vex[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+		if ((nest->vex[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 			{no_sys_mem("(vex)", nm); return(-1);}
 	}
 	if (nest->out_velocity_y && (lev == nest->writeLevel)) {
-		if ((nest->vey[lev] = (double *) mxCalloc ((size_t)nm, sizeof(double)) ) == NULL)
+		if ((nest->vey[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
 			{no_sys_mem("(vey)", nm); return(-1);}
 	}
 
@@ -2407,8 +3183,8 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	/* These two must be set to zero if inner grid was already pixel registrated */
 	xoff = nest->hdr[lev].x_inc / 2;
 	yoff = nest->hdr[lev].y_inc / 2;
-	xoff_P = nest->hdr[lev-1].x_inc / 2;
-	yoff_P = nest->hdr[lev-1].y_inc / 2;
+	xoff_P = nest->hdr[lev_P].x_inc / 2;
+	yoff_P = nest->hdr[lev_P].y_inc / 2;
 
 	/* Compute the 4 coorners coordinates of the nodes on the parent grid embracing the nested grid */
 	nest->LLx[lev] = (nest->hdr[lev].x_min - xoff) - hdr.x_inc / 2;
@@ -2464,6 +3240,95 @@ int initialize_nestum(struct nestContainer *nest, int isGeog, int lev) {
 	return(0);
 }
 
+/* --------------------------------------------------------------------------- */
+int classify_cells(struct nestContainer *nest, int lev) {
+	/* Tell, once for all, which cells of grid LEV are permanent land, may flood or dry out, or are
+	   deep water (below DEEP_WATER or the -W depth), and find in each row the span [wet_first, wet_last[ out of which there is only
+	   permanent land, so that the kernels need not visit the land ends of the rows. Must be called
+	   once the bathymetry is final (after wall_it()). A row of only land has an empty span. */
+	int row, col, nx = nest->hdr[lev].nx, ny = nest->hdr[lev].ny;
+	size_t ij;
+	unsigned char *cls;
+	double deep = (nest->linear_depth > 0) ? nest->linear_depth : DEEP_WATER;
+	real *bat = nest->bat[lev];
+
+	if ((nest->cell_class[lev] = (unsigned char *) mxCalloc ((size_t)nest->hdr[lev].nm, sizeof(unsigned char)) ) == NULL)
+		{no_sys_mem("(cell_class)", nest->hdr[lev].nm); return(-1);}
+	if ((nest->wet_first[lev] = (int *) mxCalloc ((size_t)ny, sizeof(int)) ) == NULL)
+		{no_sys_mem("(wet_first)", ny); return(-1);}
+	if ((nest->wet_last[lev] = (int *) mxCalloc ((size_t)ny, sizeof(int)) ) == NULL)
+		{no_sys_mem("(wet_last)", ny); return(-1);}
+
+	cls = nest->cell_class[lev];
+	for (row = 0, ij = 0; row < ny; row++) {
+		nest->wet_first[lev][row] = nest->wet_last[lev][row] = 0;
+		for (col = 0; col < nx; col++, ij++) {
+			if (bat[ij] <= MAXRUNUP) {
+				cls[ij] = CELL_DRY;
+				continue;
+			}
+			cls[ij] = (bat[ij] > deep) ? CELL_DEEP : CELL_COAST;
+			if (nest->wet_last[lev][row] == 0) nest->wet_first[lev][row] = col;
+			nest->wet_last[lev][row] = col + 1;
+		}
+	}
+	return(0);
+}
+
+/* --------------------------------------------------------------------------- */
+int kernel_flags(struct nestContainer *nest, int lev) {
+	/* Gather in a KF_* bitmask the options that the mass and moment kernels would otherwise test for every cell.
+	   The kernels use it to run the variant compiled with those options frozen. */
+	int kf = 0;
+
+	if (nest->do_Coriolis)      kf |= KF_CORIOLIS;
+	if (nest->manning[lev] != 0) kf |= KF_FRICTION;
+	if (lev == nest->writeLevel) {
+		if (nest->out_velocity_x) kf |= KF_VEL_X;
+		if (nest->out_velocity_y) kf |= KF_VEL_Y;
+		if (nest->do_long_beach)  kf |= KF_LONG_BEACH;
+		if (nest->do_short_beach) kf |= KF_SHORT_BEACH;
+	}
+	return(kf);
+}
+
+/* --------------------------------------------------------------------------- */
+int friction_factor(struct nestContainer *nest, int lev, char *fname) {
+	/* Fill the per node friction factor, 4.9 * manning^2, of grid LEV so that the moment kernels only have
+	   to multiply it by dt. The coefficients are either the -X constant of this level or, when FNAME is
+	   not NULL, read from that grid, that must have the same rows and columns as the bathymetry. */
+	int r_bin;
+	size_t ij;
+	real *fric;
+	struct srf_header hdr;
+
+	if (nest->manning[lev] == 0) return(0);		/* No friction on this level */
+
+	if ((nest->fric[lev] = (real *) mxCalloc ((size_t)nest->hdr[lev].nm, sizeof(real)) ) == NULL)
+		{no_sys_mem("(fric)", nest->hdr[lev].nm); return(-1);}
+	fric = nest->fric[lev];
+
+	if (fname) {
+		if ((r_bin = read_grd_info_ascii(fname, &hdr)) < 0) {
+			mexPrintf("NSWING: %s Invalid Manning grid. Possibly it is in the Surfer 7 format\n", fname);
+			return(-1);
+		}
+		if (hdr.nx != nest->hdr[lev].nx || hdr.ny != nest->hdr[lev].ny) {
+			mexPrintf("NSWING: Manning grid %s and bathymetry of level %d have different rows/columns\n", fname, lev);
+			return(-1);
+		}
+		if ((r_bin) ? read_grd_bin(fname, &hdr, fric, 1) : read_grd_ascii(fname, &hdr, fric, 1))
+			return(-1);
+		for (ij = 0; ij < nest->hdr[lev].nm; ij++)
+			fric[ij] = (real)(fric[ij] * fric[ij] * 4.9);
+	}
+	else {
+		for (ij = 0; ij < nest->hdr[lev].nm; ij++)
+			fric[ij] = (real)(nest->manning[lev] * nest->manning[lev] * 4.9);
+	}
+	return(0);
+}
+
 /* --------------------------------------------------------------------------- */
 void free_arrays(struct nestContainer *nest, int isGeog, int lev) {
 	int i;
@@ -2471,7 +3336,11 @@ void free_arrays(struct nestContainer *nest, int isGeog, int lev) {
 	for (i = 0; i <= lev; i++) {
 		if (nest->long_beach[i])  mxFree(nest->long_beach[i]);
 		if (nest->short_beach[i]) mxFree(nest->short_beach[i]);
-		if (nest->bat[i]) mxFree(nest->bat[i]);
+		if (nest->cell_class[i] && !IN_DOMAIN(nest, nest->cell_class[i])) mxFree(nest->cell_class[i]);	/* Or pages of the map */
+		if (nest->fric[i] && !IN_DOMAIN(nest, nest->fric[i])) mxFree(nest->fric[i]);
+		if (nest->wet_first[i] && !IN_DOMAIN(nest, nest->wet_first[i])) mxFree(nest->wet_first[i]);
+		if (nest->wet_last[i] && !IN_DOMAIN(nest, nest->wet_last[i])) mxFree(nest->wet_last[i]);
+		if (nest->bat[i] && !IN_DOMAIN(nest, nest->bat[i])) mxFree(nest->bat[i]);
 		if (nest->vex[i]) mxFree(nest->vex[i]);
 		if (nest->vey[i]) mxFree(nest->vey[i]);
 		if (nest->etaa[i]) mxFree(nest->etaa[i]);
@@ -2510,6 +3379,10 @@ void free_arrays(struct nestContainer *nest, int isGeog, int lev) {
 	if (nest->bnc_var_t) mxFree(nest->bnc_var_t);
 	if (nest->bnc_var_zTmp) mxFree(nest->bnc_var_zTmp);
 	if (nest->bnc_var_z_interp) mxFree(nest->bnc_var_z_interp);
+	if (nest->dom_map) {
+		unmap_file(nest->dom_map, nest->dom_size);
+		nest->dom_map = NULL;
+	}
 }
 
 /* --------------------------------------------------------------------------- */
@@ -2552,59 +3425,342 @@ void total_energy(struct nestContainer *nest, float *work, int lev) {
 int write_grd_bin(char *name, double x_min, double y_min, double x_inc, double y_inc, unsigned int i_start,
 	unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work) {
 
-	/* Writes a grid in the Surfer binary format */
-	unsigned int i, j;
-	double x_max, y_max;
-	float work_min = FLT_MAX, work_max = -FLT_MAX, tmp;
+	/* Writes a grid in the Surfer binary format. The rows of the I_START:I_END x J_START:J_END
+	   sub-region are contiguous in WORK, so each one goes out in a single block and its min/max
+	   are found on the same pass. The header, which has those, is written last. */
+	unsigned int i, j, nx = i_end - i_start, ny = j_end - j_start;
+	size_t nbytes;
+	float work_min = FLT_MAX, work_max = -FLT_MAX, *row;
+	char *map;
 	struct srf_header h;
 	FILE *fp;
 
+	strcpy (h.id,"DSBB");
+	h.nx = nx;			h.ny = ny;
+	h.x_min = x_min;		h.x_max = x_min + (nx - 1) * x_inc;
+	h.y_min = y_min;		h.y_max = y_min + (ny - 1) * y_inc;
+
+	nbytes = sizeof(struct srf_header) + (size_t)nx * ny * sizeof(float);
+	if (grd_mmap && (map = (char *)map_file(name, &nbytes, FMAP_WRITE)) != NULL) {
+		float *out = (float *)(map + sizeof(struct srf_header));
+		for (j = j_start; j < j_end; j++, out += nx) {
+			row = &work[ijs(i_start,j,nX)];
+			for (i = 0; i < nx; i++) {
+				work_max = MAX(row[i], work_max);
+				work_min = MIN(row[i], work_min);
+			}
+			memcpy(out, row, nx * sizeof(float));
+		}
+		h.z_min = (double)work_min;	h.z_max = (double)work_max;
+		memcpy(map, &h, sizeof(struct srf_header));
+		unmap_file(map, nbytes);
+		return (0);
+	}
+
 	if ((fp = fopen (name, "wb")) == NULL) {
 		mexPrintf("Fatal Error: Could not create file %s!\n", name);
 		return (-1);
 	}
+	fseek(fp, (long)sizeof(struct srf_header), SEEK_SET);	/* Leave room for the header */
 
-	x_max = x_min + (i_end - i_start - 1) * x_inc;
-	y_max = y_min + (j_end - j_start - 1) * y_inc;
-
-	/* Find zmin/zmax */
 	for (j = j_start; j < j_end; j++) {
-		for (i = i_start; i < i_end; i++) {
-			tmp = work[ijs(i,j,nX)];
-			work_max = MAX(tmp, work_max);
-			work_min = MIN(tmp, work_min);
+		row = &work[ijs(i_start,j,nX)];
+		for (i = 0; i < nx; i++) {
+			work_max = MAX(row[i], work_max);
+			work_min = MIN(row[i], work_min);
 		}
+		if (fwrite ((void *)row, sizeof(float), (size_t)nx, fp) != nx) break;
 	}
 
-	/* store header information and array */
-	strcpy (h.id,"DSBB");
-	h.nx = (i_end - i_start);	h.ny = (j_end - j_start);
-	h.x_min = x_min;		h.x_max = x_max;
-	h.y_min = y_min;		h.y_max = y_max;
 	h.z_min = (double)work_min;	h.z_max = (double)work_max;
-
-	if (fwrite ((void *)&h, sizeof (struct srf_header), (size_t)1, fp) != 1) {
-		fprintf (stderr, "Fatal Error: Error writing file %s!\n", name);
+	rewind(fp);
+	if (j < j_end || fwrite ((void *)&h, sizeof (struct srf_header), (size_t)1, fp) != 1) {
+		mexPrintf("Fatal Error: Error writing file %s!\n", name);
+		fclose(fp);
 		return (-1);
 	}
 
-	for (j = j_start; j < j_end; j++)
-		for (i = i_start; i < i_end; i++)
-			fwrite ((void *)&work[ijs(i,j,nX)], sizeof(float), (size_t)1, fp);
-
 	fclose(fp);
 	return (0);
 }
 
 /* ------------------------------------------------------------------------------ */
-int read_grd_info_ascii(char *file, struct srf_header *hdr) {
-	/* Read Surfer grid header, either in ASCII or binary */
+void *map_file(char *name, size_t *size, int mode) {
+	/* Map the file NAME in memory. With FMAP_WRITE, create it (or truncate it) with *SIZE bytes and
+	   map it read-write. Otherwise map the whole existing file and return its size in *SIZE. Its
+	   pages are shared with any other process that maps the same file, until (FMAP_COPY) this one
+	   writes to them. NULL on failure. */
+	void *p;
+	int   writing = (mode == FMAP_WRITE);
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	HANDLE fh, mh;
+	LARGE_INTEGER sz;
+
+	fh = CreateFileA(name, (writing) ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+	                 (writing) ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fh == INVALID_HANDLE_VALUE) return (NULL);
+	if (writing)
+		sz.QuadPart = (LONGLONG)*size;
+	else if (!GetFileSizeEx(fh, &sz) || sz.QuadPart == 0) {
+		CloseHandle(fh);
+		return (NULL);
+	}
+	*size = (size_t)sz.QuadPart;
+	mh = CreateFileMappingA(fh, NULL, (writing) ? PAGE_READWRITE : (mode == FMAP_COPY) ? PAGE_WRITECOPY : PAGE_READONLY,
+	                        sz.HighPart, sz.LowPart, NULL);
+	p  = (mh) ? MapViewOfFile(mh, (writing) ? FILE_MAP_WRITE : (mode == FMAP_COPY) ? FILE_MAP_COPY : FILE_MAP_READ,
+	                          0, 0, 0) : NULL;
+	if (mh) CloseHandle(mh);		/* The view keeps the mapping alive */
+	CloseHandle(fh);
+	return (p);
+#else
+	int fd;
+	struct stat st;
 
-	char line[128], id[5] = "";
-	FILE *fp;
+	if (writing) {
+		if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) return (NULL);
+		if (ftruncate(fd, (off_t)*size)) {
+			close(fd);
+			return (NULL);
+		}
+	}
+	else {
+		if ((fd = open(name, O_RDONLY)) < 0) return (NULL);
+		if (fstat(fd, &st) || st.st_size == 0) {
+			close(fd);
+			return (NULL);
+		}
+		*size = (size_t)st.st_size;
+	}
+	if (mode == FMAP_READ)
+		p = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	else
+		p = mmap(NULL, *size, PROT_READ | PROT_WRITE, (writing) ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);				/* The mapping keeps the file open */
+	return ((p == MAP_FAILED) ? NULL : p);
+#endif
+}
 
-	if ((fp = fopen (file, "r")) == NULL) {
-		mexPrintf ("NSWING: Unable to read file -- %s\n", file);
+/* ------------------------------------------------------------------------------ */
+void unmap_file(void *p, size_t size) {
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	UnmapViewOfFile(p);
+#else
+	munmap(p, size);
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+int write_domain(char *file, struct nestContainer *nest, int nNg, struct domain_head *K) {
+	/* -Y. Save the bathymetries of the base and NNG nested grids, as the solver holds them (type real,
+	   positive down), each one on its own memory pages, after a head with the grids geometry. With
+	   the key K of a cache (-Y+c) save also K and the cell classes, wet spans and friction factors. */
+	int    g, tables = (K != NULL);
+	size_t ny;
+	size_t size;
+	char  *map;
+	struct domain_head D;
+
+	memset(&D, 0, sizeof(struct domain_head));
+	strcpy(D.magic, "NSWDOM1");
+	D.real_size = (int)sizeof(real);
+	D.n_grids   = nNg + 1;
+	if (K) {
+		D.key = K->key;
+		D.n_inputs = K->n_inputs;
+		memcpy(D.in_size, K->in_size, sizeof(D.in_size));
+	}
+	size = (sizeof(struct domain_head) + DOM_ALIGN - 1) / DOM_ALIGN * DOM_ALIGN;
+	for (g = 0; g <= nNg; g++) {
+		D.nx[g] = nest->hdr[g].nx;           D.ny[g] = nest->hdr[g].ny;
+		D.parent[g] = nest->parent[g];
+		D.LLrow[g] = nest->LLrow[g];         D.LLcol[g] = nest->LLcol[g];
+		D.URrow[g] = nest->URrow[g];         D.URcol[g] = nest->URcol[g];
+		D.x_min[g] = nest->hdr[g].x_min;     D.x_max[g] = nest->hdr[g].x_max;
+		D.y_min[g] = nest->hdr[g].y_min;     D.y_max[g] = nest->hdr[g].y_max;
+		D.z_min[g] = nest->hdr[g].z_min;     D.z_max[g] = nest->hdr[g].z_max;
+		D.x_inc[g] = nest->hdr[g].x_inc;     D.y_inc[g] = nest->hdr[g].y_inc;
+		D.offset[g] = (int64_t)size;
+		size += ((size_t)nest->hdr[g].nm * sizeof(real) + DOM_ALIGN - 1) / DOM_ALIGN * DOM_ALIGN;
+		if (!tables) continue;
+		ny = (size_t)nest->hdr[g].ny;
+		D.off_class[g] = (int64_t)size;
+		size += ((size_t)nest->hdr[g].nm + DOM_ALIGN - 1) / DOM_ALIGN * DOM_ALIGN;
+		D.off_wet[g] = (int64_t)size;
+		size += (2 * ny * sizeof(int) + DOM_ALIGN - 1) / DOM_ALIGN * DOM_ALIGN;
+		if (nest->fric[g]) {
+			D.off_fric[g] = (int64_t)size;
+			size += ((size_t)nest->hdr[g].nm * sizeof(real) + DOM_ALIGN - 1) / DOM_ALIGN * DOM_ALIGN;
+		}
+	}
+
+	if ((map = (char *)map_file(file, &size, FMAP_WRITE)) == NULL) {
+		mexPrintf("NSWING: Unable to create the domain file %s\n", file);
+		return (-1);
+	}
+	memcpy(map, &D, sizeof(struct domain_head));
+	for (g = 0; g <= nNg; g++) {
+		memcpy(map + D.offset[g], nest->bat[g], (size_t)nest->hdr[g].nm * sizeof(real));
+		if (!tables) continue;
+		ny = (size_t)nest->hdr[g].ny;
+		memcpy(map + D.off_class[g], nest->cell_class[g], (size_t)nest->hdr[g].nm);
+		memcpy(map + D.off_wet[g], nest->wet_first[g], ny * sizeof(int));
+		memcpy(map + D.off_wet[g] + ny * sizeof(int), nest->wet_last[g], ny * sizeof(int));
+		if (D.off_fric[g])
+			memcpy(map + D.off_fric[g], nest->fric[g], (size_t)nest->hdr[g].nm * sizeof(real));
+	}
+	unmap_file(map, size);
+	return (0);
+}
+
+/* ------------------------------------------------------------------------------ */
+int read_domain(char *file, struct nestContainer *nest, struct srf_header *hdr, struct domain_head *K) {
+	/* Map the domain FILE (see write_domain) and point the bathymetries of NEST at its pages, and also
+	   the tables of classify_cells() and friction_factor() when FILE has them (a -Y+c cache). The map is
+	   copy on write, so that -Q or the walls of -B may still change them. Fills HDR with the base grid
+	   and the headers of the nested grids in NEST. Returns the number of grids, 0 if FILE is not a
+	   domain file (but some grid), or is a cache whose key and input sizes differ from K, or -1 on error. */
+	int    g;
+	size_t size;
+	char  *map;
+	struct domain_head *D;
+
+	if ((map = (char *)map_file(file, &size, FMAP_COPY)) == NULL) return (0);	/* read_grd_info_ascii() will complain */
+	D = (struct domain_head *)map;
+	if (size < sizeof(struct domain_head) || strncmp(D->magic, "NSWDOM1", 8) ||
+	    (K && (D->key != K->key || D->n_inputs != K->n_inputs || memcmp(D->in_size, K->in_size, sizeof(K->in_size))))) {
+		unmap_file(map, size);
+		return (0);
+	}
+	if (D->real_size != (int)sizeof(real) || D->n_grids < 1 || D->n_grids > 10) {
+		mexPrintf("NSWING: The domain file %s was written by a build with the other precision\n", file);
+		unmap_file(map, size);
+		return (-1);
+	}
+	for (g = 0; g < D->n_grids; g++) {
+		if (D->offset[g] + (int64_t)D->nx[g] * D->ny[g] * (int64_t)sizeof(real) > (int64_t)size ||
+		    D->off_class[g] + (int64_t)D->nx[g] * D->ny[g] > (int64_t)size ||
+		    D->off_wet[g] + 2 * (int64_t)D->ny[g] * (int64_t)sizeof(int) > (int64_t)size ||
+		    D->off_fric[g] + (int64_t)D->nx[g] * D->ny[g] * (int64_t)sizeof(real) > (int64_t)size) {
+			mexPrintf("NSWING: The domain file %s is truncated\n", file);
+			unmap_file(map, size);
+			return (-1);
+		}
+	}
+
+	memcpy(hdr->id, "DSBB", 4);
+	hdr->nx = D->nx[0];                    hdr->ny = D->ny[0];
+	hdr->x_min = D->x_min[0];              hdr->x_max = D->x_max[0];
+	hdr->y_min = D->y_min[0];              hdr->y_max = D->y_max[0];
+	hdr->z_min = D->z_min[0];              hdr->z_max = D->z_max[0];
+	for (g = 0; g < D->n_grids; g++) {
+		nest->bat[g] = (real *)(map + D->offset[g]);
+		if (D->off_class[g]) {
+			nest->cell_class[g] = (unsigned char *)(map + D->off_class[g]);
+			nest->wet_first[g]  = (int *)(map + D->off_wet[g]);
+			nest->wet_last[g]   = nest->wet_first[g] + D->ny[g];
+		}
+		if (D->off_fric[g]) nest->fric[g] = (real *)(map + D->off_fric[g]);
+		if (g == 0) continue;		/* main() sets the base header from HDR */
+		nest->hdr[g].nx = D->nx[g];            nest->hdr[g].ny = D->ny[g];
+		nest->hdr[g].nm = (unsigned int)D->nx[g] * (unsigned int)D->ny[g];
+		nest->hdr[g].x_inc = D->x_inc[g];      nest->hdr[g].y_inc = D->y_inc[g];
+		nest->hdr[g].x_min = D->x_min[g];      nest->hdr[g].x_max = D->x_max[g];
+		nest->hdr[g].y_min = D->y_min[g];      nest->hdr[g].y_max = D->y_max[g];
+		nest->hdr[g].z_min = D->z_min[g];      nest->hdr[g].z_max = D->z_max[g];
+		nest->parent[g] = D->parent[g];
+	}
+	nest->dom_map  = map;
+	nest->dom_size = size;
+	return (D->n_grids);
+}
+
+/* ------------------------------------------------------------------------------ */
+int check_domain(struct nestContainer *nest, int nNg) {
+	/* The nested grids must sit in their parents where they sat when the domain file was written */
+	int    g;
+	struct domain_head *D = (struct domain_head *)nest->dom_map;
+
+	for (g = 1; g <= nNg; g++) {
+		if (nest->LLrow[g] != D->LLrow[g] || nest->LLcol[g] != D->LLcol[g] ||
+		    nest->URrow[g] != D->URrow[g] || nest->URcol[g] != D->URcol[g]) {
+			mexPrintf("NSWING: Nested grid %d does not fit in its parent as when the domain file was written\n", g);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* ------------------------------------------------------------------------------ */
+static uint64_t mix64(uint64_t x) {
+	/* The finalizer of MurmurHash3. A bijection where every input bit flips every output bit with probability ~1/2 */
+	x ^= x >> 33;	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (x);
+}
+
+uint64_t hash_bytes(const void *p, size_t n, uint64_t h) {
+	/* Fold N bytes at P in the 64 bits hash H, eight bytes at a time, each word fully mixed in */
+	size_t i;
+	uint64_t w;
+	const unsigned char *c = (const unsigned char *)p;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&w, c + i, 8);
+		h = mix64(h ^ w);
+	}
+	if (i < n) {
+		w = 0;
+		memcpy(&w, c + i, n - i);
+		h = mix64(h ^ w);
+	}
+	return (mix64(h ^ (uint64_t)n));
+}
+
+/* ------------------------------------------------------------------------------ */
+uint64_t hash_file(char *name, uint64_t h, struct domain_head *K) {
+	/* Fold the contents of the file NAME in the hash H, and add its size to the list of K. A file that
+	   cannot be mapped only adds its name, and will be complained about by whoever reads it. */
+	size_t size;
+	void  *map;
+
+	if ((map = map_file(name, &size, FMAP_READ)) == NULL) {
+		if (K->n_inputs < 24) K->in_size[K->n_inputs++] = -1;
+		return (hash_bytes(name, strlen(name), h));
+	}
+	if (K->n_inputs < 24) K->in_size[K->n_inputs++] = (int64_t)size;
+	h = hash_bytes(map, size, h);
+	unmap_file(map, size);
+	return (h);
+}
+
+/* ------------------------------------------------------------------------------ */
+void write_cache(char *file, struct nestContainer *nest, int nNg, struct domain_head *K) {
+	/* -Y+c. Save the domain with its tables in the cache FILE. It is written aside and renamed, so
+	   that a run starting meanwhile never maps half a file. A failure only costs the next run. */
+	char tmp[1024];
+
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	sprintf(tmp, "%s.%d", file, (int)_getpid());
+#else
+	sprintf(tmp, "%s.%d", file, (int)getpid());
+#endif
+	if (write_domain(tmp, nest, nNg, K) || rename(tmp, file)) {
+		mexPrintf("NSWING: Warning, could not save the domain cache %s\n", file);
+		remove(tmp);
+	}
+}
+
+/* ------------------------------------------------------------------------------ */
+int read_grd_info_ascii(char *file, struct srf_header *hdr) {
+	/* Read Surfer grid header, either in ASCII or binary */
+
+	char line[128], id[5] = "";
+	FILE *fp;
+
+	if ((fp = fopen (file, "r")) == NULL) {
+		mexPrintf ("NSWING: Unable to read file -- %s\n", file);
 		return (-1);
 	}
 
@@ -2635,46 +3791,172 @@ int read_grd_info_ascii(char *file, struct srf_header *hdr) {
 }
 
 /* ------------------------------------------------------------------------------ */
-int read_grd_ascii(char *file, struct srf_header *hdr, double *work, int sign) {
+int read_grd_ascii(char *file, struct srf_header *hdr, real *work, int sign) {
 	/* sign is either +1 or -1, in case one wants to revert sign of the imported grid */
 
-	/* Reads a grid in the Surfer ascii format */
-	unsigned int i = 0, j, n_field;
-	char *p, buffer[512], line[512];
-	FILE *fp;
+	/* Reads a grid in the Surfer ascii format. The file is mapped in memory and its values, after
+	   the 5 header lines, are cut in pieces at line ends that are converted by different threads.
+	   Each thread first counts the values of its piece, so that it knows where they go in WORK. */
+	int    c, n_chunks = 1;
+	size_t size, len, first;
+	char  *map, *p, *end, line[512];
+	struct ascii_chunk C[MAX_THREADS];
 
-	if ((fp = fopen (file, "r")) == NULL) {
+	if ((map = (char *)map_file(file, &size, FMAP_READ)) == NULL) {
 		mexPrintf ("NSWING: Unable to read file %s - exiting\n", file);
 		return (-1);
 	}
+	end = map + size;
+
+	for (c = 0, p = map; c < 5; c++) {		/* The header lines */
+		for (len = 0; p + len < end && p[len] != '\n'; len++);
+		memcpy(line, p, MIN(len, 511));		line[MIN(len, 511)] = '\0';
+		if (c == 0)
+			sscanf (line, "%s", hdr->id);
+		else if (c == 1)
+			sscanf (line, "%d %d", &hdr->nx, &hdr->ny);
+		else if (c == 2)
+			sscanf (line, "%lf %lf", &hdr->x_min, &hdr->x_max);
+		else if (c == 3)
+			sscanf (line, "%lf %lf", &hdr->y_min, &hdr->y_max);
+		else
+			sscanf (line, "%lf %lf", &hdr->z_min, &hdr->z_max);
+		p += MIN(len + 1, (size_t)(end - p));
+	}
+
+	if (end - p > (1 << 20))		/* Not worth the threads for less than 1 MB */
+		n_chunks = MIN(GetLocalNThread(), MAX_THREADS);
+	for (c = 0; c < n_chunks; c++) {
+		C[c].p0 = (c == 0) ? p : C[c-1].p1;
+		C[c].p1 = (c == n_chunks - 1) ? end : p + (end - p) / n_chunks * (c + 1);
+		while (C[c].p1 < end && C[c].p1[-1] != '\n') C[c].p1++;	/* Cut after a line end */
+		if (C[c].p1 < C[c].p0) C[c].p1 = C[c].p0;
+		C[c].nm   = (size_t)hdr->nx * hdr->ny;
+		C[c].sign = sign;
+		C[c].work = work;
+		C[c].counting = TRUE;
+	}
+	run_ascii_chunks(C, n_chunks);
+	for (c = 0, first = 0; c < n_chunks; c++) {
+		C[c].first = first;
+		first += C[c].n;
+		C[c].counting = FALSE;
+	}
+	run_ascii_chunks(C, n_chunks);
+
+	unmap_file(map, size);
+	return (0);
+} 
 
-	fgets (line, 512, fp);
-	sscanf (line, "%s", hdr->id);
-	fgets (line, 512, fp);
-	sscanf (line, "%d %d", &hdr->nx, &hdr->ny);
-	fgets (line, 512, fp);
-	sscanf (line, "%lf %lf", &hdr->x_min, &hdr->x_max);
-	fgets (line, 512, fp);
-	sscanf (line, "%lf %lf", &hdr->y_min, &hdr->y_max);
-	fgets (line, 512, fp);
-	sscanf (line, "%lf %lf", &hdr->z_min, &hdr->z_max);
-
-	while (fgets (line, 512, fp) != NULL) {
-		strcpy (buffer, line);
-		n_field = count_col (buffer);	/* Count # of fields in line */
-		if (n_field == 0) continue;
-		p = (char *)strtok (line, " \t\n\015\032");
-		j = 0;
-		while (p && j < n_field) {
-			sscanf (p, "%lf", &work[i]);
-			work[i] *= sign;
-			j++;	i++;
-			p = (char *)strtok ((char *)NULL, " \t\n\015\032");
+/* -------------------------------------------------------------------- */
+void ascii_chunk(struct ascii_chunk *C) {
+	/* Count, or convert into C->work, the values between C->p0 and C->p1 */
+	size_t i = C->first;
+	char  *p = C->p0, *t;
+
+	if (C->counting) C->n = 0;
+	while (p < C->p1) {
+		while (p < C->p1 && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\015' || *p == '\032')) p++;
+		if (p == C->p1) break;
+		for (t = p; t < C->p1 && !(*t == ' ' || *t == '\t' || *t == '\n' || *t == '\015' || *t == '\032'); t++);
+		if (C->counting)
+			C->n++;
+		else if (i < C->nm)
+			C->work[i++] = (real)(ascii_value(p, t) * C->sign);
+		p = t;
+	}
+}
+
+/* -------------------------------------------------------------------- */
+double ascii_value(char *p, char *end) {
+	/* Convert the number between P and END. Numbers with up to 15 significant digits and a decimal
+	   exponent within +-22 are converted with one exact product (or quotient) of two doubles, so the
+	   result is the correctly rounded one that strtod() also gives. The others go to strtod(). */
+	static double p10[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+	                         1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	int      neg = FALSE, n_dig = 0, n_sig = 0, e10 = 0, ex = 0, ex_neg = FALSE;
+	uint64_t mant = 0;
+	char    *s = p, buf[64];
+	double   v;
+
+	if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+	for (; p < end && *p >= '0' && *p <= '9'; p++, n_dig++) {
+		if (mant || *p != '0') n_sig++;
+		if (n_sig <= 15) mant = mant * 10 + (*p - '0');
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, n_dig++) {
+			if (mant || *p != '0') n_sig++;
+			if (n_sig <= 15) {
+				mant = mant * 10 + (*p - '0');
+				e10--;
+			}
 		}
 	}
-	fclose(fp);
+	if (n_dig && p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '-' || *p == '+')) ex_neg = (*p++ == '-');
+		for (; p < end && *p >= '0' && *p <= '9' && ex < 10000; p++) ex = ex * 10 + (*p - '0');
+		e10 += (ex_neg) ? -ex : ex;
+	}
+	if (n_dig && p == end && n_sig <= 15 && e10 >= -22 && e10 <= 22) {
+		v = (e10 < 0) ? (double)mant / p10[-e10] : (double)mant * p10[e10];
+		return ((neg) ? -v : v);
+	}
+
+	/* Too many digits, a large exponent, NaN, or not a number at all (then it is 0) */
+	memcpy(buf, s, MIN((size_t)(end - s), 63));	buf[MIN((size_t)(end - s), 63)] = '\0';
+	return (strtod(buf, NULL));
+}
+
+/* -------------------------------------------------------------------- */
+#if !HAVE_OPENMP && defined(DO_MULTI_THREAD)
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+unsigned __stdcall ascii_thread(void *Arg_p) {
+	ascii_chunk((struct ascii_chunk *)Arg_p);
+	_endthreadex(0);
 	return (0);
-} 
+}
+#	else
+void *ascii_thread(void *Arg_p) {
+	ascii_chunk((struct ascii_chunk *)Arg_p);
+	return (NULL);
+}
+#	endif
+#endif
+
+void run_ascii_chunks(struct ascii_chunk *C, int n) {
+	/* Run ascii_chunk() on the N pieces, each in its own thread. They are not worth the pool of the
+	   solver, which does not exist yet when the grids are read. */
+	int i;
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(static, 1) num_threads(n)
+	for (i = 0; i < n; i++)
+		ascii_chunk(&C[i]);
+#elif defined(DO_MULTI_THREAD)
+	THREAD_T threads[MAX_THREADS];
+
+	for (i = 1; i < n; i++) {
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+		threads[i] = (HANDLE)_beginthreadex(NULL, 0, ascii_thread, &C[i], 0, NULL);
+#	else
+		pthread_create(&threads[i], NULL, ascii_thread, &C[i]);
+#	endif
+	}
+	ascii_chunk(&C[0]);			/* The calling thread does the first piece */
+	for (i = 1; i < n; i++) {
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#	else
+		pthread_join(threads[i], NULL);
+#	endif
+	}
+#else
+	for (i = 0; i < n; i++)
+		ascii_chunk(&C[i]);
+#endif
+}
 
 /* -------------------------------------------------------------------- */
 int count_col(char *line) {
@@ -2698,7 +3980,7 @@ int read_header_bin(FILE *fp, struct srf_header *hdr) {
 }
 
 /* -------------------------------------------------------------------- */
-int read_grd_bin(char *file, struct srf_header *hdr, double *work, int sign) {
+int read_grd_bin(char *file, struct srf_header *hdr, real *work, int sign) {
 	/* sign is either +1 or -1, in case one wants to revert sign of the imported grid */
 	int i, j;
 	unsigned int ij, kk;
@@ -2788,6 +4070,85 @@ int read_maregs(struct grd_header hdr, char *file, unsigned int *lcum_p, char *n
 	return (i);
 }
 
+/* -------------------------------------------------------------------- */
+void write_maregs_header(FILE *fp, struct nestContainer *nest, unsigned int *lcum_p, char *names[], int n_mareg, int lev) {
+	/* Write the names and the coordinates (at grid nodes) of the maregraphs at the top of their ascii file */
+	int ix, iy, n;
+	char *txt[4], t0[16], t1[16], t2[16], t3[16], *txt_X, *txt_Y, fmt[8];	/* for the headers */
+	txt[0] = mxCalloc((size_t)n_mareg, 16); txt[1] = mxCalloc((size_t)n_mareg, 16);
+	txt[2] = mxCalloc((size_t)n_mareg, 16); txt[3] = mxCalloc((size_t)n_mareg, 16);
+	txt_X  = mxCalloc((size_t)(n_mareg*10+4), 1);	txt_Y = mxCalloc((size_t)(n_mareg*10+4), 1);
+	sprintf(txt[0], "#\t"); sprintf(txt[1], "#\t"); sprintf(txt[2], "#\t"); sprintf(txt[3], "#\t");
+	sprintf(txt_X, "# X\t");	sprintf(txt_Y, "# Y\t");
+	if (nest->isGeog)
+		strcpy(fmt, "\t%.5f");
+	else
+		strcpy(fmt, "\t%.2f");
+	for (n = 0; n < n_mareg; n++) {
+		ix = lcum_p[n] % nest->hdr[lev].nx;
+		iy = lcum_p[n] / nest->hdr[lev].nx;
+		sprintf(t0, "%8s",  names[n]);
+		sprintf(t1, fmt, nest->hdr[lev].x_min + ix * nest->hdr[lev].x_inc);	/* Xs */
+		sprintf(t2, fmt, nest->hdr[lev].y_min + iy * nest->hdr[lev].y_inc);	/* Ys */
+		sprintf(t3, "\t%.1f", nest->bat[lev][lcum_p[n]]); 	/* Zs (from grid) */
+		strcat(txt[0], t0);		strcat(txt[1], t1);		strcat(txt[2], t2);		strcat(txt[3], t3);
+		strcat(txt_X, t1);		strcat(txt_Y, t2);
+	}
+	fprintf(fp, "%s\n%s\n%s\n%s\n%s\n%s\n", txt[0], txt[1], txt[2], txt[3], txt_X, txt_Y);
+	fprintf(fp, ">XY\n");		/* So that the file can be opened directly with dag-n-drop to Mirone */
+	mxFree(txt[0]);	mxFree(txt[1]);	mxFree(txt[2]);	mxFree(txt[3]);	mxFree(txt_X);	mxFree(txt_Y);
+}
+
+/* -------------------------------------------------------------------- */
+int read_scenarios(char *file, double **fault, char ***names) {
+	/* Read the -Fb file. One scenario per line with the 9 parameters of -F separated by slashes
+	   (dip/strike/rake/slip/length/width/topDepth/x_epic/y_epic) and an optional name.
+	   Returns the number of scenarios, or -1 on error. Lengths are converted to meters. */
+	int     i = 0, k = 0, n, n_scen = 0;
+	char    line[256], txt[64];
+	double *f;
+	FILE   *fp;
+
+	if ((fp = fopen (file, "r")) == NULL) {
+		mexPrintf ("NSWING: Unable to open file %s - exiting\n", file);
+		return (-1);
+	}
+
+	while (fgets (line, 256, fp) != NULL)		/* First count them */
+		if (line[0] != '#' && line[0] != '\n' && line[0] != '\r') n_scen++;
+	if (n_scen == 0) {
+		mexPrintf ("NSWING: No scenarios in file %s\n", file);
+		fclose (fp);
+		return (-1);
+	}
+
+	*fault = (double *) mxCalloc((size_t)(9 * n_scen), sizeof(double));
+	*names = (char **)  mxCalloc((size_t)n_scen, sizeof(char *));
+	rewind (fp);
+	while (fgets (line, 256, fp) != NULL) {
+		k++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;	/* Jump comment and empty lines */
+		f = &(*fault)[9 * i];
+		n = sscanf (line, "%lf/%lf/%lf/%lf/%lf/%lf/%lf/%lf/%lf %63s", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5],
+		            &f[6], &f[7], &f[8], txt);
+		if (n != 9 && n != 10) {
+			mexPrintf("NSWING: Error reading scenarios file at line %d Expected 9 parameters but got %d\n", k, n);
+			fclose (fp);
+			return (-1);
+		}
+		f[4] *= 1000;	f[5] *= 1000;	f[6] *= 1000;		/* As in -F, deform() wants meters */
+		if (n == 10)	/* This scenario's name */
+			(*names)[i] = strdup(&txt[0]);
+		else {
+			sprintf(txt, "%d", i + 1);
+			(*names)[i] = strdup(&txt[0]);
+		}
+		i++;
+	}
+	fclose (fp);
+	return (i);
+}
+
 /* -------------------------------------------------------------------- */
 int read_tracers(struct grd_header hdr, char *file, struct tracers *oranges) {
 	/* Read tracers positions */
@@ -3304,7 +4665,7 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 			slice_range[1] = MAX(work[ij], slice_range[1]);
 		}
 
-		err_trap(nc_put_vara_float(ncid[0], ids[0], start, count, work));
+		out_vara(nest, ncid[0], ids[0], 3, start, count, work);
 
 		/* Conditionally write the Vx & Vy velocity components */
 		if (nest->out_velocity_x) {
@@ -3316,7 +4677,7 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 				slice_range[2] = MIN(work[ij], slice_range[2]);
 				slice_range[3] = MAX(work[ij], slice_range[3]);
 			}			
-			err_trap(nc_put_vara_float(ncid[0], ids[1], start, count, work));
+			out_vara(nest, ncid[0], ids[1], 3, start, count, work);
 		}
 		if (nest->out_velocity_y) {
 			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++) {
@@ -3327,7 +4688,7 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 				slice_range[4] = MIN(work[ij], slice_range[4]);
 				slice_range[5] = MAX(work[ij], slice_range[5]);
 			}			
-			err_trap (nc_put_vara_float (ncid[0], ids[2], start, count, work));
+			out_vara(nest, ncid[0], ids[2], 3, start, count, work);
 		}
 		if (nest->out_momentum) {
 			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++) {
@@ -3335,13 +4696,13 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 				slice_range[2] = MIN(work[ij], slice_range[2]);
 				slice_range[3] = MAX(work[ij], slice_range[3]);
 			}
-			err_trap (nc_put_vara_float (ncid[0], ids[1], start, count, work));
+			out_vara(nest, ncid[0], ids[1], 3, start, count, work);
 			for (ij = 0; ij < nest->hdr[nest->writeLevel].nm; ij++) {
 				work[ij] = (float)nest->fluxn_d[nest->writeLevel][ij];
 				slice_range[4] = MIN(work[ij], slice_range[2]);
 				slice_range[5] = MAX(work[ij], slice_range[3]);
 			}
-			err_trap (nc_put_vara_float (ncid[0], ids[2], start, count, work));
+			out_vara(nest, ncid[0], ids[2], 3, start, count, work);
 		}
 	}
 	else {
@@ -3351,7 +4712,7 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 					for (col = i_start; col < i_end; col++)
 						work[k++] = (float)(nest->etad[lev][ij_grd(col, row, nest->hdr[lev])] * 100);
 
-				err_trap (nc_put_vara_float (ncid[0], ids[0], start, count, work));
+				out_vara(nest, ncid[0], ids[0], 3, start, count, work);
 			}
 			else if (n == 1) {		/* X velocity */ 
 				for (row = j_start, k = 0; row < j_end; row++) {
@@ -3361,7 +4722,7 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 						            (float)(nest->fluxm_d[lev][ij] / nest->htotal_d[lev][ij] * 100);
 					}
 				}
-				err_trap (nc_put_vara_float (ncid[1], ids[1], start, count, work));
+				out_vara(nest, ncid[1], ids[1], 3, start, count, work);
 			}
 			else {				/* Y velocity */ 
 				for (row = j_start, k = 0; row < j_end; row++) {
@@ -3371,7 +4732,7 @@ void write_most_slice(struct nestContainer *nest, int *ncid, int *ids, unsigned
 						            (float)(nest->fluxn_d[lev][ij] / nest->htotal_d[lev][ij] * 100);
 					}
 				}
-				err_trap (nc_put_vara_float (ncid[2], ids[2], start, count, work));
+				out_vara(nest, ncid[2], ids[2], 3, start, count, work);
 			}
 		}
 	}
@@ -3756,7 +5117,7 @@ void write_anuga_slice(struct nestContainer *nest, int ncid, int z_id, unsigned
 		slice_range[0] = MIN(work[k], slice_range[0]);
 	}
 
-	err_trap (nc_put_vara_float (ncid, z_id, start, count, work));
+	out_vara(nest, ncid, z_id, 2, start, count, work);
 }
 
 /* --------------------------------------------------------------------------- */
@@ -3775,13 +5136,14 @@ void err_trap_(int status) {
  *
  *		Updates only etad and htotal_d
  * -------------------------------------------------------------------- */
-void mass(struct nestContainer *nest, int lev) {
+static FORCE_INLINE void mass_body(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end,
+                                  int long_on, int short_on) {
 
-	int row, col;
+	int row, col, c0, c1;
 	int cm1, rm1;			/* previous column (cm1 = col -1) and row (rm1 = row - 1) */
 	unsigned int ij;
 	double dtdx, dtdy, dd = 0, zzz;
-	double *etaa, *etad, *htotal_d, *bat, *fluxm_a, *fluxn_a;
+	real   *etaa, *etad, *htotal_d, *bat, *fluxm_a, *fluxn_a;
 
 	etaa     = nest->etaa[lev];          etad    = nest->etad[lev];
 	htotal_d = nest->htotal_d[lev];      bat     = nest->bat[lev];
@@ -3790,10 +5152,15 @@ void mass(struct nestContainer *nest, int lev) {
 	dtdx = nest->dt[lev] / nest->hdr[lev].x_inc;
 	dtdy = nest->dt[lev] / nest->hdr[lev].y_inc;
 
-	for (row = 0; row < nest->hdr[lev].ny; row++) {
-		ij = row * nest->hdr[lev].nx;
+	for (row = row_start; row < row_end; row++) {
+		c0 = MIN(MAX(col_start, nest->wet_first[lev][row]), col_end);	/* Permanent land at the row ends only */
+		c1 = MAX(MIN(col_end, nest->wet_last[lev][row]), c0);			/* needs eta to follow bat */
+		ij = row * nest->hdr[lev].nx + c1;
+		for (col = c1; col < col_end; col++, ij++) etad[ij] = -bat[ij];
+		ij = row * nest->hdr[lev].nx + col_start;
+		for (col = col_start; col < c0; col++, ij++) etad[ij] = -bat[ij];
 		rm1 = (row == 0) ? 0 : nest->hdr[lev].nx;
-		for (col = 0; col < nest->hdr[lev].nx; col++) {
+		for (col = c0; col < c1; col++) {
 			/* case ocean and non permanent dry area */
 			if (bat[ij] > MAXRUNUP) {
 				cm1 = (col == 0) ? 0 : 1;
@@ -3811,9 +5178,9 @@ void mass(struct nestContainer *nest, int lev) {
 					etad[ij] = -bat[ij];
 				}
 
-				if (nest->do_long_beach  && (lev == nest->writeLevel) && bat[ij] > 0 && dd < EPS1)
+				if (long_on && bat[ij] > 0 && dd < EPS1)
 					nest->long_beach[lev][ij] = 1;
-				if (nest->do_short_beach && (lev == nest->writeLevel) && bat[ij] < 0 && zzz > EPS1)
+				if (short_on && bat[ij] < 0 && zzz > EPS1)
 					nest->short_beach[lev][ij] = 1;
 			}
 			else {			/* over dry areas htotal is null and eta follows bat */
@@ -3824,6 +5191,11 @@ void mass(struct nestContainer *nest, int lev) {
 	}
 }
 
+MASS_VARIANTS(mass)
+void mass(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	mass_variants[nest->kflags[lev] >> 4](nest, lev, row_start, row_end, col_start, col_end);
+}
+
 /* ---------------------------------------------------------------------- */
 /* Send waves through a boundary */
 /* ---------------------------------------------------------------------- */
@@ -3901,131 +5273,298 @@ void wall_two(struct nestContainer *nest, int ot1, int ot2, int in1, int in2) {
 /* ---------------------------------------------------------------------- */
 /* open boundary condition */
 /* ---------------------------------------------------------------------- */
-void openb(struct grd_header hdr, double *bat, double *fluxm_d, double *fluxn_d, double *etad, struct nestContainer *nest) {
+void openb(struct grd_header hdr, real *bat, real *fluxm_a, real *fluxn_a, real *etad, struct nestContainer *nest) {
+	openb_rows(hdr, bat, fluxm_a, fluxn_a, etad, nest, 0, hdr.ny);
+}
+
+/* --------------------------------------------------------------------- */
+void openb_rows(struct grd_header hdr, real *bat, real *fluxm_a, real *fluxn_a, real *etad, struct nestContainer *nest,
+                int row_start, int row_end) {
+	/* Same as openb() but restricted to the border nodes of the rows [row_start, row_end[ */
+	openb_strided(hdr, bat, fluxm_a, fluxn_a, etad, nest, row_start, row_end, 1, 0);
+}
+
+/* --------------------------------------------------------------------- */
+void openb_strided(struct grd_header hdr, real *bat, real *fluxm_a, real *fluxn_a, real *etad, struct nestContainer *nest,
+                   int row_start, int row_end, int stride, int s) {
+	/* Same as openb_rows() for the scenario S of a pack, whose ETAD and fluxes hold STRIDE scenarios
+	   per node ([node][scenario]). BAT is the one of a single scenario */
+#define PK(ij) ((size_t)(ij) * stride + s)
 
 	int i, j;
 	double uh, zz, d__1, d__2;
 
 	/* ----- first column (South border) */
 	j = 0;
-	for (i = 1; i < hdr.nx - 1; i++) {
+	for (i = 1; row_start == 0 && i < hdr.nx - 1; i++) {
 		if (bat[ij_grd(i,j,hdr)] < EPS5) {
-			etad[ij_grd(i,j,hdr)] = -bat[ij_grd(i,j,hdr)];
+			etad[PK(ij_grd(i,j,hdr))] = -bat[ij_grd(i,j,hdr)];
 			continue;
 		}
-		uh = (fluxm_d[ij_grd(i,j,hdr)] + fluxm_d[ij_grd(i-1,j,hdr)]) * 0.5;
-		d__2 = fluxn_d[ij_grd(i,j,hdr)];
+		uh = (fluxm_a[PK(ij_grd(i,j,hdr))] + fluxm_a[PK(ij_grd(i-1,j,hdr))]) * 0.5;
+		d__2 = fluxn_a[PK(ij_grd(i,j,hdr))];
 		zz = sqrt(uh * uh + d__2 * d__2) / sqrt(NORMAL_GRAV * bat[ij_grd(i,j,hdr)]);
 		if (d__2 > 0) zz *= -1;
-		etad[ij_grd(i,j,hdr)] = zz;
+		etad[PK(ij_grd(i,j,hdr))] = zz;
 	}
 
 	/* ------ last column (North border) */
 	j = hdr.ny - 1;
-	for (i = 1; i < hdr.nx - 1; i++) {
+	for (i = 1; row_end == hdr.ny && i < hdr.nx - 1; i++) {
 		if (bat[ij_grd(i,j,hdr)] > EPS5) {
-			uh = (fluxm_d[ij_grd(i,j,hdr)] + fluxm_d[ij_grd(i-1,j,hdr)]) * 0.5;
-			d__2 = fluxn_d[ij_grd(i,j-1,hdr)];
+			uh = (fluxm_a[PK(ij_grd(i,j,hdr))] + fluxm_a[PK(ij_grd(i-1,j,hdr))]) * 0.5;
+			d__2 = fluxn_a[PK(ij_grd(i,j-1,hdr))];
 			zz = sqrt(uh * uh + d__2 * d__2) / sqrt(NORMAL_GRAV * bat[ij_grd(i,j,hdr)]);
-			if (fluxn_d[ij_grd(i,j-1,hdr)] < 0) zz *= -1;
+			if (fluxn_a[PK(ij_grd(i,j-1,hdr))] < 0) zz *= -1;
 			if (fabs(zz) <= EPS5) zz = 0;
-			etad[ij_grd(i,j,hdr)] = zz;
+			etad[PK(ij_grd(i,j,hdr))] = zz;
 		} 
 		else
-			etad[ij_grd(i,j,hdr)] = -bat[ij_grd(i,j,hdr)];
+			etad[PK(ij_grd(i,j,hdr))] = -bat[ij_grd(i,j,hdr)];
 	}
 
 	/* ------ first row (West border) */
 	i = 0;
-	for (j = 1; j < hdr.ny - 1; j++) {
+	for (j = MAX(1, row_start); j < MIN(hdr.ny - 1, row_end); j++) {
 		if (bat[ij_grd(i,j,hdr)] < EPS5) {
-			etad[ij_grd(i,j,hdr)] = -bat[ij_grd(i,j,hdr)];
+			etad[PK(ij_grd(i,j,hdr))] = -bat[ij_grd(i,j,hdr)];
 			continue;
 		}
 		if (bat[ij_grd(i,j-1,hdr)] > EPS5)
-			uh = (fluxn_d[ij_grd(i,j,hdr)] + fluxn_d[ij_grd(i,j-1,hdr)]) * 0.5;
+			uh = (fluxn_a[PK(ij_grd(i,j,hdr))] + fluxn_a[PK(ij_grd(i,j-1,hdr))]) * 0.5;
 		else
-			uh = fluxn_d[ij_grd(i,j,hdr)];
+			uh = fluxn_a[PK(ij_grd(i,j,hdr))];
 	
-		d__2 = fluxm_d[ij_grd(i,j,hdr)];
+		d__2 = fluxm_a[PK(ij_grd(i,j,hdr))];
 		zz = sqrt(uh * uh + d__2 * d__2) / sqrt(NORMAL_GRAV * bat[ij_grd(i,j,hdr)]);
-		if (fluxm_d[ij_grd(i,j,hdr)] > 0) zz *= -1;
+		if (fluxm_a[PK(ij_grd(i,j,hdr))] > 0) zz *= -1;
 		if (fabs(zz) <= EPS5) zz = 0;
-		etad[ij_grd(i,j,hdr)] = zz;
+		etad[PK(ij_grd(i,j,hdr))] = zz;
 	}
 
 	/* ------- last row (East border) */
 	i = hdr.nx - 1;
-	for (j = 1; j < hdr.ny - 1; j++) {
+	for (j = MAX(1, row_start); j < MIN(hdr.ny - 1, row_end); j++) {
 		if (bat[ij_grd(i,j,hdr)] > EPS5) {
-			uh = (fluxn_d[ij_grd(i,j,hdr)] + fluxn_d[ij_grd(i,j-1,hdr)]) * 0.5;
-			d__2 = fluxm_d[ij_grd(i-1,j,hdr)];
+			uh = (fluxn_a[PK(ij_grd(i,j,hdr))] + fluxn_a[PK(ij_grd(i,j-1,hdr))]) * 0.5;
+			d__2 = fluxm_a[PK(ij_grd(i-1,j,hdr))];
 			zz = sqrt(uh * uh + d__2 * d__2) / sqrt(NORMAL_GRAV * bat[ij_grd(i,j,hdr)]);
-			if (fluxm_d[ij_grd(i-1,j,hdr)] < 0) zz *= -1;
-			etad[ij_grd(i,j,hdr)] = zz;
+			if (fluxm_a[PK(ij_grd(i-1,j,hdr))] < 0) zz *= -1;
+			etad[PK(ij_grd(i,j,hdr))] = zz;
 		} 
 		else
-			etad[ij_grd(i,j,hdr)] = -bat[ij_grd(i,j,hdr)];
+			etad[PK(ij_grd(i,j,hdr))] = -bat[ij_grd(i,j,hdr)];
 	}
 
 	/* -------- first row & first column (SW corner) */
-	if (nest->bnc_border[1] == 0) { 
+	if (nest->bnc_border[1] == 0 && row_start == 0) { 
 		if (bat[0] > EPS5) {
-			zz = sqrt(fluxm_d[0] * fluxm_d[0] + fluxn_d[0] * fluxn_d[0]) / sqrt(NORMAL_GRAV * bat[0]);
-			if (fluxm_d[0] > 0 || fluxn_d[0] > 0) zz *= -1;
+			zz = sqrt(fluxm_a[PK(0)] * fluxm_a[PK(0)] + fluxn_a[PK(0)] * fluxn_a[PK(0)]) / sqrt(NORMAL_GRAV * bat[0]);
+			if (fluxm_a[PK(0)] > 0 || fluxn_a[PK(0)] > 0) zz *= -1;
 			if (fabs(zz) <= EPS5) zz = 0;
-			etad[0] = zz;
+			etad[PK(0)] = zz;
 		} 
 		else
-			etad[0] = -bat[0];
+			etad[PK(0)] = -bat[0];
 	}
 
+	if (row_end < hdr.ny) return;		/* All that remains is on the last row (it writes on ij_grd(0,hdr.ny-1)) */
+
 	/* -------- last row & first column */
 	if (bat[ij_grd(hdr.nx-1,0,hdr)] > EPS5) {
-		d__1 = fluxm_d[ij_grd(hdr.nx-2,0,hdr)];
-		d__2 = fluxn_d[ij_grd(hdr.nx-1,0,hdr)];
+		d__1 = fluxm_a[PK(ij_grd(hdr.nx-2,0,hdr))];
+		d__2 = fluxn_a[PK(ij_grd(hdr.nx-1,0,hdr))];
 		zz = sqrt(d__1 * d__1 + d__2 * d__2) / sqrt(NORMAL_GRAV * bat[ij_grd(hdr.nx-1,0,hdr)]);
-		if (fluxm_d[ij_grd(hdr.nx-2,0,hdr)] < 0 || fluxn_d[ij_grd(hdr.nx-1,0,hdr)] > 0) zz *= -1;
+		if (fluxm_a[PK(ij_grd(hdr.nx-2,0,hdr))] < 0 || fluxn_a[PK(ij_grd(hdr.nx-1,0,hdr))] > 0) zz *= -1;
 		if (fabs(zz) <= EPS5) zz = 0;
-		etad[ij_grd(0,hdr.ny-1,hdr)] = zz;
+		etad[PK(ij_grd(0,hdr.ny-1,hdr))] = zz;
 	} 
 	else
-		etad[ij_grd(0,hdr.ny-1,hdr)] = -bat[ij_grd(0,hdr.ny-1,hdr)];
+		etad[PK(ij_grd(0,hdr.ny-1,hdr))] = -bat[ij_grd(0,hdr.ny-1,hdr)];
 
 	/* -------- first row & last column */
 	if (bat[ij_grd(0,hdr.ny-1,hdr)] > EPS5) {
-		d__1 = fluxm_d[ij_grd(0,hdr.ny-1,hdr)];
-		d__2 = fluxn_d[ij_grd(0,hdr.ny-2,hdr)];
+		d__1 = fluxm_a[PK(ij_grd(0,hdr.ny-1,hdr))];
+		d__2 = fluxn_a[PK(ij_grd(0,hdr.ny-2,hdr))];
 		zz = sqrt(d__1 * d__1 + d__2 * d__2) / sqrt(NORMAL_GRAV * bat[ij_grd(0,hdr.ny-1,hdr)]);
-		if (fluxm_d[ij_grd(0,hdr.ny-1,hdr)] > 0 || fluxn_d[ij_grd(0,hdr.ny-2,hdr)] < 0) zz = -zz;
+		if (fluxm_a[PK(ij_grd(0,hdr.ny-1,hdr))] > 0 || fluxn_a[PK(ij_grd(0,hdr.ny-2,hdr))] < 0) zz = -zz;
 		if (fabs(zz) <= EPS5) zz = 0;
-		etad[ij_grd(0,hdr.ny-1,hdr)] = zz;
+		etad[PK(ij_grd(0,hdr.ny-1,hdr))] = zz;
 	} 
 	else
-		etad[ij_grd(0,hdr.ny-1,hdr)] = -bat[ij_grd(0,hdr.ny-1,hdr)];
+		etad[PK(ij_grd(0,hdr.ny-1,hdr))] = -bat[ij_grd(0,hdr.ny-1,hdr)];
 
 	/* ---------- last row & last column */
 	if (bat[ij_grd(hdr.nx-1,hdr.ny-1,hdr)] > EPS5) {
-		d__1 = fluxm_d[ij_grd(hdr.nx-2,hdr.ny-1,hdr)];
-		d__2 = fluxn_d[ij_grd(hdr.nx-1,hdr.ny-2,hdr)];
+		d__1 = fluxm_a[PK(ij_grd(hdr.nx-2,hdr.ny-1,hdr))];
+		d__2 = fluxn_a[PK(ij_grd(hdr.nx-1,hdr.ny-2,hdr))];
 		zz = sqrt(d__1 * d__1 + d__2 * d__2) / sqrt(NORMAL_GRAV * bat[ij_grd(hdr.nx-1,hdr.ny-1,hdr)]);
-		if (fluxm_d[ij_grd(hdr.nx-2,hdr.ny-1,hdr)] < 0 || fluxn_d[ij_grd(hdr.nx-1,hdr.ny-2,hdr)] < 0) zz *= -1;
-		etad[ij_grd(hdr.nx-1,hdr.ny-1,hdr)] = zz;
+		if (fluxm_a[PK(ij_grd(hdr.nx-2,hdr.ny-1,hdr))] < 0 || fluxn_a[PK(ij_grd(hdr.nx-1,hdr.ny-2,hdr))] < 0) zz *= -1;
+		etad[PK(ij_grd(hdr.nx-1,hdr.ny-1,hdr))] = zz;
 	} 
 	else
-		etad[ij_grd(hdr.nx-1,hdr.ny-1,hdr)] = -bat[ij_grd(hdr.nx-1,hdr.ny-1,hdr)];
+		etad[PK(ij_grd(hdr.nx-1,hdr.ny-1,hdr))] = -bat[ij_grd(hdr.nx-1,hdr.ny-1,hdr)];
+#undef PK
 }
 
 /* --------------------------------------------------------------------- */
 /* update eta and fluxes */
 /* --------------------------------------------------------------------- */
 void update(struct nestContainer *nest, int lev) {
-	memcpy(nest->etaa[lev],    nest->etad[lev],    nest->hdr[lev].nm * sizeof(double));
-	memcpy(nest->fluxm_a[lev], nest->fluxm_d[lev], nest->hdr[lev].nm * sizeof(double));
-	memcpy(nest->fluxn_a[lev], nest->fluxn_d[lev], nest->hdr[lev].nm * sizeof(double));
-	memcpy(nest->htotal_a[lev],nest->htotal_d[lev],nest->hdr[lev].nm * sizeof(double));
+	/* Make the state computed in the last step (the _d arrays) the starting state (the _a arrays)
+	   of the next one. The arrays are swapped instead of copied, which leaves the _d arrays with
+	   the state of the step before. So this is called at the start of a step, right before the
+	   _d arrays are recomputed, and the end of a step only sets new_state. Until then, the newest
+	   state is in the _d arrays, as it was with the old copy. */
+	real *t;
+
+	if (!nest->new_state[lev]) return;		/* First step or after a reset. The start state is in _a */
+	t = nest->etaa[lev];       nest->etaa[lev]     = nest->etad[lev];       nest->etad[lev]     = t;
+	t = nest->fluxm_a[lev];    nest->fluxm_a[lev]  = nest->fluxm_d[lev];    nest->fluxm_d[lev]  = t;
+	t = nest->fluxn_a[lev];    nest->fluxn_a[lev]  = nest->fluxn_d[lev];    nest->fluxn_d[lev]  = t;
+	t = nest->htotal_a[lev];   nest->htotal_a[lev] = nest->htotal_d[lev];   nest->htotal_d[lev] = t;
+	nest->new_state[lev] = FALSE;
+}
+
+/* --------------------------------------------------------------------- */
+void active_region(struct nestContainer *nest, int lev) {
+	/* Set the box of grid LEV that the kernels have to compute in this step. A step is a local
+	   function of the start state (etaa, fluxm_a, fluxn_a, htotal_a) that reaches ACTIVE_PAD cells,
+	   so a cell whose state did not change in the last step, and around which nothing changed
+	   either, will not change now. Its recomputed value would be the one already in both the _a
+	   and the _d arrays (swapped by update()), so it is simply left out. The first two steps are
+	   computed over the whole grid so that both arrays hold the rest state. From then on the box
+	   is the one of the cells that changed in the last step, grown by ACTIVE_PAD. Those can only
+	   be inside the previous box, so only that is scanned. Results are identical to those of
+	   full grid sweeps. Must be called after update() so that the _a arrays hold the newest state. */
+	int row, col, r0, r1, c0, c1, nx = nest->hdr[lev].nx, ny = nest->hdr[lev].ny;
+	size_t ij;
+	real *etaa, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *htotal_a, *htotal_d;
+
+	if (!nest->track_active || nest->act_step[lev] < 2) {
+		nest->act_row0[lev] = nest->act_col0[lev] = 0;
+		nest->act_row1[lev] = ny;		nest->act_col1[lev] = nx;
+		if (nest->track_active) nest->act_step[lev]++;
+		return;
+	}
+
+	etaa     = nest->etaa[lev];         etad     = nest->etad[lev];
+	fluxm_a  = nest->fluxm_a[lev];      fluxm_d  = nest->fluxm_d[lev];
+	fluxn_a  = nest->fluxn_a[lev];      fluxn_d  = nest->fluxn_d[lev];
+	htotal_a = nest->htotal_a[lev];     htotal_d = nest->htotal_d[lev];
+	r0 = ny;	r1 = 0;		c0 = nx;	c1 = 0;
+	for (row = nest->act_row0[lev]; row < nest->act_row1[lev]; row++) {
+		ij = (size_t)row * nx + nest->act_col0[lev];
+		for (col = nest->act_col0[lev]; col < nest->act_col1[lev]; col++, ij++) {
+			if (etaa[ij] != etad[ij] || fluxm_a[ij] != fluxm_d[ij] ||
+			    fluxn_a[ij] != fluxn_d[ij] || htotal_a[ij] != htotal_d[ij]) {
+				r0 = MIN(r0, row);	r1 = MAX(r1, row + 1);
+				c0 = MIN(c0, col);	c1 = MAX(c1, col + 1);
+			}
+		}
+	}
+
+	if (lev < 9 && nest->level[lev+1] > 0) {	/* upscale() writes on the cells covered by the child grid */
+		r0 = MIN(r0, nest->LLrow[lev+1]);	r1 = MAX(r1, nest->ULrow[lev+1] + 1);
+		c0 = MIN(c0, nest->LLcol[lev+1]);	c1 = MAX(c1, nest->LRcol[lev+1] + 1);
+	}
+
+	if (r0 >= r1 || c0 >= c1)		/* Nothing moves. An empty box */
+		r0 = r1 = c0 = c1 = 0;
+	else {							/* Grow the box by the reach of this step */
+		r0 = MAX(r0 - ACTIVE_PAD, 0);	r1 = MIN(r1 + ACTIVE_PAD, ny);
+		c0 = MAX(c0 - ACTIVE_PAD, 0);	c1 = MIN(c1 + ACTIVE_PAD, nx);
+	}
+	nest->act_row0[lev] = r0;	nest->act_row1[lev] = r1;
+	nest->act_col0[lev] = c0;	nest->act_col1[lev] = c1;
+}
+
+/* ---------------------------------------------------------------------- */
+double cfl_time_step(struct nestContainer *nest, int lev, int row0, int row1, int col0, int col1) {
+	/* Time step of grid LEV that gives a Courant number of 0.5 with the largest sqrt(g*h) + |u| found in
+	   the box [row0, row1[ x [col0, col1[ of its newest state. Returns DBL_MAX if there is no water there. */
+	int row, col, nx = nest->hdr[lev].nx;
+	size_t ij;
+	double h, c, c_max = 0, ds;
+	real *bat, *eta, *fluxm, *fluxn;
+
+	bat   = nest->bat[lev];
+	eta   = (nest->new_state[lev]) ? nest->etad[lev]    : nest->etaa[lev];
+	fluxm = (nest->new_state[lev]) ? nest->fluxm_d[lev] : nest->fluxm_a[lev];
+	fluxn = (nest->new_state[lev]) ? nest->fluxn_d[lev] : nest->fluxn_a[lev];
+
+	for (row = row0; row < row1; row++) {
+		for (col = col0, ij = (size_t)row * nx + col0; col < col1; col++, ij++) {
+			if ((h = bat[ij] + eta[ij]) < EPS5) continue;		/* Dry */
+			c = sqrt(NORMAL_GRAV * h);
+			if (h > EPS2) c += sqrt(fluxm[ij] * fluxm[ij] + fluxn[ij] * fluxn[ij]) / h;
+			if (c > c_max) c_max = c;
+		}
+	}
+	if (c_max == 0) return(DBL_MAX);
+
+	ds = MIN(nest->hdr[lev].x_inc, nest->hdr[lev].y_inc);
+	if (nest->isGeog)		/* The meridians get closer towards the poles */
+		ds = MIN(nest->hdr[lev].x_inc * cos(MAX(fabs(nest->hdr[lev].y_min), fabs(nest->hdr[lev].y_max)) * D2R),
+		         nest->hdr[lev].y_inc) * 111000;
+	return(0.5 * ds / c_max);
+}
+
+/* ---------------------------------------------------------------------- */
+int adapt_time_step(struct nestContainer *nest, int max_mult) {
+	/* Set the time steps of all levels for the next base step (-t<dt>+a). The base level takes the
+	   largest multiple, up to MAX_MULT, of the -t step that its water, in the active box, allows.
+	   Each nested level does the smallest integer number of steps per step of its parent (as
+	   nestify() wants) that its whole grid allows. A level whose deepest water is dry or at rest
+	   so takes longer steps. The coefficients that carry dt are recomputed when any of them
+	   changed. Returns the multiple of the -t step picked for the base level. */
+	int lev, m, changed = FALSE;
+	double dt, dt_P, dt_cfl;
+
+	dt_cfl = cfl_time_step(nest, 0, nest->act_row0[0], nest->act_row1[0], nest->act_col0[0], nest->act_col1[0]);
+	m  = (dt_cfl >= max_mult * nest->dt_base) ? max_mult : MAX((int)(dt_cfl / nest->dt_base), 1);
+	dt = m * nest->dt_base;
+	if (dt != nest->dt[0]) {
+		nest->dt[0] = dt;
+		changed = TRUE;
+	}
+
+	for (lev = 1; lev < 10 && nest->level[lev] > 0; lev++) {
+		dt_cfl = cfl_time_step(nest, lev, 0, nest->hdr[lev].ny, 0, nest->hdr[lev].nx);
+		dt_P = nest->dt[nest->parent[lev]];
+		dt = (dt_cfl >= dt_P) ? dt_P : dt_P / ceil(dt_P / dt_cfl);
+		if (dt != nest->dt[lev]) {
+			nest->dt[lev] = dt;
+			changed = TRUE;
+		}
+	}
+
+	if (changed) {
+		if (nest->isGeog) inisp(nest);
+		else if (nest->do_Coriolis) inicart(nest);
+	}
+	return(m);
 }
 
+/* ---------------------------------------------------------------------- */
+static FORCE_INLINE double pow_m7_3(double x) {
+	/* x^(-7/3), the depth factor of the Manning friction, for x > 0. pow() and cbrt() are library calls
+	   that dominate the cost of the friction and block its vectorization. Instead, take a rough guess
+	   of x^(-1/3) from the bits of the float x and refine it with Newton iterations, that have no
+	   divisions. 4 of them give the result to a few ulps. */
+	union {float f; uint32_t i;} g;
+	double r, r3;
+
+	g.f = (float)x;
+	g.i = 0x54a2fa8c - g.i / 3;
+	r  = g.f;
+	r  = r * (4 - x * r * r * r) * (1.0 / 3);
+	r  = r * (4 - x * r * r * r) * (1.0 / 3);
+	r  = r * (4 - x * r * r * r) * (1.0 / 3);
+	r  = r * (4 - x * r * r * r) * (1.0 / 3);
+	r3 = r * r * r;
+	return(r * r3 * r3);
+}
 
 /* -------------------------------------------------------------------------
  * Solve nonlinear momentum equation, cartesian coordinates with moving boundary
@@ -4043,23 +5582,25 @@ void update(struct nestContainer *nest, int lev) {
  *
  *		Updates fluxm_d and fluxn_d
  * ---------------------------------------------------------------------- */
-void moment_M(struct nestContainer *nest, int lev) {
+static FORCE_INLINE void moment_M_body(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end,
+                                  int cor_on, int fric_on, int vel_on) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int rm2, cp2;
-	double xp, xqe, xqq, ff = 0, dd, df, cte, f_limit;
+	double xp, xqe, xqq, ff = 0, dd = 0, df = 0, f_limit;
 	double advx, dtdx, dtdy, advy, rlat;
 	double dpa_ij, dpa_ij_rp1, dpa_ij_rm1, dpa_ij_cm1, dpa_ij_cp1;
 
-	double dt, manning, *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vex, *r4m;
+	double dt, *r4m;
+	real   *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vex, *fric;
 	struct grd_header hdr;
 
 	hdr      = nest->hdr[lev];             vex      = nest->vex[lev];
-	dt       = nest->dt[lev];              manning  = nest->manning[lev];
+	dt       = nest->dt[lev];              fric     = nest->fric[lev];
 	bat      = nest->bat[lev];             etad     = nest->etad[lev];
 	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
 	fluxm_a  = nest->fluxm_a[lev];         fluxm_d  = nest->fluxm_d[lev];
@@ -4080,18 +5621,19 @@ void moment_M(struct nestContainer *nest, int lev) {
 
 	if (nest->do_linear) jupe = 1e6;		/* A tricky way of imposing linearity */
 
-	/* fixes friction parameter */
-	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
-
-	memset(fluxm_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */
+	/* Do this rather than seting to zero under looping conditions. Only the cells of this tile */
+	for (row = row_start; row < row_end; row++)
+		memset(&fluxm_d[row * hdr.nx + col_start], 0, (size_t)(col_end - col_start) * sizeof(real));
 
 	/* main computation cycle fluxm_d */
-	for (row = 0; row < hdr.ny - last; row++) {
+	for (row = row_start; row < MIN(row_end, hdr.ny - last); row++) {
 		rp1 = (row < hdr.ny - 1) ? hdr.nx : 0;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1 + first;
+		c0 = MAX(MAX(col_start, first), nest->wet_first[lev][row]);	/* Skip the permanent land at the row ends */
+		c1 = MIN(MIN(col_end, hdr.nx - 1), nest->wet_last[lev][row]);
+		ij = row * hdr.nx - 1 + c0;
 
-		for (col = first; col < hdr.nx - 1; col++) {
+		for (col = c0; col < c1; col++) {
 			cp1 = 1;
 			cp2 = (col < hdr.nx - 2) ? 2 : 1;
 			cm1 = (col == 0) ? 0 : 1;
@@ -4139,13 +5681,13 @@ void moment_M(struct nestContainer *nest, int lev) {
 
 			if (df < EPS4) df = EPS4;
 			xqq = (fluxn_a[ij] + fluxn_a[ij+cp1] + fluxn_a[ij-rm1] + fluxn_a[ij+cp1-rm1]) * 0.25;
-			ff = (manning != 0 && bat[ij] < nest->manning_depth) ? cte * sqrt(fluxm_a[ij] * fluxm_a[ij] + xqq * xqq) / pow(df, 2.333333) : 0;
+			ff = (fric_on && bat[ij] < nest->manning_depth) ? fric[ij] * dt * sqrt(fluxm_a[ij] * fluxm_a[ij] + xqq * xqq) * pow_m7_3(df) : 0;
 
 			/* computes linear terms in cartesian coordinates */
 			xp = (1 - ff) * fluxm_a[ij] - dtdx * NORMAL_GRAV * dd * (etad[ij+cp1] - etad[ij]);
 
 			/* - if requested computes Coriolis term */
-			if (nest->do_Coriolis) xp += r4m[row] * 2 * xqq;
+			if (cor_on) xp += r4m[row] * 2 * xqq;
 
 			/* - total water depth is smaller than EPS3 >> linear */
 			if (dpa_ij < EPS4) goto L120;
@@ -4222,30 +5764,38 @@ L120:
 			fluxm_d[ij] = xp;
 
 L121:
-			if (nest->out_velocity_x && (lev == nest->writeLevel))
+			if (vel_on)
 				vex[ij] = (valid_vel && dd > EPS3) ? xp / df : 0;
 		}
 	}
 }
 
+MOMENT_VARIANTS(moment_M)
+void moment_M(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	int kf = nest->kflags[lev];
+	moment_M_variants[(kf & (KF_CORIOLIS | KF_FRICTION)) | ((kf & KF_VEL_X) ? 4 : 0)](nest, lev, row_start, row_end, col_start, col_end);
+}
+
 /* -------------------------------------------------------------------- */
-void moment_N(struct nestContainer *nest, int lev) {
+static FORCE_INLINE void moment_N_body(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end,
+                                  int cor_on, int fric_on, int vel_on) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int cm2, rp2;
-	double xq, xpe, xpp, ff = 0, dd, df, cte, f_limit;
+	double xq, xpe, xpp, ff = 0, dd = 0, df = 0, f_limit;
 	double advx, dtdx, dtdy, advy, rlat;
 	double dqa_ij, dqa_ij_rp1, dqa_ij_rm1, dqa_ij_cm1, dqa_ij_cp1;
 
-	double dt, manning, *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vey, *r4n;
+	double dt, *r4n;
+	real   *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *fluxn_d, *vey, *fric;
 	struct grd_header hdr;
 
 	hdr      = nest->hdr[lev];             vey      = nest->vey[lev];
-	dt       = nest->dt[lev];              manning  = nest->manning[lev];
+	dt       = nest->dt[lev];              fric     = nest->fric[lev];
 	bat      = nest->bat[lev];             etad     = nest->etad[lev];
 	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
 	fluxm_a  = nest->fluxm_a[lev];         fluxm_d  = nest->fluxm_d[lev];
@@ -4266,18 +5816,19 @@ void moment_N(struct nestContainer *nest, int lev) {
 
 	if (nest->do_linear) jupe = 1e6;		/* A tricky way of imposing linearity */
 
-	/* fixes friction parameter */
-	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
-
-	memset(fluxn_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */ 
+	/* Do this rather than seting to zero under looping conditions. Only the cells of this tile */
+	for (row = row_start; row < row_end; row++)
+		memset(&fluxn_d[row * hdr.nx + col_start], 0, (size_t)(col_end - col_start) * sizeof(real));
 
 	/* main computation cycle fluxn_d */
-	for (row = first; row < hdr.ny - 1; row++) {
+	for (row = MAX(row_start, first); row < MIN(row_end, hdr.ny - 1); row++) {
 		rp1 = hdr.nx;
 		rp2 = (row < hdr.ny - 2) ? 2*hdr.nx : hdr.nx;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1;
-		for (col = 0; col < hdr.nx - last; col++) {
+		c0 = MAX(col_start, nest->wet_first[lev][row]);	/* Skip the permanent land at the row ends */
+		c1 = MIN(MIN(col_end, hdr.nx - last), nest->wet_last[lev][row]);
+		ij = row * hdr.nx - 1 + c0;
+		for (col = c0; col < c1; col++) {
 			cp1 = (col < hdr.nx - 1) ? 1 : 0;
 			cm1 = (col == 0) ? 0 : 1;
 			ij++;
@@ -4325,13 +5876,13 @@ void moment_N(struct nestContainer *nest, int lev) {
 
 			if (df < EPS4) df = EPS4;
 			xpp = (fluxm_a[ij] + fluxm_a[ij+rp1] + fluxm_a[ij-cm1] + fluxm_a[ij-cm1+rp1]) * 0.25;
-			ff = (manning != 0 && bat[ij] < nest->manning_depth) ? cte * sqrt(fluxn_a[ij] * fluxn_a[ij] + xpp * xpp) / pow(df, 2.333333) : 0;
+			ff = (fric_on && bat[ij] < nest->manning_depth) ? fric[ij] * dt * sqrt(fluxn_a[ij] * fluxn_a[ij] + xpp * xpp) * pow_m7_3(df) : 0;
 
 			/* computes linear terms of N in cartesian coordinates */
 			xq = (1 - ff) * fluxn_a[ij] - dtdy * NORMAL_GRAV * dd * (etad[ij+rp1] - etad[ij]);
 
 			/* - if requested computes coriolis term */
-			if (nest->do_Coriolis)
+			if (cor_on)
 				xq -= r4n[row] * 2 * xpp;
 
 			/* - total water depth is smaller than EPS3 >> linear */
@@ -4407,88 +5958,865 @@ L200:
 			fluxn_d[ij] = xq;
 
 L201:
-			if (nest->out_velocity_y && (lev == nest->writeLevel))
+			if (vel_on)
 				vey[ij] = (valid_vel && dd > EPS3) ? xq / df : 0;
 		}
 	}
 }
 
-/* -------------------------------------------------------------------- */
-/* initializes parameters needed for spherical computations */
-/* -------------------------------------------------------------------- */
-void inisp(struct nestContainer *nest) {
-	int row, k = 0;
-	double phim_rad, phin_rad, omega, raio_t, dxtemp, dytemp, dt;
+MOMENT_VARIANTS(moment_N)
+void moment_N(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	int kf = nest->kflags[lev];
+	moment_N_variants[(kf & (KF_CORIOLIS | KF_FRICTION)) | ((kf & KF_VEL_Y) ? 4 : 0)](nest, lev, row_start, row_end, col_start, col_end);
+}
 
-	raio_t = 6.371e6;
-	omega = 7.2722e-5;
-	while (nest->level[k] >= 0) {
-		dt = nest->dt[k];
-		dxtemp = raio_t * nest->hdr[k].x_inc * D2R;
-		dytemp = raio_t * nest->hdr[k].y_inc * D2R;
-		for (row = 0; row < nest->hdr[k].ny; row++) {
-			phim_rad = (nest->hdr[k].y_min + row * nest->hdr[k].y_inc) * D2R;
-			phin_rad = (nest->hdr[k].y_min + (row + 0.5) * nest->hdr[k].y_inc) * D2R;
-			nest->r0[k][row] = dt / dytemp;
-			nest->r1m[k][row] = sin(phim_rad);
-			nest->r1n[k][row] = cos(phin_rad);
-			nest->r2m[k][row] = dt / dxtemp / cos(phim_rad);
-			nest->r2n[k][row] = dt / dytemp / cos(phin_rad);
-			nest->r3m[k][row] = NORMAL_GRAV * (dt / dxtemp) / cos(phim_rad);
-			nest->r3n[k][row] = NORMAL_GRAV * (dt / dytemp);
-			nest->r4m[k][row] = dt * omega * sin(phim_rad);
-			nest->r4n[k][row] = dt * omega * sin(phin_rad);
+/* -------------------------------------------------------------------------
+ * The linear kernels for a pack of SCEN_PACK -Fb scenarios, whose state arrays are interleaved
+ * per node ([node][scenario]). One sweep advances all of them, so the bathymetry and the wet
+ * spans are read once per pack and the inner loops run across the scenarios. They are the
+ * mass() and moment_M|N() of a base level grid (no nesting) in cartesian coordinates with -L,
+ * no friction, no Coriolis and no velocities saved (see pack_lane()), and give the same results.
+ * The moment terms are evaluated as in moment_M|N_seg() (depths in double, slope in real) so that
+ * this also holds with SINGLE_PRECISION.
+ * ---------------------------------------------------------------------- */
+void mass_pack(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	int row, col, c0, c1, s;
+	size_t ij, cm1, rm1;
+	double dtdx, dtdy, dd, zzz;
+	real   *etaa, *etad, *htotal_d, *bat, *fluxm_a, *fluxn_a, *m, *n, b;
+
+	etaa     = nest->etaa[lev];          etad    = nest->etad[lev];
+	htotal_d = nest->htotal_d[lev];      bat     = nest->bat[lev];
+	fluxm_a  = nest->fluxm_a[lev];       fluxn_a = nest->fluxn_a[lev];
+
+	dtdx = nest->dt[lev] / nest->hdr[lev].x_inc;
+	dtdy = nest->dt[lev] / nest->hdr[lev].y_inc;
+
+	for (row = row_start; row < row_end; row++) {
+		c0 = MIN(MAX(col_start, nest->wet_first[lev][row]), col_end);
+		c1 = MAX(MIN(col_end, nest->wet_last[lev][row]), c0);
+		ij = (size_t)row * nest->hdr[lev].nx + c1;
+		for (col = c1; col < col_end; col++, ij++)
+			for (s = 0; s < SCEN_PACK; s++) etad[ij * SCEN_PACK + s] = -bat[ij];
+		ij = (size_t)row * nest->hdr[lev].nx + col_start;
+		for (col = col_start; col < c0; col++, ij++)
+			for (s = 0; s < SCEN_PACK; s++) etad[ij * SCEN_PACK + s] = -bat[ij];
+		rm1 = (row == 0) ? 0 : (size_t)nest->hdr[lev].nx * SCEN_PACK;
+		for (col = c0; col < c1; col++, ij++) {
+			b = bat[ij];
+			if (b > MAXRUNUP) {
+				cm1 = (col == 0) ? 0 : SCEN_PACK;
+				m = &fluxm_a[ij * SCEN_PACK];		n = &fluxn_a[ij * SCEN_PACK];
+				for (s = 0; s < SCEN_PACK; s++) {
+					zzz = etaa[ij * SCEN_PACK + s] - dtdx * (m[s] - m[s-cm1]) - dtdy * (n[s] - n[s-rm1]);
+					dd = zzz + b;
+					htotal_d[ij * SCEN_PACK + s] = (dd > EPS10) ? dd : 0;
+					etad[ij * SCEN_PACK + s]     = (dd > EPS10) ? zzz : -b;
+				}
+			}
+			else
+				for (s = 0; s < SCEN_PACK; s++) etad[ij * SCEN_PACK + s] = -b;
 		}
-		k++;
 	}
 }
 
 /* -------------------------------------------------------------------- */
-/* initializes vectors needed for computing the Coriolis  */
-/* -------------------------------------------------------------------- */
-void inicart(struct nestContainer *nest) {
-	int row, k = 0;
-	double phim_rad, phin_rad, dt, omega = 7.2722e-5;
+void moment_M_pack(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	int row, col, c0, c1, s;
+	size_t ij, k;
+	double xp, dd, dtdx, b0, b1, h0, h1, e0, e1;
+	real   *bat, *htotal_d, *etad, *fluxm_a, *fluxm_d;
+	struct grd_header hdr;
 
-	while (nest->level[k] >= 0) {
-		dt = nest->dt[k];
-		for (row = 0; row < nest->hdr[k].ny; row++) {
-			phim_rad = nest->lat_min4Coriolis + row * nest->hdr[k].y_inc * M_PI / 2e9;
-			phin_rad = nest->lat_min4Coriolis + (row * nest->hdr[k].y_inc + nest->hdr[k].y_inc / 2.) * M_PI / 2e9;
-			nest->r4m[k][row] = dt * omega * sin(phim_rad);
-			nest->r4n[k][row] = dt * omega * sin(phin_rad);
+	hdr      = nest->hdr[lev];             bat      = nest->bat[lev];
+	etad     = nest->etad[lev];            htotal_d = nest->htotal_d[lev];
+	fluxm_a  = nest->fluxm_a[lev];         fluxm_d  = nest->fluxm_d[lev];
+	dtdx = nest->dt[lev] / hdr.x_inc;
+
+	for (row = row_start; row < row_end; row++)
+		memset(&fluxm_d[((size_t)row * hdr.nx + col_start) * SCEN_PACK], 0, (size_t)(col_end - col_start) * SCEN_PACK * sizeof(real));
+
+	for (row = row_start; row < MIN(row_end, hdr.ny - 1); row++) {
+		c0 = MAX(col_start, nest->wet_first[lev][row]);
+		c1 = MIN(MIN(col_end, hdr.nx - 1), nest->wet_last[lev][row]);
+		for (col = c0; col < c1; col++) {
+			ij = (size_t)row * hdr.nx + col;
+			b0 = bat[ij];		b1 = bat[ij+1];
+			if (b0 <= MAXRUNUP) continue;		/* no flux to permanent dry areas */
+			for (s = 0; s < SCEN_PACK; s++) {
+				k  = ij * SCEN_PACK + s;
+				h0 = htotal_d[k];	h1 = htotal_d[k+SCEN_PACK];
+				e0 = etad[k];		e1 = etad[k+SCEN_PACK];
+				if (h0 > EPS5 && h1 > EPS5) {		/* case wet-wet */
+					if (-b1 >= e0)
+						dd = h1;
+					else if (-b0 >= e1)
+						dd = h0;
+					else {
+						dd = (h0 + h1) * 0.5;
+						if (dd < EPS5) dd = 0;
+					}
+				}
+				else if (h0 > EPS5 && h1 < EPS5 && e0 >= e1)	/* case wet-dry */
+					dd = (b0 > b1) ? e0 - e1 : h0;
+				else if (h0 < EPS5 && h1 > EPS5 && e0 <= e1)	/* case dry-wet */
+					dd = (b0 > b1) ? h1 : e1 - e0;
+				else
+					continue;
+				if (dd < EPS4) continue;
+
+				xp = fluxm_a[k] - dtdx * NORMAL_GRAV * dd * (etad[k+SCEN_PACK] - etad[k]);
+#ifdef LIMIT_DISCHARGE
+				if (fabs(xp) < EPS10)
+					xp = 0;
+				else if (xp > V_LIMIT * dd)
+					xp = V_LIMIT * dd;
+				else if (xp < -V_LIMIT * dd)
+					xp = -V_LIMIT * dd;
+#endif
+				fluxm_d[k] = xp;
+			}
 		}
-		k++;
 	}
 }
 
 /* -------------------------------------------------------------------- */
-/* solves non linear continuity equation w/ spherical coordinates */
-/* Computes water depth (htotal) needed for friction and */
-/* moving boundary algorithm */
-/* htotal < 0 - dry cell htotal (m) above still water */
-/* htotal > 0 - wet cell with htotal (m) of water depth */
-/* -------------------------------------------------------------------- */
-void mass_sp(struct nestContainer *nest, int lev) {
+void moment_N_pack(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	int row, col, c0, c1, s;
+	size_t ij, k, rp1;
+	double xq, dd, dtdy, b0, b1, h0, h1, e0, e1;
+	real   *bat, *htotal_d, *etad, *fluxn_a, *fluxn_d;
+	struct grd_header hdr;
 
-	unsigned int ij;
-	int row, col;
-	int cm1, rm1, rowm1;			/* previous column (cm1 = col -1) and row (rm1 = row - 1) */
-	double etan, dd;
+	hdr      = nest->hdr[lev];             bat      = nest->bat[lev];
+	etad     = nest->etad[lev];            htotal_d = nest->htotal_d[lev];
+	fluxn_a  = nest->fluxn_a[lev];         fluxn_d  = nest->fluxn_d[lev];
+	dtdy = nest->dt[lev] / hdr.y_inc;
+	rp1  = (size_t)hdr.nx * SCEN_PACK;
+
+	for (row = row_start; row < row_end; row++)
+		memset(&fluxn_d[((size_t)row * hdr.nx + col_start) * SCEN_PACK], 0, (size_t)(col_end - col_start) * SCEN_PACK * sizeof(real));
+
+	for (row = row_start; row < MIN(row_end, hdr.ny - 1); row++) {
+		c0 = MAX(col_start, nest->wet_first[lev][row]);
+		c1 = MIN(MIN(col_end, hdr.nx - 1), nest->wet_last[lev][row]);
+		for (col = c0; col < c1; col++) {
+			ij = (size_t)row * hdr.nx + col;
+			b0 = bat[ij];		b1 = bat[ij+hdr.nx];
+			if (b0 <= MAXRUNUP) continue;
+			for (s = 0; s < SCEN_PACK; s++) {
+				k  = ij * SCEN_PACK + s;
+				h0 = htotal_d[k];	h1 = htotal_d[k+rp1];
+				e0 = etad[k];		e1 = etad[k+rp1];
+				if (h0 > EPS5 && h1 > EPS5) {
+					if (-b1 >= e0)
+						dd = h1;
+					else if (-b0 >= e1)
+						dd = h0;
+					else {
+						dd = (h0 + h1) * 0.5;
+						if (dd < EPS5) dd = 0;
+					}
+				}
+				else if (h0 > EPS5 && h1 < EPS5 && e0 > e1)
+					dd = (b0 > b1) ? e0 - e1 : h0;
+				else if (h0 < EPS5 && h1 > EPS5 && e1 > e0)
+					dd = (b0 > b1) ? h1 : e1 - e0;
+				else
+					continue;
+				if (dd < EPS4) continue;
 
-	for (row = 0; row < nest->hdr[lev].ny; row++) {
-		ij = row * nest->hdr[lev].nx;
-		rm1 = ((row == 0) ? 0 : 1) * nest->hdr[lev].nx;
-		rowm1 = MAX(row - 1, 0);
-		for (col = 0; col < nest->hdr[lev].nx; col++) {
-			/* case ocean and non permanent dry area */
-			if (nest->bat[lev][ij] > MAXRUNUP) {
-				cm1 = (col == 0) ? 0 : 1;
-				etan = nest->etaa[lev][ij] - nest->r2m[lev][row] * (nest->fluxm_a[lev][ij] - nest->fluxm_a[lev][ij-cm1])
-				     - nest->r2n[lev][row] * (nest->fluxn_a[lev][ij] * nest->r1n[lev][row]
-				     - nest->fluxn_a[lev][ij-rm1] * nest->r1n[lev][rowm1]);
-				if (fabs(etan) < EPS10) etan = 0;
-				dd = etan + nest->bat[lev][ij];
+				xq = fluxn_a[k] - dtdy * NORMAL_GRAV * dd * (etad[k+rp1] - etad[k]);
+#ifdef LIMIT_DISCHARGE
+				if (fabs(xq) < EPS10)
+					xq = 0;
+				else if (xq > V_LIMIT * dd)
+					xq = V_LIMIT * dd;
+				else if (xq < -V_LIMIT * dd)
+					xq = -V_LIMIT * dd;
+#endif
+				fluxn_d[k] = xq;
+			}
+		}
+	}
+}
+
+/* -------------------------------------------------------------------------
+ * Vectorized versions of moment_M() and moment_N()
+ *
+ * The moving boundary cases (wet-wet b2/d2/b3, wet-dry a3/d1, dry-wet b1/c3), the upwind
+ * selections and the discharge limit are all evaluated for every cell and the right one is
+ * picked with selects instead of branches, so that the compiler turns the row loops into
+ * AVX2 or AVX-512 code with masks and blends. All the cell expressions are the same as in the
+ * scalar kernels and evaluated in the same order, so results match them to the last bit
+ * unless the compiler contracts a multiply and an add into a FMA (AVX-512 builds), in which
+ * case the difference stays below 1e-12 relative. The edge columns, where the cm1/cp1/cp2
+ * offsets are not constant, and the lateral buffer of linear columns are left to the scalar
+ * kernels. The Manning friction, only needed where -X is set, is computed in a separate loop.
+ * ---------------------------------------------------------------------- */
+#ifdef DO_SIMD
+/* The output arrays never overlap the input ones, but the compiler cannot know it */
+#	ifdef __clang__
+#		define SIMD_LOOP _Pragma("clang loop vectorize(assume_safety)")
+#	else
+#		define SIMD_LOOP _Pragma("GCC ivdep")
+#	endif
+/* GCC only vectorizes cheap loops at -O2 and, without -fno-tree-sink, moves the divisions
+   back under the selects where they are no longer if-convertible. The same happens with the
+   double to float conversions of a SINGLE_PRECISION build unless they are known not to trap */
+#	if defined(__clang__)
+#		define SIMD_INLINE      __attribute__((always_inline))
+#		define SIMD_TARGET(isa) __attribute__((target(isa)))
+#	else
+#		define SIMD_OPTIMIZE    optimize("tree-vectorize", "vect-cost-model=dynamic", "no-tree-sink", "no-trapping-math")
+#		define SIMD_INLINE      __attribute__((always_inline, SIMD_OPTIMIZE))
+#		define SIMD_TARGET(isa) __attribute__((target(isa), SIMD_OPTIMIZE))
+#	endif
+
+static SIMD_INLINE inline
+void moment_M_seg(struct nestContainer *nest, int lev, int row, int col_start, int col_end, int linear) {
+	/* Compute fluxm_d for the cells [col_start, col_end[ of ROW. Requires col_start >= 1 and col_end <= nx - 2 */
+	int k, n, col, rp1, rm1, rm2, do_vex, cor_on;
+	size_t ij;
+	double dd_v[SIMD_CHUNK], df_v[SIMD_CHUNK], ff_v[SIMD_CHUNK], vv_v[SIMD_CHUNK];
+	double h0, h1, e0, e1, e01, e10, b0, b1, dpa, avg, d, f, fm0, xqq, xqe, xqe2, xp, xpc, r4m_row, f_limit, ff;
+	double dpa_cp1, dpa_cm1, dpa_rp1, dpa_rm1, adv_cp1, adv_cm1, adv_1, adv_2, advx, advy;
+	int ww, b2, d2, wd, dw, act;
+	double dt, dtdx, dtdy, m_depth;
+	real   *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *vex, *fric;
+	struct grd_header hdr;
+
+	hdr      = nest->hdr[lev];             vex      = nest->vex[lev];
+	fric     = nest->fric[lev];            bat      = nest->bat[lev];
+	etad     = nest->etad[lev];            fluxm_d  = nest->fluxm_d[lev];
+	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
+	fluxm_a  = nest->fluxm_a[lev];         fluxn_a  = nest->fluxn_a[lev];
+
+	dt   = nest->dt[lev];
+	m_depth = nest->manning_depth;		/* Friction only where shallower than this */
+	dtdx = dt / hdr.x_inc;
+	dtdy = dt / hdr.y_inc;
+	rp1  = (row < hdr.ny - 1) ? hdr.nx : 0;
+	rm1  = (row == 0) ? 0 : hdr.nx;
+	rm2  = (row < 2) ? 0 : 2 * hdr.nx;
+	cor_on  = nest->do_Coriolis;
+	r4m_row = (cor_on) ? nest->r4m[lev][row] : 0;
+	do_vex  = (nest->out_velocity_x && (lev == nest->writeLevel));
+
+	for (col = col_start; col < col_end; col += SIMD_CHUNK) {
+		n = MIN(SIMD_CHUNK, col_end - col);
+
+		/* Moving boundary. dd_v = 0 flags the cells that get no flux */
+		SIMD_LOOP
+		for (k = 0; k < n; k++) {
+			ij = (size_t)row * hdr.nx + col + k;
+			h0 = htotal_d[ij];    h1 = htotal_d[ij+1];
+			e0 = etad[ij];        e1 = etad[ij+1];
+			b0 = bat[ij];         b1 = bat[ij+1];
+			dpa = (h0 + htotal_a[ij] + h1 + htotal_a[ij+1]) * 0.25;
+			dpa = (dpa > EPS5) ? dpa : 0;
+			avg = (h0 + h1) * 0.5;
+			avg = (avg < EPS5) ? 0 : avg;
+			ww  = (h0 > EPS5) & (h1 > EPS5);
+			b2  = ww & (-b1 >= e0);
+			d2  = ww & !b2 & (-b0 >= e1);
+			wd  = (h0 > EPS5) & (h1 < EPS5) & (e0 >= e1);
+			dw  = (h0 < EPS5) & (h1 > EPS5) & (e0 <= e1);
+			e10 = e1 - e0;        e01 = e0 - e1;
+			d   = (b0 > b1) ? h1 : e10;                      /* dry-wet */
+			d   = (wd) ? ((b0 > b1) ? e01 : h0) : d;         /* wet-dry */
+			d   = (ww) ? avg : d;                           /* b3/d3 */
+			d   = (d2) ? h0 : d;
+			d   = (b2) ? h1 : d;
+			f   = (ww & !b2 & !d2) ? dpa : d;
+			act = (b0 > MAXRUNUP) & (ww | wd | dw) & !(d < EPS4);
+			dd_v[k] = (act) ? d : 0;
+			df_v[k] = (f < EPS4) ? EPS4 : f;
+			vv_v[k] = (b2 | d2) ? 0 : 1;
+		}
+
+		/* Friction. The depth factor vectorizes, the sqrt() does not (it may set errno) */
+		if (fric) {
+			SIMD_LOOP
+			for (k = 0; k < n; k++) {
+				ij = (size_t)row * hdr.nx + col + k;
+				ff = fric[ij] * dt * pow_m7_3(df_v[k]);
+				ff_v[k] = ((dd_v[k] > 0) & (bat[ij] < m_depth)) ? ff : 0;
+			}
+			for (k = 0; k < n; k++) {
+				if (ff_v[k] == 0) continue;
+				ij = (size_t)row * hdr.nx + col + k;
+				xqq = (fluxn_a[ij] + fluxn_a[ij+1] + fluxn_a[ij-rm1] + fluxn_a[ij+1-rm1]) * 0.25;
+				ff_v[k] *= sqrt(fluxm_a[ij] * fluxm_a[ij] + xqq * xqq);
+			}
+		}
+		else
+			for (k = 0; k < n; k++) ff_v[k] = 0;
+
+		/* Linear and convection terms */
+		SIMD_LOOP
+		for (k = 0; k < n; k++) {
+			ij = (size_t)row * hdr.nx + col + k;
+			h0  = htotal_d[ij];    h1 = htotal_d[ij+1];
+			fm0 = fluxm_a[ij];
+			dpa = (h0 + htotal_a[ij] + h1 + htotal_a[ij+1]) * 0.25;
+			dpa = (dpa > EPS5) ? dpa : 0;
+			xqq = (fluxn_a[ij] + fluxn_a[ij+1] + fluxn_a[ij-rm1] + fluxn_a[ij+1-rm1]) * 0.25;
+			xp  = (1 - ff_v[k]) * fm0 - dtdx * NORMAL_GRAV * dd_v[k] * (etad[ij+1] - etad[ij]);
+			xpc = xp + r4m_row * 2 * xqq;
+			xp  = (cor_on) ? xpc : xp;
+
+			/* upwind scheme for x-direction volume flux */
+			dpa_cp1 = (h1 + htotal_a[ij+1] + htotal_d[ij+2] + htotal_a[ij+2]) * 0.25;
+			dpa_cm1 = (htotal_d[ij-1] + htotal_a[ij-1] + h0 + htotal_a[ij]) * 0.25;
+			adv_1   = -dtdx * (fm0 * fm0 / dpa);
+			adv_cp1 =  dtdx * (fluxm_a[ij+1] * fluxm_a[ij+1] / dpa_cp1 - fm0 * fm0 / dpa);
+			adv_2   =  dtdx * (fm0 * fm0 / dpa);
+			adv_cm1 =  dtdx * (fm0 * fm0 / dpa - fluxm_a[ij-1] * fluxm_a[ij-1] / dpa_cm1);
+			adv_cp1 = (dpa_cp1 < EPS3) ? adv_1 : adv_cp1;
+			adv_cp1 = (h1 < EPS5)      ? adv_1 : adv_cp1;
+			adv_cm1 = (dpa_cm1 < EPS3) ? adv_2 : adv_cm1;
+			adv_cm1 = (h0 < EPS5)      ? adv_2 : adv_cm1;
+			advx    = (fm0 < 0) ? adv_cp1 : adv_cm1;
+
+			/* upwind scheme for y-direction volume flux */
+			dpa_rp1 = (htotal_d[ij+rp1] + htotal_a[ij+rp1] + htotal_d[ij+1+rp1] + htotal_a[ij+1+rp1]) * 0.25;
+			dpa_rm1 = (htotal_d[ij-rm1] + htotal_a[ij-rm1] + htotal_d[ij+1-rm1] + htotal_a[ij+1-rm1]) * 0.25;
+			xqe     = (fluxn_a[ij+rp1] + fluxn_a[ij+1+rp1] + fluxn_a[ij] + fluxn_a[ij+1]) * 0.25;
+			xqe2    = (fluxn_a[ij-rm1] + fluxn_a[ij+1-rm1] + fluxn_a[ij-rm2] + fluxn_a[ij+1-rm2]) * 0.25;
+			adv_1   = -dtdy * (fm0 * xqq / dpa);
+			adv_cp1 =  dtdy * (fluxm_a[ij+rp1] * xqe / dpa_rp1 - fm0 * xqq / dpa);
+			adv_2   =  dtdy * (fm0 * xqq / dpa);
+			adv_cm1 =  dtdy * (fm0 * xqq / dpa - fluxm_a[ij-rm1] * xqe2 / dpa_rm1);
+			adv_cp1 = (htotal_d[ij+rp1] < EPS5)   ? adv_1 : adv_cp1;
+			adv_cp1 = (htotal_d[ij+1+rp1] < EPS5) ? adv_1 : adv_cp1;
+			adv_cp1 = (dpa_rp1 < EPS5)            ? adv_1 : adv_cp1;
+			adv_cm1 = (htotal_d[ij-rm1] < EPS5)   ? adv_2 : adv_cm1;
+			adv_cm1 = (htotal_d[ij+1-rm1] < EPS5) ? adv_2 : adv_cm1;
+			adv_cm1 = (dpa_rm1 < EPS5)            ? adv_2 : adv_cm1;
+			advy    = (xqq < 0) ? adv_cp1 : adv_cm1;
+
+			xpc = xp - advx - advy;
+			xp  = (!linear & !(dpa < EPS4)) ? xpc : xp;
+			xp /= (ff_v[k] + 1);
+#ifdef LIMIT_DISCHARGE
+			f_limit = V_LIMIT * dd_v[k];
+			xp = (fabs(xp) < EPS10) ? 0 : ((xp > f_limit) ? f_limit : ((xp < -f_limit) ? -f_limit : xp));
+#endif
+			fluxm_d[ij] = (dd_v[k] > 0) ? xp : 0;
+		}
+
+		if (do_vex) {
+			SIMD_LOOP
+			for (k = 0; k < n; k++) {
+				ij = (size_t)row * hdr.nx + col + k;
+				d  = fluxm_d[ij] / df_v[k];
+				d  = (vv_v[k] != 0 && dd_v[k] > EPS3) ? d : 0;
+				vex[ij] = (bat[ij] <= MAXRUNUP) ? vex[ij] : d;
+			}
+		}
+	}
+}
+
+static SIMD_INLINE inline
+void moment_N_seg(struct nestContainer *nest, int lev, int row, int col_start, int col_end, int linear) {
+	/* Compute fluxn_d for the cells [col_start, col_end[ of ROW. Requires col_start >= 2, col_end <= nx - 1 and row < ny - 1 */
+	int k, n, col, rp1, rp2, rm1, do_vey, cor_on;
+	size_t ij;
+	double dd_v[SIMD_CHUNK], df_v[SIMD_CHUNK], ff_v[SIMD_CHUNK], vv_v[SIMD_CHUNK];
+	double h0, h1, e0, e1, e01, e10, b0, b1, dqa, avg, d, f, fn0, xpp, xpe, xpe2, xq, xqc, r4n_row, f_limit, ff;
+	double dqa_cp1, dqa_cm1, dqa_rp1, dqa_rm1, adv_cp1, adv_cm1, adv_1, adv_2, advx, advy;
+	int ww, b2, d2, wd, dw, act;
+	double dt, dtdx, dtdy, m_depth;
+	real   *bat, *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxn_d, *fluxn_a, *vey, *fric;
+	struct grd_header hdr;
+
+	hdr      = nest->hdr[lev];             vey      = nest->vey[lev];
+	fric     = nest->fric[lev];            bat      = nest->bat[lev];
+	etad     = nest->etad[lev];            fluxn_d  = nest->fluxn_d[lev];
+	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
+	fluxm_a  = nest->fluxm_a[lev];         fluxn_a  = nest->fluxn_a[lev];
+
+	dt   = nest->dt[lev];
+	m_depth = nest->manning_depth;		/* Friction only where shallower than this */
+	dtdx = dt / hdr.x_inc;
+	dtdy = dt / hdr.y_inc;
+	rp1  = hdr.nx;
+	rp2  = (row < hdr.ny - 2) ? 2 * hdr.nx : hdr.nx;
+	rm1  = (row == 0) ? 0 : hdr.nx;
+	cor_on  = nest->do_Coriolis;
+	r4n_row = (cor_on) ? nest->r4n[lev][row] : 0;
+	do_vey  = (nest->out_velocity_y && (lev == nest->writeLevel));
+
+	for (col = col_start; col < col_end; col += SIMD_CHUNK) {
+		n = MIN(SIMD_CHUNK, col_end - col);
+
+		/* Moving boundary - Imamura algorithm following cho 2009. dd_v = 0 flags the cells that get no flux */
+		SIMD_LOOP
+		for (k = 0; k < n; k++) {
+			ij = (size_t)row * hdr.nx + col + k;
+			h0 = htotal_d[ij];    h1 = htotal_d[ij+rp1];
+			e0 = etad[ij];        e1 = etad[ij+rp1];
+			b0 = bat[ij];         b1 = bat[ij+rp1];
+			dqa = (h0 + htotal_a[ij] + h1 + htotal_a[ij+rp1]) * 0.25;
+			dqa = (dqa > EPS5) ? dqa : 0;
+			avg = (h0 + h1) * 0.5;
+			avg = (avg < EPS5) ? 0 : avg;
+			ww  = (h0 > EPS5) & (h1 > EPS5);
+			b2  = ww & (-b1 >= e0);
+			d2  = ww & !b2 & (-b0 >= e1);
+			wd  = (h0 > EPS5) & (h1 < EPS5) & (e0 > e1);
+			dw  = (h0 < EPS5) & (h1 > EPS5) & (e1 > e0);
+			e10 = e1 - e0;        e01 = e0 - e1;
+			d   = (b0 > b1) ? h1 : e10;                      /* dry-wet */
+			d   = (wd) ? ((b0 > b1) ? e01 : h0) : d;         /* wet-dry */
+			d   = (ww) ? avg : d;                           /* b3/d3 */
+			d   = (d2) ? h0 : d;
+			d   = (b2) ? h1 : d;
+			f   = (ww & !b2 & !d2) ? dqa : d;
+			act = (b0 > MAXRUNUP) & (ww | wd | dw) & !(d < EPS4);
+			dd_v[k] = (act) ? d : 0;
+			df_v[k] = (f < EPS4) ? EPS4 : f;
+			vv_v[k] = (b2 | d2) ? 0 : 1;
+		}
+
+		/* Friction. The depth factor vectorizes, the sqrt() does not (it may set errno) */
+		if (fric) {
+			SIMD_LOOP
+			for (k = 0; k < n; k++) {
+				ij = (size_t)row * hdr.nx + col + k;
+				ff = fric[ij] * dt * pow_m7_3(df_v[k]);
+				ff_v[k] = ((dd_v[k] > 0) & (bat[ij] < m_depth)) ? ff : 0;
+			}
+			for (k = 0; k < n; k++) {
+				if (ff_v[k] == 0) continue;
+				ij = (size_t)row * hdr.nx + col + k;
+				xpp = (fluxm_a[ij] + fluxm_a[ij+rp1] + fluxm_a[ij-1] + fluxm_a[ij-1+rp1]) * 0.25;
+				ff_v[k] *= sqrt(fluxn_a[ij] * fluxn_a[ij] + xpp * xpp);
+			}
+		}
+		else
+			for (k = 0; k < n; k++) ff_v[k] = 0;
+
+		/* Linear and convection terms */
+		SIMD_LOOP
+		for (k = 0; k < n; k++) {
+			ij = (size_t)row * hdr.nx + col + k;
+			h0  = htotal_d[ij];    h1 = htotal_d[ij+rp1];
+			fn0 = fluxn_a[ij];
+			dqa = (h0 + htotal_a[ij] + h1 + htotal_a[ij+rp1]) * 0.25;
+			dqa = (dqa > EPS5) ? dqa : 0;
+			xpp = (fluxm_a[ij] + fluxm_a[ij+rp1] + fluxm_a[ij-1] + fluxm_a[ij-1+rp1]) * 0.25;
+			xq  = (1 - ff_v[k]) * fn0 - dtdy * NORMAL_GRAV * dd_v[k] * (etad[ij+rp1] - etad[ij]);
+			xqc = xq - r4n_row * 2 * xpp;
+			xq  = (cor_on) ? xqc : xq;
+
+			/* upwind scheme for y-direction volume flux */
+			dqa_rp1 = (h1 + htotal_a[ij+rp1] + htotal_d[ij+rp2] + htotal_a[ij+rp2]) * 0.25;
+			dqa_rm1 = (htotal_d[ij-rm1] + htotal_a[ij-rm1] + h0 + htotal_a[ij]) * 0.25;
+			adv_1   = -dtdy * ((fn0 * fn0) / dqa);
+			adv_cp1 =  dtdy * (fluxn_a[ij+rp1] * fluxn_a[ij+rp1] / dqa_rp1 - fn0 * fn0 / dqa);
+			adv_2   =  dtdy * (fn0 * fn0) / dqa;
+			adv_cm1 =  dtdy * (fn0 * fn0 / dqa - fluxn_a[ij-rm1] * fluxn_a[ij-rm1] / dqa_rm1);
+			adv_cp1 = (dqa_rp1 < EPS5) ? adv_1 : adv_cp1;
+			adv_cp1 = (h1 < EPS5)      ? adv_1 : adv_cp1;
+			adv_cm1 = (dqa_rm1 < EPS3) ? adv_2 : adv_cm1;
+			adv_cm1 = (h0 < EPS5)      ? adv_2 : adv_cm1;
+			advy    = (fn0 < 0) ? adv_cp1 : adv_cm1;
+
+			/* upwind scheme for x-direction volume flux */
+			dqa_cp1 = (htotal_d[ij+1] + htotal_a[ij+1] + htotal_d[ij+rp1+1] + htotal_a[ij+rp1+1]) * 0.25;
+			dqa_cm1 = (htotal_d[ij-1] + htotal_a[ij-1] + htotal_d[ij+rp1-1] + htotal_a[ij+rp1-1]) * 0.25;
+			xpe     = (fluxm_a[ij+1] + fluxm_a[ij+1+rp1] + fluxm_a[ij] + fluxm_a[ij+rp1]) * 0.25;
+			xpe2    = (fluxm_a[ij-1] + fluxm_a[ij-1+rp1] + fluxm_a[ij-2] + fluxm_a[ij-2+rp1]) * 0.25;
+			adv_1   = -dtdx * (fn0 * xpp / dqa);
+			adv_cp1 =  dtdx * (fluxn_a[ij+1] * xpe / dqa_cp1 - fn0 * xpp / dqa);
+			adv_2   =  dtdx * (fn0 * xpp / dqa);
+			adv_cm1 =  dtdx * (fn0 * xpp / dqa - fluxn_a[ij-1] * xpe2 / dqa_cm1);
+			adv_cp1 = (htotal_d[ij+1] < EPS5)     ? adv_1 : adv_cp1;
+			adv_cp1 = (htotal_d[ij+1+rp1] < EPS5) ? adv_1 : adv_cp1;
+			adv_cp1 = (dqa_cp1 < EPS3)            ? adv_1 : adv_cp1;
+			adv_cm1 = (htotal_d[ij-1] < EPS5)     ? adv_2 : adv_cm1;
+			adv_cm1 = (htotal_d[ij-1+rp1] < EPS5) ? adv_2 : adv_cm1;
+			adv_cm1 = (dqa_cm1 < EPS3)            ? adv_2 : adv_cm1;
+			advx    = (xpp < 0) ? adv_cp1 : adv_cm1;
+
+			xqc = xq - advx - advy;
+			xq  = (!linear & !(dqa < EPS4)) ? xqc : xq;
+			xq /= (ff_v[k] + 1);
+#ifdef LIMIT_DISCHARGE
+			f_limit = V_LIMIT * dd_v[k];
+			xq = (fabs(xq) < EPS10) ? 0 : ((xq > f_limit) ? f_limit : ((xq < -f_limit) ? -f_limit : xq));
+#endif
+			fluxn_d[ij] = (dd_v[k] > 0) ? xq : 0;
+		}
+
+		if (do_vey) {
+			SIMD_LOOP
+			for (k = 0; k < n; k++) {
+				ij = (size_t)row * hdr.nx + col + k;
+				d  = fluxn_d[ij] / df_v[k];
+				d  = (vv_v[k] != 0 && dd_v[k] > EPS3) ? d : 0;
+				vey[ij] = (bat[ij] <= MAXRUNUP) ? vey[ij] : d;
+			}
+		}
+	}
+}
+
+static SIMD_TARGET("avx2")
+void moment_M_seg_avx2(struct nestContainer *nest, int lev, int row, int col_start, int col_end, int linear) {
+	moment_M_seg(nest, lev, row, col_start, col_end, linear);
+}
+static SIMD_TARGET("avx2")
+void moment_N_seg_avx2(struct nestContainer *nest, int lev, int row, int col_start, int col_end, int linear) {
+	moment_N_seg(nest, lev, row, col_start, col_end, linear);
+}
+static SIMD_TARGET("avx512f")
+void moment_M_seg_avx512(struct nestContainer *nest, int lev, int row, int col_start, int col_end, int linear) {
+	moment_M_seg(nest, lev, row, col_start, col_end, linear);
+}
+static SIMD_TARGET("avx512f")
+void moment_N_seg_avx512(struct nestContainer *nest, int lev, int row, int col_start, int col_end, int linear) {
+	moment_N_seg(nest, lev, row, col_start, col_end, linear);
+}
+#endif
+
+#ifndef DO_SIMD
+#	define SIMD_LOOP
+#	define SIMD_INLINE
+#endif
+
+/* -------------------------------------------------------------------- */
+static SIMD_INLINE inline
+void moment_M_deep_seg(struct nestContainer *nest, int lev, int row, int col_start, int col_end) {
+	/* Linear fluxm_d of the cells [col_start, col_end[ of ROW that, and their east neighbors, are deeper
+	   than linear_depth. Water never dries out there, so there is no moving boundary logic, and the
+	   convection and friction terms are neglected. Requires 1 <= row < ny - 1 and col_end <= nx - 2 */
+	int col, nx = nest->hdr[lev].nx, cor_on, do_vex;
+	size_t ij;
+	double dd, xqq, xp, xpc, cte, r4m_row, f_limit;
+	real   *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxm_d, *fluxn_a, *vex;
+
+	etad     = nest->etad[lev];            fluxm_d  = nest->fluxm_d[lev];
+	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
+	fluxm_a  = nest->fluxm_a[lev];         fluxn_a  = nest->fluxn_a[lev];
+	vex      = nest->vex[lev];
+
+	cte     = (nest->isGeog) ? nest->r3m[lev][row] : nest->dt[lev] / nest->hdr[lev].x_inc * NORMAL_GRAV;
+	cor_on  = nest->do_Coriolis;
+	r4m_row = (cor_on) ? nest->r4m[lev][row] : 0;
+	do_vex  = (nest->out_velocity_x && (lev == nest->writeLevel));
+
+	SIMD_LOOP
+	for (col = col_start; col < col_end; col++) {
+		ij  = (size_t)row * nx + col;
+		dd  = (htotal_d[ij] + htotal_d[ij+1]) * 0.5;
+		xqq = (fluxn_a[ij] + fluxn_a[ij+1] + fluxn_a[ij-nx] + fluxn_a[ij+1-nx]) * 0.25;
+		xp  = fluxm_a[ij] - cte * dd * (etad[ij+1] - etad[ij]);
+		xpc = xp + r4m_row * 2 * xqq;
+		xp  = (cor_on) ? xpc : xp;
+#ifdef LIMIT_DISCHARGE
+		f_limit = V_LIMIT * dd;
+		xp = (fabs(xp) < EPS10) ? 0 : ((xp > f_limit) ? f_limit : ((xp < -f_limit) ? -f_limit : xp));
+#endif
+		fluxm_d[ij] = xp;
+	}
+
+	if (do_vex) {
+		SIMD_LOOP
+		for (col = col_start; col < col_end; col++) {
+			ij = (size_t)row * nx + col;
+			vex[ij] = fluxm_d[ij] / ((htotal_d[ij] + htotal_a[ij] + htotal_d[ij+1] + htotal_a[ij+1]) * 0.25);
+		}
+	}
+}
+
+/* -------------------------------------------------------------------- */
+static SIMD_INLINE inline
+void moment_N_deep_seg(struct nestContainer *nest, int lev, int row, int col_start, int col_end) {
+	/* Same as moment_M_deep_seg() for fluxn_d. Requires 1 <= row < ny - 1 and 1 <= col_start, col_end <= nx - 1 */
+	int col, nx = nest->hdr[lev].nx, cor_on, do_vey;
+	size_t ij;
+	double dd, xpp, xq, xqc, cte, r4n_row, f_limit;
+	real   *htotal_a, *htotal_d, *etad, *fluxm_a, *fluxn_a, *fluxn_d, *vey;
+
+	etad     = nest->etad[lev];            fluxn_d  = nest->fluxn_d[lev];
+	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
+	fluxm_a  = nest->fluxm_a[lev];         fluxn_a  = nest->fluxn_a[lev];
+	vey      = nest->vey[lev];
+
+	cte     = (nest->isGeog) ? nest->r3n[lev][row] : nest->dt[lev] / nest->hdr[lev].y_inc * NORMAL_GRAV;
+	cor_on  = nest->do_Coriolis;
+	r4n_row = (cor_on) ? nest->r4n[lev][row] : 0;
+	do_vey  = (nest->out_velocity_y && (lev == nest->writeLevel));
+
+	SIMD_LOOP
+	for (col = col_start; col < col_end; col++) {
+		ij  = (size_t)row * nx + col;
+		dd  = (htotal_d[ij] + htotal_d[ij+nx]) * 0.5;
+		xpp = (fluxm_a[ij] + fluxm_a[ij+nx] + fluxm_a[ij-1] + fluxm_a[ij-1+nx]) * 0.25;
+		xq  = fluxn_a[ij] - cte * dd * (etad[ij+nx] - etad[ij]);
+		xqc = xq - r4n_row * 2 * xpp;
+		xq  = (cor_on) ? xqc : xq;
+#ifdef LIMIT_DISCHARGE
+		f_limit = V_LIMIT * dd;
+		xq = (fabs(xq) < EPS10) ? 0 : ((xq > f_limit) ? f_limit : ((xq < -f_limit) ? -f_limit : xq));
+#endif
+		fluxn_d[ij] = xq;
+	}
+
+	if (do_vey) {
+		SIMD_LOOP
+		for (col = col_start; col < col_end; col++) {
+			ij = (size_t)row * nx + col;
+			vey[ij] = fluxn_d[ij] / ((htotal_d[ij] + htotal_a[ij] + htotal_d[ij+nx] + htotal_a[ij+nx]) * 0.25);
+		}
+	}
+}
+
+#ifdef DO_SIMD
+static SIMD_TARGET("avx2")
+void moment_M_deep_avx2(struct nestContainer *nest, int lev, int row, int col_start, int col_end) {
+	moment_M_deep_seg(nest, lev, row, col_start, col_end);
+}
+static SIMD_TARGET("avx2")
+void moment_N_deep_avx2(struct nestContainer *nest, int lev, int row, int col_start, int col_end) {
+	moment_N_deep_seg(nest, lev, row, col_start, col_end);
+}
+static SIMD_TARGET("avx512f")
+void moment_M_deep_avx512(struct nestContainer *nest, int lev, int row, int col_start, int col_end) {
+	moment_M_deep_seg(nest, lev, row, col_start, col_end);
+}
+static SIMD_TARGET("avx512f")
+void moment_N_deep_avx512(struct nestContainer *nest, int lev, int row, int col_start, int col_end) {
+	moment_N_deep_seg(nest, lev, row, col_start, col_end);
+}
+#endif
+
+/* -------------------------------------------------------------------- */
+void moment_M_split(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	/* Hybrid linear/nonlinear moment along X. The runs of cells that, as their east neighbors, are
+	   classified CELL_DEEP go through the linear deep water kernel, all the others through the usual one */
+	int row, col, a, b, c0, c1, nx = nest->hdr[lev].nx;
+	size_t ij;
+	unsigned char *cls = nest->cell_class[lev];
+	PFV moment_k;
+
+	moment_k = (nest->isGeog) ? (PFV)moment_sp_M : ((nest->simd_level) ? (PFV)moment_M_simd : (PFV)moment_M);
+	for (row = row_start; row < row_end; row++) {
+		if (row < 1 || row >= nest->hdr[lev].ny - 1) {		/* The borders are left to the usual kernel */
+			moment_k(nest, lev, row, row + 1, col_start, col_end);
+			continue;
+		}
+		c0 = MAX(col_start, 1);		c1 = MIN(col_end, nx - 2);
+		ij = (size_t)row * nx;
+		for (col = col_start; col < col_end; col = b) {
+			for (a = MAX(col, c0); a < c1 && !(cls[ij+a] == CELL_DEEP && cls[ij+a+1] == CELL_DEEP); a++);
+			if (a >= c1) {			/* No more deep water in this row */
+				moment_k(nest, lev, row, row + 1, col, col_end);
+				break;
+			}
+			if (a > col) moment_k(nest, lev, row, row + 1, col, a);
+			for (b = a + 1; b < c1 && cls[ij+b] == CELL_DEEP && cls[ij+b+1] == CELL_DEEP; b++);
+#ifdef DO_SIMD
+			if (nest->simd_level == 3)
+				moment_M_deep_avx512(nest, lev, row, a, b);
+			else if (nest->simd_level == 2)
+				moment_M_deep_avx2(nest, lev, row, a, b);
+			else
+#endif
+				moment_M_deep_seg(nest, lev, row, a, b);
+		}
+	}
+}
+
+/* -------------------------------------------------------------------- */
+void moment_N_split(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	/* Same as moment_M_split() for the moment along Y, where the neighbors are the ones to the north */
+	int row, col, a, b, c0, c1, nx = nest->hdr[lev].nx;
+	size_t ij;
+	unsigned char *cls = nest->cell_class[lev];
+	PFV moment_k;
+
+	moment_k = (nest->isGeog) ? (PFV)moment_sp_N : ((nest->simd_level) ? (PFV)moment_N_simd : (PFV)moment_N);
+	for (row = row_start; row < row_end; row++) {
+		if (row < 1 || row >= nest->hdr[lev].ny - 1) {
+			moment_k(nest, lev, row, row + 1, col_start, col_end);
+			continue;
+		}
+		c0 = MAX(col_start, 1);		c1 = MIN(col_end, nx - 1);
+		ij = (size_t)row * nx;
+		for (col = col_start; col < col_end; col = b) {
+			for (a = MAX(col, c0); a < c1 && !(cls[ij+a] == CELL_DEEP && cls[ij+a+nx] == CELL_DEEP); a++);
+			if (a >= c1) {
+				moment_k(nest, lev, row, row + 1, col, col_end);
+				break;
+			}
+			if (a > col) moment_k(nest, lev, row, row + 1, col, a);
+			for (b = a + 1; b < c1 && cls[ij+b] == CELL_DEEP && cls[ij+b+nx] == CELL_DEEP; b++);
+#ifdef DO_SIMD
+			if (nest->simd_level == 3)
+				moment_N_deep_avx512(nest, lev, row, a, b);
+			else if (nest->simd_level == 2)
+				moment_N_deep_avx2(nest, lev, row, a, b);
+			else
+#endif
+				moment_N_deep_seg(nest, lev, row, a, b);
+		}
+	}
+}
+
+/* -------------------------------------------------------------------- */
+void moment_M_simd(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	/* Same as moment_M() but with the interior of each row done by the vectorized kernel */
+	int row, c0, c1, first, last, jupe, linear;
+	struct grd_header hdr = nest->hdr[lev];
+
+	jupe  = (lev > 0) ? 0 : 5;
+	first = (lev > 0) ? 1 : 0;
+	last  = (lev > 0) ? 0 : 1;
+	for (row = row_start; row < row_end; row++) {
+		/* Linear rows (or the whole grid) go all through the vectorized kernel, the others only between the lateral buffers */
+		linear = (nest->do_linear || row < jupe || row > (hdr.ny - jupe - 1));
+		c0 = MAX(MAX(col_start, first), (linear) ? 1 : MAX(1, jupe));
+		c1 = MIN(col_end, (linear) ? hdr.nx - 2 : MIN(hdr.nx - 2, hdr.nx - jupe));
+		c0 = MAX(c0, nest->wet_first[lev][row]);	c1 = MIN(c1, nest->wet_last[lev][row]);
+#ifdef DO_SIMD
+		if (row < hdr.ny - last && c0 < c1) {
+			moment_M(nest, lev, row, row + 1, col_start, c0);
+			if (nest->simd_level == 3)
+				moment_M_seg_avx512(nest, lev, row, c0, c1, linear);
+			else
+				moment_M_seg_avx2(nest, lev, row, c0, c1, linear);
+			moment_M(nest, lev, row, row + 1, c1, col_end);
+			continue;
+		}
+#endif
+		moment_M(nest, lev, row, row + 1, col_start, col_end);
+	}
+}
+
+/* -------------------------------------------------------------------- */
+void moment_N_simd(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	/* Same as moment_N() but with the interior of each row done by the vectorized kernel */
+	int row, c0, c1, first, jupe, linear;
+	struct grd_header hdr = nest->hdr[lev];
+
+	jupe  = (lev > 0) ? 0 : 5;
+	first = (lev > 0) ? 1 : 0;
+	for (row = row_start; row < row_end; row++) {
+		linear = (nest->do_linear || row < jupe || row > (hdr.ny - jupe - 1));
+		c0 = MAX(col_start, (linear) ? 2 : MAX(2, jupe));
+		c1 = MIN(col_end, (linear) ? hdr.nx - 1 : MIN(hdr.nx - 1, hdr.nx - jupe));
+		c0 = MAX(c0, nest->wet_first[lev][row]);	c1 = MIN(c1, nest->wet_last[lev][row]);
+#ifdef DO_SIMD
+		if (row >= first && row < hdr.ny - 1 && c0 < c1) {
+			moment_N(nest, lev, row, row + 1, col_start, c0);
+			if (nest->simd_level == 3)
+				moment_N_seg_avx512(nest, lev, row, c0, c1, linear);
+			else
+				moment_N_seg_avx2(nest, lev, row, c0, c1, linear);
+			moment_N(nest, lev, row, row + 1, c1, col_end);
+			continue;
+		}
+#endif
+		moment_N(nest, lev, row, row + 1, col_start, col_end);
+	}
+}
+
+/* -------------------------------------------------------------------- */
+int GetSIMDLevel(void) {
+	/* Find out the widest vector instructions this CPU (and OS) supports. 0 means use the scalar kernels */
+#ifdef DO_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return (3);
+	if (__builtin_cpu_supports("avx2"))    return (2);
+#endif
+	return (0);
+}
+
+/* -------------------------------------------------------------------- */
+/* initializes parameters needed for spherical computations */
+/* -------------------------------------------------------------------- */
+void inisp(struct nestContainer *nest) {
+	int row, k = 0;
+	double phim_rad, phin_rad, omega, raio_t, dxtemp, dytemp, dt;
+
+	raio_t = 6.371e6;
+	omega = 7.2722e-5;
+	while (nest->level[k] >= 0) {
+		dt = nest->dt[k];
+		dxtemp = raio_t * nest->hdr[k].x_inc * D2R;
+		dytemp = raio_t * nest->hdr[k].y_inc * D2R;
+		for (row = 0; row < nest->hdr[k].ny; row++) {
+			phim_rad = (nest->hdr[k].y_min + row * nest->hdr[k].y_inc) * D2R;
+			phin_rad = (nest->hdr[k].y_min + (row + 0.5) * nest->hdr[k].y_inc) * D2R;
+			nest->r0[k][row] = dt / dytemp;
+			nest->r1m[k][row] = sin(phim_rad);
+			nest->r1n[k][row] = cos(phin_rad);
+			nest->r2m[k][row] = dt / dxtemp / cos(phim_rad);
+			nest->r2n[k][row] = dt / dytemp / cos(phin_rad);
+			nest->r3m[k][row] = NORMAL_GRAV * (dt / dxtemp) / cos(phim_rad);
+			nest->r3n[k][row] = NORMAL_GRAV * (dt / dytemp);
+			nest->r4m[k][row] = dt * omega * sin(phim_rad);
+			nest->r4n[k][row] = dt * omega * sin(phin_rad);
+		}
+		k++;
+	}
+}
+
+/* -------------------------------------------------------------------- */
+/* initializes vectors needed for computing the Coriolis  */
+/* -------------------------------------------------------------------- */
+void inicart(struct nestContainer *nest) {
+	int row, k = 0;
+	double phim_rad, phin_rad, dt, omega = 7.2722e-5;
+
+	while (nest->level[k] >= 0) {
+		dt = nest->dt[k];
+		for (row = 0; row < nest->hdr[k].ny; row++) {
+			phim_rad = nest->lat_min4Coriolis + row * nest->hdr[k].y_inc * M_PI / 2e9;
+			phin_rad = nest->lat_min4Coriolis + (row * nest->hdr[k].y_inc + nest->hdr[k].y_inc / 2.) * M_PI / 2e9;
+			nest->r4m[k][row] = dt * omega * sin(phim_rad);
+			nest->r4n[k][row] = dt * omega * sin(phin_rad);
+		}
+		k++;
+	}
+}
+
+/* -------------------------------------------------------------------- */
+/* solves non linear continuity equation w/ spherical coordinates */
+/* Computes water depth (htotal) needed for friction and */
+/* moving boundary algorithm */
+/* htotal < 0 - dry cell htotal (m) above still water */
+/* htotal > 0 - wet cell with htotal (m) of water depth */
+/* -------------------------------------------------------------------- */
+static FORCE_INLINE void mass_sp_body(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end,
+                                  int long_on, int short_on) {
+
+	unsigned int ij;
+	int row, col, c0, c1;
+	int cm1, rm1, rowm1;			/* previous column (cm1 = col -1) and row (rm1 = row - 1) */
+	double etan, dd;
+
+	for (row = row_start; row < row_end; row++) {
+		c0 = MIN(MAX(col_start, nest->wet_first[lev][row]), col_end);	/* Permanent land at the row ends only */
+		c1 = MAX(MIN(col_end, nest->wet_last[lev][row]), c0);			/* needs eta to follow bat */
+		ij = row * nest->hdr[lev].nx + c1;
+		for (col = c1; col < col_end; col++, ij++) nest->etad[lev][ij] = -nest->bat[lev][ij];
+		ij = row * nest->hdr[lev].nx + col_start;
+		for (col = col_start; col < c0; col++, ij++) nest->etad[lev][ij] = -nest->bat[lev][ij];
+		rm1 = ((row == 0) ? 0 : 1) * nest->hdr[lev].nx;
+		rowm1 = MAX(row - 1, 0);
+		for (col = c0; col < c1; col++) {
+			/* case ocean and non permanent dry area */
+			if (nest->bat[lev][ij] > MAXRUNUP) {
+				cm1 = (col == 0) ? 0 : 1;
+				etan = nest->etaa[lev][ij] - nest->r2m[lev][row] * (nest->fluxm_a[lev][ij] - nest->fluxm_a[lev][ij-cm1])
+				     - nest->r2n[lev][row] * (nest->fluxn_a[lev][ij] * nest->r1n[lev][row]
+				     - nest->fluxn_a[lev][ij-rm1] * nest->r1n[lev][rowm1]);
+				if (fabs(etan) < EPS10) etan = 0;
+				dd = etan + nest->bat[lev][ij];
 
 				/* wetable zone */
 				if (dd >= EPS10) {
@@ -4500,9 +6828,9 @@ void mass_sp(struct nestContainer *nest, int lev) {
 					nest->etad[lev][ij] = -nest->bat[lev][ij];
 				}
 
-				if (nest->do_long_beach  && (lev == nest->writeLevel) && nest->bat[lev][ij] > 0 && dd < EPS1)
+				if (long_on && nest->bat[lev][ij] > 0 && dd < EPS1)
 					nest->long_beach[lev][ij] = 1;
-				if (nest->do_short_beach && (lev == nest->writeLevel) && nest->bat[lev][ij] < 0 && dd > EPS1)
+				if (short_on && nest->bat[lev][ij] < 0 && dd > EPS1)
 					nest->short_beach[lev][ij] = 1;
 			}
 			else {			/* over dry areas htotal is null and eta follows bat */
@@ -4513,22 +6841,29 @@ void mass_sp(struct nestContainer *nest, int lev) {
 	}
 }
 
+MASS_VARIANTS(mass_sp)
+void mass_sp(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	mass_sp_variants[nest->kflags[lev] >> 4](nest, lev, row_start, row_end, col_start, col_end);
+}
+
 /* ---------------------------------------------------------------------- */
 /* Solve nonlinear momentum equation, in spherical coordinates */
 /* with moving boundary */
 /* ---------------------------------------------------------------------- */
-void moment_sp_M(struct nestContainer *nest, int lev) {
+static FORCE_INLINE void moment_sp_M_body(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end,
+                                  int cor_on, int fric_on, int vel_on) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int rm2, cp2;
-	double ff = 0, cte;
-	double dd, df, xp, xqe, xqq, advx, advy, f_limit;
+	double ff = 0;
+	double dd = 0, df = 0, xp, xqe, xqq, advx, advy, f_limit;
 	double dpa_ij, dpa_ij_rp1, dpa_ij_rm1, dpa_ij_cm1, dpa_ij_cp1;
-	double dt, manning, *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vex;
+	double dt;
+	real   *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vex, *fric;
 	double *r0, *r2m, *r3m, *r4m;
 	struct grd_header hdr;
 	double bat__ij;
@@ -4538,7 +6873,7 @@ void moment_sp_M(struct nestContainer *nest, int lev) {
 	double fluxm_a__ij;
 
 	hdr      = nest->hdr[lev];             vex      = nest->vex[lev];
-	dt       = nest->dt[lev];              manning  = nest->manning[lev];
+	dt       = nest->dt[lev];              fric     = nest->fric[lev];
 	bat      = nest->bat[lev];             etad     = nest->etad[lev];
 	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
 	fluxm_a  = nest->fluxm_a[lev];         fluxm_d  = nest->fluxm_d[lev];
@@ -4557,16 +6892,17 @@ void moment_sp_M(struct nestContainer *nest, int lev) {
 
 	if (nest->do_linear) jupe = 1e6;		/* A tricky way of imposing linearity */
 
-	/* - fixes friction parameter */
-	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
-
-	memset(fluxm_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */
+	/* Do this rather than seting to zero under looping conditions. Only the cells of this tile */
+	for (row = row_start; row < row_end; row++)
+		memset(&fluxm_d[row * hdr.nx + col_start], 0, (size_t)(col_end - col_start) * sizeof(real));
 
-	for (row = 0; row < hdr.ny - last; row++) {		/* - main computation cycle fluxm_d */
+	for (row = row_start; row < MIN(row_end, hdr.ny - last); row++) {		/* - main computation cycle fluxm_d */
 		rp1 = (row < hdr.ny - 1) ? hdr.nx : 0;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1 + first;
-		for (col = first; col < hdr.nx - 1; col++) {
+		c0 = MAX(MAX(col_start, first), nest->wet_first[lev][row]);	/* Skip the permanent land at the row ends */
+		c1 = MIN(MIN(col_end, hdr.nx - 1), nest->wet_last[lev][row]);
+		ij = row * hdr.nx - 1 + c0;
+		for (col = c0; col < c1; col++) {
 			cp1 = 1;
 			cp2 = (col < hdr.nx - 2) ? 2 : 1;
 			cm1 = (col == 0) ? 0 : 1;
@@ -4623,12 +6959,12 @@ void moment_sp_M(struct nestContainer *nest, int lev) {
 
 			df = (df < EPS3) ? EPS3 : df;		/* Aparently this is faster than the simpe if test */
 			xqq = (fluxn_a[ij] + fluxn_a[ij+cp1] + fluxn_a[ij-rm1] + fluxn_a[ij+cp1-rm1]) * 0.25;
-			ff = (manning != 0) ? cte * sqrt(fluxm_a__ij * fluxm_a__ij + xqq * xqq) / pow(df, 2.333333) : 0;
+			ff = (fric_on) ? fric[ij] * dt * sqrt(fluxm_a__ij * fluxm_a__ij + xqq * xqq) * pow_m7_3(df) : 0;
 
 			/* - computes linear terms in spherical coordinates */
 			xp = (1 - ff) * fluxm_a__ij - r3m[row] * dd * (etad[ij+cp1] - etad__ij); /* - includes coriolis */
 
-			if (nest->do_Coriolis)
+			if (cor_on)
 				xp += r4m[row] * 2 * xqq;
 
 			/* - total water depth is smaller than EPS3 >> linear */
@@ -4710,26 +7046,34 @@ L120:
 
 			fluxm_d[ij] = xp;
 L121:
-			if (nest->out_velocity_x && (lev == nest->writeLevel))
+			if (vel_on)
 				vex[ij] = (valid_vel && dd > EPS3) ? xp / df : 0;
 		}
 	}
 }
 
+MOMENT_VARIANTS(moment_sp_M)
+void moment_sp_M(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	int kf = nest->kflags[lev];
+	moment_sp_M_variants[(kf & (KF_CORIOLIS | KF_FRICTION)) | ((kf & KF_VEL_X) ? 4 : 0)](nest, lev, row_start, row_end, col_start, col_end);
+}
+
 
 /* ----------------------------------------------------------------------------------------- */
-void moment_sp_N(struct nestContainer *nest, int lev) {
+static FORCE_INLINE void moment_sp_N_body(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end,
+                                  int cor_on, int fric_on, int vel_on) {
 
 	unsigned int ij;
-	int first, last, jupe, row, col;
+	int first, last, jupe, row, col, c0, c1;
 	int valid_vel;
 	int cm1, rm1;			/* previous column (cm1 = col - 1) and row (rm1 = row - 1) */
 	int cp1, rp1;			/* next column (cp1 = col + 1) and row (rp1 = row + 1) */
 	int cm2, rp2;
-	double ff = 0, cte;
-	double dd, df, xq, xpe, xpp, advx, advy, f_limit;
+	double ff = 0;
+	double dd = 0, df = 0, xq, xpe, xpp, advx, advy, f_limit;
 	double dqa_ij, dqa_ij_rp1, dqa_ij_rm1, dqa_ij_cm1, dqa_ij_cp1;
-	double dt, manning, *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vey;
+	double dt;
+	real   *htotal_a, *htotal_d, *bat, *etad, *fluxm_a, *fluxn_a, *fluxm_d, *fluxn_d, *vey, *fric;
 	double *r0, *r2n, *r3n, *r4n;
 	struct grd_header hdr;
 	double bat__ij;
@@ -4741,7 +7085,7 @@ void moment_sp_N(struct nestContainer *nest, int lev) {
 	double fluxn_a__ij;
 
 	hdr      = nest->hdr[lev];             vey      = nest->vey[lev];
-	dt       = nest->dt[lev];              manning  = nest->manning[lev];
+	dt       = nest->dt[lev];              fric     = nest->fric[lev];
 	bat      = nest->bat[lev];             etad     = nest->etad[lev];
 	htotal_a = nest->htotal_a[lev];        htotal_d = nest->htotal_d[lev];
 	fluxm_a  = nest->fluxm_a[lev];         fluxm_d  = nest->fluxm_d[lev];
@@ -4760,18 +7104,19 @@ void moment_sp_N(struct nestContainer *nest, int lev) {
 
 	if (nest->do_linear) jupe = 1e6;		/* A tricky way of imposing linearity */
 
-	/* - fixes friction parameter */
-	cte = (manning != 0) ? manning * manning * dt * 4.9 : 0;
-
-	memset(fluxn_d, 0, hdr.nm * sizeof(double));	/* Do this rather than seting to zero under looping conditions */
+	/* Do this rather than seting to zero under looping conditions. Only the cells of this tile */
+	for (row = row_start; row < row_end; row++)
+		memset(&fluxn_d[row * hdr.nx + col_start], 0, (size_t)(col_end - col_start) * sizeof(real));
 
 	/* - main computation cycle fluxn_d */
-	for (row = first; row < hdr.ny - 1; row++) {
+	for (row = MAX(row_start, first); row < MIN(row_end, hdr.ny - 1); row++) {
 		rp1 = hdr.nx;
 		rp2 = (row < hdr.ny - 2) ? 2*hdr.nx : hdr.nx;
 		rm1 = (row == 0) ? 0 : hdr.nx;
-		ij = row * hdr.nx - 1;
-		for (col = 0; col < hdr.nx - last; col++) {
+		c0 = MAX(col_start, nest->wet_first[lev][row]);	/* Skip the permanent land at the row ends */
+		c1 = MIN(MIN(col_end, hdr.nx - last), nest->wet_last[lev][row]);
+		ij = row * hdr.nx - 1 + c0;
+		for (col = c0; col < c1; col++) {
 			cp1 = (col < hdr.nx-1) ? 1 : 0;
 			cm1 = (col == 0) ? 0 : 1;
 			ij++;
@@ -4834,12 +7179,12 @@ void moment_sp_N(struct nestContainer *nest, int lev) {
 
 			df = (df < EPS3) ? EPS3 : df;
 			xpp = (fluxm_a[ij] + fluxm_a[ij+rp1] + fluxm_a[ij-cm1] + fluxm_a[ij-cm1+rp1]) * 0.25;
-			ff = (manning != 0) ? cte * sqrt(fluxn_a__ij * fluxn_a__ij + xpp * xpp) / pow(df, 2.333333) : 0;
+			ff = (fric_on) ? fric[ij] * dt * sqrt(fluxn_a__ij * fluxn_a__ij + xpp * xpp) * pow_m7_3(df) : 0;
 
 			/* - computes linear terms of N in cartesian coordinates */
 			xq = (1 - ff) * fluxn_a__ij - r3n[row] * dd * (etad__ij_p_rp1 - etad__ij);
 
-			if (nest->do_Coriolis)			/* - includes coriolis effect */
+			if (cor_on)			/* - includes coriolis effect */
 				xq -= r4n[row] * 2 * xpp;
 
 			/* - lateral buffer >> linear */
@@ -4916,32 +7261,39 @@ L200:
 			fluxn_d[ij] = xq;
 
 L201:
-			if (nest->out_velocity_y && (lev == nest->writeLevel))
+			if (vel_on)
 				vey[ij] = (valid_vel && dd > EPS3) ? xq / df : 0;
 		}
 	}
 }
 
+MOMENT_VARIANTS(moment_sp_N)
+void moment_sp_N(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	int kf = nest->kflags[lev];
+	moment_sp_N_variants[(kf & (KF_CORIOLIS | KF_FRICTION)) | ((kf & KF_VEL_Y) ? 4 : 0)](nest, lev, row_start, row_end, col_start, col_end);
+}
+
 /* ----------------------------------------------------------------------------------------- */
-void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2, char *what, int lev, int i_time) {
+void interp_edges(struct nestContainer *nest, real *flux_L1, real *flux_L2, char *what, int lev, int i_time) {
 	/* Interpolate outer Fluxes on boundary edges with the resolution of the nested grid
 	   and assign them to inner grid, at its boundaries. */
-	int i, n, col, row, last_iter;
-	double s, t1, *bat_P, *etad_P;
+	int i, n, col, row, last_iter, lev_P = nest->parent[lev];
+	double s, t1;
+	real   *bat_P, *etad_P;
 	//unsigned int ij;
 	//double grx, gry, c1, c2, hp, hm, xm;
 
-	bat_P  = nest->bat[lev-1];	/* Parent bathymetry */;
-	etad_P = nest->etad[lev-1];
-	last_iter = (int)(nest->dt[lev-1] / nest->dt[lev]);  /* No truncations here */
+	bat_P  = nest->bat[lev_P];	/* Parent bathymetry */;
+	etad_P = nest->etad[lev_P];
+	last_iter = (int)(nest->dt[lev_P] / nest->dt[lev]);  /* No truncations here */
 
 	if (what[0] == 'N') {			/* Only FLUXN uses this branch */
 		n = (nest->LRcol[lev] - nest->LLcol[lev] + 1);
 		/* SOUTH boundary */
-		s = nest->hdr[lev].y_inc / nest->hdr[lev-1].y_inc;
+		s = nest->hdr[lev].y_inc / nest->hdr[lev_P].y_inc;
 		for (i = 0, col = nest->LLcol[lev]; col <= nest->LRcol[lev]; col++, i++) {
-			t1 = flux_L1[ij_grd(col, nest->LLrow[lev], nest->hdr[lev-1])];
-			//t2 = flux_L1[ij_grd(col, nest->LLrow[lev]+1, nest->hdr[lev-1])];
+			t1 = flux_L1[ij_grd(col, nest->LLrow[lev], nest->hdr[lev_P])];
+			//t2 = flux_L1[ij_grd(col, nest->LLrow[lev]+1, nest->hdr[lev_P])];
 			nest->edge_row_Ptmp[lev][i] = t1;
 		}
 		intp_lin (nest->edge_row_P[lev], nest->edge_row_Ptmp[lev], n, nest->hdr[lev].nx,
@@ -4955,8 +7307,8 @@ void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2,
 
 		/* NORTH boundary */
 		for (i = 0, col = nest->LLcol[lev]; col <= nest->LRcol[lev]; col++, i++) {
-			t1 = flux_L1[ij_grd(col, nest->ULrow[lev]-1, nest->hdr[lev-1])];
-			//t2 = flux_L1[ij_grd(col, nest->ULrow[lev],   nest->hdr[lev-1])];
+			t1 = flux_L1[ij_grd(col, nest->ULrow[lev]-1, nest->hdr[lev_P])];
+			//t2 = flux_L1[ij_grd(col, nest->ULrow[lev],   nest->hdr[lev_P])];
 			nest->edge_row_Ptmp[lev][i] = t1;
 		}
 		intp_lin (nest->edge_row_P[lev], nest->edge_row_Ptmp[lev], n, nest->hdr[lev].nx,
@@ -4973,10 +7325,10 @@ void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2,
 		//grx = NORMAL_GRAV * nest->dt[lev] / nest->hdr[lev].x_inc;
 		n = (nest->ULrow[lev] - nest->LLrow[lev] + 1);
 		/* WEST (left) boundary. */
-		s = nest->hdr[lev].x_inc / nest->hdr[lev-1].x_inc;
+		s = nest->hdr[lev].x_inc / nest->hdr[lev_P].x_inc;
 		for (i = 0, row = nest->LLrow[lev]; row <= nest->ULrow[lev]; row++, i++) {
-			t1 = flux_L1[ij_grd(nest->LLcol[lev],   row, nest->hdr[lev-1])];
-			//t2 = flux_L1[ij_grd(nest->LLcol[lev]+1, row, nest->hdr[lev-1])];
+			t1 = flux_L1[ij_grd(nest->LLcol[lev],   row, nest->hdr[lev_P])];
+			//t2 = flux_L1[ij_grd(nest->LLcol[lev]+1, row, nest->hdr[lev_P])];
 			nest->edge_col_Ptmp[lev][i] = t1;
 		}
 		intp_lin (nest->edge_col_P[lev], nest->edge_col_Ptmp[lev], n, nest->hdr[lev].ny,
@@ -4991,14 +7343,14 @@ void interp_edges(struct nestContainer *nest, double *flux_L1, double *flux_L2,
 		/* EAST (right) boundary */
 		//if (i_time == 0) {
 			for (i = 0, row = nest->LLrow[lev]; row <= nest->ULrow[lev]; row++, i++)
-				nest->edge_col_Ptmp[lev][i] = flux_L1[ij_grd(nest->LRcol[lev]-1, row, nest->hdr[lev-1])];
+				nest->edge_col_Ptmp[lev][i] = flux_L1[ij_grd(nest->LRcol[lev]-1, row, nest->hdr[lev_P])];
 #if 0
 		}
 		else {
 			c1 = (double)(i_time) / (double)(last_iter);
 			c2 = 1 - c1;
 			for (i = 0, row = nest->LLrow[lev]; row <= nest->ULrow[lev]; row++, i++) {
-				ij = ij_grd(nest->LLcol[lev], row, nest->hdr[lev-1]);
+				ij = ij_grd(nest->LLcol[lev], row, nest->hdr[lev_P]);
 				nest->edge_col_Ptmp[lev][i] = 0;
 				if ((bat_P[ij-1] + etad_P[ij-1] < EPS5) || (bat_P[ij] + etad_P[ij] < EPS5))
 					continue;
@@ -5093,16 +7445,17 @@ int intp_lin (double *x, double *y, int n, int m, double *u, double *v) {
 /* ------------------------------------------------------------------------------------------- */
 /* upscale from doughter to parent level
 /* ------------------------------------------------------------------------------------------- */
-void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
+void upscale(struct nestContainer *nest, real *out, int lev, int i_tsr) {
 	/* Computes the mean of cells inside a square window
 	   lev   -> This grid level
 	*/
-	int	inc, k, col, row, col_P, row_P, wcol, wrow, prow, count, half, rim, do_half = FALSE;
+	int	lev_P = nest->parent[lev], inc, k, col, row, col_P, row_P, wcol, wrow, prow, count, half, rim, do_half = FALSE;
 	unsigned int ij, nm;
-	double	*p, *pa, soma, *bat_P;
+	double	soma;
+	real	*p, *pa, *bat_P;
 
 	inc = nest->incRatio[lev];	/* Grid spatial ratio between Parent and doughter */
-	bat_P = nest->bat[lev-1];	/* Parent bathymetry */
+	bat_P = nest->bat[lev_P];	/* Parent bathymetry */
 
 	nm = nest->hdr[lev].nx * nest->hdr[lev].ny;
 	for (ij = 0; ij < nm; ij++)
@@ -5114,7 +7467,7 @@ void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
 
 	rim = 1 * inc;
 	for (row = 0+rim, prow = 0, row_P = nest->LLrow[lev]+1; row < nest->hdr[lev].ny-rim; row_P++, prow++, row += inc) {
-		ij = ij_grd(nest->LLcol[lev] + 1,  nest->LLrow[lev] + 1 + prow,  nest->hdr[lev-1]);
+		ij = ij_grd(nest->LLcol[lev] + 1,  nest->LLrow[lev] + 1 + prow,  nest->hdr[lev_P]);
 		for (col = 0+rim, col_P = nest->LLcol[lev]+1; col < nest->hdr[lev].nx-rim; col_P++, col += inc) {
 			k = col + row * nest->hdr[lev].nx;       /* Index of window's LL corner */
 			soma = 0;
@@ -5136,8 +7489,8 @@ void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
 			}
 			/* --- case when more than 50% of daugther cells add to a mother cell */
 			if (soma && count > half) {
-				if (bat_P[ij_grd(col_P, row_P, nest->hdr[lev-1])] < 0)
-					out[ij] = soma / count - bat_P[ij_grd(col_P, row_P, nest->hdr[lev-1])];
+				if (bat_P[ij_grd(col_P, row_P, nest->hdr[lev_P])] < 0)
+					out[ij] = soma / count - bat_P[ij_grd(col_P, row_P, nest->hdr[lev_P])];
 				else
 					out[ij] = soma / count;
 			}
@@ -5153,14 +7506,15 @@ void upscale(struct nestContainer *nest, double *out, int lev, int i_tsr) {
 /* --------------------------------------------------------------------- */
 /* upscale from doughter to parent level
 /* --------------------------------------------------------------------- */
-void upscale_(struct nestContainer *nest, double *etad, int lev, int i_tsr) {
+void upscale_(struct nestContainer *nest, real *etad, int lev, int i_tsr) {
 	/* i_tst -> loop variable over the time step ration of the two grids */
 	int half, count, row, col, nrow, ncol, rim, do_half = FALSE;
-	int i0, j0, ii, jj, ki, kj;
+	int i0, j0, ii, jj, ki, kj, lev_P = nest->parent[lev];
 	unsigned int ij;
-	double sum, *bat_P;
+	double sum;
+	real   *bat_P;
 
-	bat_P = nest->bat[lev-1];	/* Parent bathymetry */
+	bat_P = nest->bat[lev_P];	/* Parent bathymetry */
 
 	if (i_tsr % 2 == 0) do_half = TRUE;  /* Compute eta as the mean of etad & etaa */
 
@@ -5195,11 +7549,11 @@ void upscale_(struct nestContainer *nest, double *etad, int lev, int i_tsr) {
 
 			/* --- case when more than 50% of daugther cells add to a mother cell */
 			if (sum && count >= half) {
-				//etad[ij_grd(col,row, nest->hdr[lev-1])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev-1])];
-				if (bat_P[ij_grd(col,row, nest->hdr[lev-1])] < 0)
-					etad[ij_grd(col,row, nest->hdr[lev-1])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev-1])];
+				//etad[ij_grd(col,row, nest->hdr[lev_P])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev_P])];
+				if (bat_P[ij_grd(col,row, nest->hdr[lev_P])] < 0)
+					etad[ij_grd(col,row, nest->hdr[lev_P])] = sum / count - bat_P[ij_grd(col,row, nest->hdr[lev_P])];
 				else
-					etad[ij_grd(col,row, nest->hdr[lev-1])] = sum / count;
+					etad[ij_grd(col,row, nest->hdr[lev_P])] = sum / count;
 			}
 		}
 	}
@@ -5230,167 +7584,802 @@ void replicate(struct nestContainer *nest, int lev) {
 /* ------------------------------------------------------------------------------ */
 void nestify(struct nestContainer *nest, int nNg, int level, int isGeog) {
 	/* nNg -> number of nested grids */
-	/* level contains the number of times this function was called recursively.
-	   Start with 0 in first call and this counter is increased internally */
-	int j, last_iter, nhalf;
-
-	if (nest->run_jump_time > 0) {      /* If holding childrens state */
-		if (nest->run_jump_time > nest->time_h)
-			return;
-		else {
-			/* At this point we must interpolate children's eta & flux to not create family discontinuities */
-			resamplegrid(nest, nNg);
-			nest->run_jump_time = 0;    /* Since we are done, reset to zero so we won't pass here again */
-		}
-	}
+	/* Do the sub-steps of the nested grid LEVEL that fit in one step of its parent. Those of the grids
+	   nested in it are done, in turn, at each of its sub-steps */
+	int j, last_iter, nhalf, lev_P = nest->parent[level];
 
-	last_iter = (int)(nest->dt[level-1] / nest->dt[level]);  /* No truncations here */
+	last_iter = (int)(nest->dt[lev_P] / nest->dt[level]);  /* No truncations here */
 	nhalf = (int)((float)last_iter / 2);           /* */
 	for (j = 0; j < last_iter; j++) {
+		update(nest, level);
 		edge_communication(nest, level, j);
 		mass_conservation(nest, isGeog, level);
 
-		if (nest->do_max_level)    update_max(nest);             /* This makes sure all time steps are visited */
-		if (nest->do_max_velocity) update_max_velocity(nest);    /* This makes sure all time steps are visited */
+		if (nest->keeps_max[level]) {
+			if (nest->do_max_level)    update_max(nest);             /* This makes sure all time steps are visited */
+			if (nest->do_max_velocity) update_max_velocity(nest);    /* This makes sure all time steps are visited */
+		}
 
 		/* MAGIC happens here */
-		if (nNg != 1)
-			nestify(nest, nNg - 1, level + 1, isGeog);
+		if (nest->n_children[level])
+			nestify_children(nest, nNg, level, isGeog);
 
 		moment_conservation(nest, isGeog, level);
 		replicate(nest, level);
 
 		if (j == nhalf && nest->do_upscale)           /* Do the upscale only at middle iteration of this cycle */
-			upscale_(nest, nest->etad[level-1], level, last_iter);
+			upscale_(nest, nest->etad[lev_P], level, last_iter);
 
-		update(nest, level);
+		nest->new_state[level] = TRUE;
 	}
 }
 
 /* ------------------------------------------------------------------------------ */
-void resamplegrid(struct nestContainer *nest, int nNg) {
-	/* interpolate children's eta & flux to not create family discontinuities */
-	/* nNg -> number of nested grids */
-	int row, col, k;
-	size_t ij;
-	double xx, yy;
-	for (k = 1; k <= nNg; k++) {
-		for (row = ij = 0; row < nest->hdr[k].ny; row++) {
-			yy = nest->hdr[k].y_min + row * nest->hdr[k].y_inc;
-			for (col = 0; col < nest->hdr[k].nx; col++, ij++) {
-				if (nest->bat[k][ij] < 0) continue;
-				xx = nest->hdr[k].x_min + col * nest->hdr[k].x_inc;
-				nest->etaa[k][ij]    = GMT_get_bcr_z(nest->etaa[k-1],    nest->hdr[k-1], xx, yy);
-				nest->etad[k][ij]    = GMT_get_bcr_z(nest->etad[k-1],    nest->hdr[k-1], xx, yy);
-				nest->fluxm_a[k][ij] = GMT_get_bcr_z(nest->fluxm_a[k-1], nest->hdr[k-1], xx, yy);
-				nest->fluxn_a[k][ij] = GMT_get_bcr_z(nest->fluxn_a[k-1], nest->hdr[k-1], xx, yy);
-				nest->fluxm_d[k][ij] = GMT_get_bcr_z(nest->fluxm_d[k-1], nest->hdr[k-1], xx, yy);
-				nest->fluxn_d[k][ij] = GMT_get_bcr_z(nest->fluxn_d[k-1], nest->hdr[k-1], xx, yy);
-				nest->htotal_a[k][ij]= GMT_get_bcr_z(nest->htotal_a[k-1],nest->hdr[k-1], xx, yy);
-				nest->htotal_d[k][ij]= GMT_get_bcr_z(nest->htotal_d[k-1],nest->hdr[k-1], xx, yy);
-			}
+void nestify_children(struct nestContainer *nest, int nNg, int lev_P, int isGeog) {
+	/* Do the nesting work of the grids nested in LEV_P, after the mass step of LEV_P. Siblings only
+	   meet in the arrays of their parent, each on its own (non overlapping) piece of it, so when
+	   there are several they are computed concurrently. */
+	int k, n = 0, kids[10];
+
+	if (nest->run_jump_time > 0) {      /* If holding childrens state */
+		if (nest->run_jump_time > nest->time_h)
+			return;
+		else {
+			/* At this point we must interpolate children's eta & flux to not create family discontinuities */
+			resamplegrid(nest, nNg);
+			nest->run_jump_time = 0;    /* Since we are done, reset to zero so we won't pass here again */
 		}
 	}
-}
 
-/* ------------------------------------------------------------------------------ */
-void edge_communication(struct nestContainer *nest, int lev, int i_time) {
-	interp_edges(nest, nest->fluxm_a[lev-1], nest->fluxm_a[lev], "M", lev, i_time);
-	interp_edges(nest, nest->fluxn_a[lev-1], nest->fluxn_a[lev], "N", lev, i_time);
+	for (k = lev_P + 1; k <= nNg; k++) {
+		if (nest->parent[k] != lev_P) continue;
+		if (nest->asleep[k]) {          /* Waiting for the wave. The parent alone does the job meanwhile */
+			if (!wave_near_nest(nest, k, nest->etad[lev_P], FALSE))
+				continue;
+			resample_level(nest, k);    /* Start from the parent's state, as above */
+			nest->asleep[k] = FALSE;
+		}
+		kids[n++] = k;
+	}
+
+	if (n == 1)
+		nestify(nest, nNg, kids[0], isGeog);
+	else if (n > 1)
+		run_levels((PFV)nestify_task, nest, kids, n);
 }
 
 /* ------------------------------------------------------------------------------ */
-void mass_conservation(struct nestContainer *nest, int isGeog, int m) {
-	/* m is the level of nesting which starts counting at one for FIRST nesting level */
-	if (isGeog == 0)
-		mass(nest, m);
-	else
-		mass_sp(nest, m);
+void nestify_task(struct nestContainer *nest, int lev) {
+	/* nestify() with the arguments that run_levels() can pass */
+	nestify(nest, nest->n_nested, lev, nest->isGeog);
 }
 
 /* ------------------------------------------------------------------------------ */
-void moment_conservation(struct nestContainer *nest, int isGeog, int m) {
-	/* m is the level of nesting which starts counting at one for FIRST nesting level */
-	int i;
+void nest_family(struct nestContainer *nest, int nNg) {
+	/* Count the children of each grid and pick the grids whose sub-steps update the max grids of
+	   writeLevel. Those are its ancestors, itself, and the descendants that are not run concurrently
+	   with a sibling (that would make two threads update the max grids at the same time). */
+	int k, j, w = nest->writeLevel;
 
-#ifdef DO_MULTI_THREAD
-	HANDLE ThreadList[2];  /* Handles to the worker threads */
-	ThreadArg Arg_List[2], *Arg_p;
+	nest->n_nested = nNg;
+	for (k = 0; k <= nNg; k++) nest->n_children[k] = 0;
+	for (k = 1; k <= nNg; k++) nest->n_children[nest->parent[k]]++;
 
-	if (isGeog == 0) { 
-		for (i = 0; i < 2; i++) {
-			Arg_p           = &Arg_List[i];
-			Arg_p->nest     = nest;
-			Arg_p->iThread  = i;
-			Arg_p->lev      = m;
-			ThreadList[i] = (HANDLE)_beginthreadex(NULL, 0, MT_cart, Arg_p, 0, NULL);
+	for (k = 1; k <= nNg; k++) {
+		for (j = w; j > 0 && j != k; j = nest->parent[j]);	/* Is K an ancestor of writeLevel (or itself)? */
+		if (j == k) {
+			nest->keeps_max[k] = TRUE;
+			continue;
 		}
+		nest->keeps_max[k] = FALSE;
+		for (j = k; j > 0 && j != w && nest->n_children[nest->parent[j]] == 1; j = nest->parent[j]);
+		if (j == w) nest->keeps_max[k] = TRUE;	/* A descendant with no siblings up to writeLevel */
+	}
+}
+
+/* ------------------------------------------------------------------------------ */
+void resamplegrid(struct nestContainer *nest, int nNg) {
+	/* interpolate children's eta & flux to not create family discontinuities */
+	/* nNg -> number of nested grids */
+	int k;
+	for (k = 1; k <= nNg; k++)
+		resample_level(nest, k);
+}
+
+/* ------------------------------------------------------------------------------ */
+void resample_level(struct nestContainer *nest, int k) {
+	/* interpolate the eta & flux of the nested grid K from those of its parent */
+	int row, col, k_P = nest->parent[k];
+	size_t ij;
+	double xx, yy;
+
+	nest->new_state[k] = FALSE;		/* Start the children from the interpolated _a state */
+	for (row = ij = 0; row < nest->hdr[k].ny; row++) {
+		yy = nest->hdr[k].y_min + row * nest->hdr[k].y_inc;
+		for (col = 0; col < nest->hdr[k].nx; col++, ij++) {
+			if (nest->bat[k][ij] < 0) continue;
+			xx = nest->hdr[k].x_min + col * nest->hdr[k].x_inc;
+			nest->etaa[k][ij]    = GMT_get_bcr_z(nest->etaa[k_P],    nest->hdr[k_P], xx, yy);
+			nest->etad[k][ij]    = GMT_get_bcr_z(nest->etad[k_P],    nest->hdr[k_P], xx, yy);
+			nest->fluxm_a[k][ij] = GMT_get_bcr_z(nest->fluxm_a[k_P], nest->hdr[k_P], xx, yy);
+			nest->fluxn_a[k][ij] = GMT_get_bcr_z(nest->fluxn_a[k_P], nest->hdr[k_P], xx, yy);
+			nest->fluxm_d[k][ij] = GMT_get_bcr_z(nest->fluxm_d[k_P], nest->hdr[k_P], xx, yy);
+			nest->fluxn_d[k][ij] = GMT_get_bcr_z(nest->fluxn_d[k_P], nest->hdr[k_P], xx, yy);
+			nest->htotal_a[k][ij]= GMT_get_bcr_z(nest->htotal_a[k_P],nest->hdr[k_P], xx, yy);
+			nest->htotal_d[k][ij]= GMT_get_bcr_z(nest->htotal_d[k_P],nest->hdr[k_P], xx, yy);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------------ */
+int wave_near_nest(struct nestContainer *nest, int lev, real *eta, int whole) {
+	/* Tell if |ETA| of the parent of the nested grid LEV exceeds nest->wake_eta on the cells of a band
+	   WAKE_RING cells wide on each side of the nested grid border. The wave cannot get into the nested
+	   grid without crossing it. With WHOLE check all cells of the parent that cover the nested grid. */
+	int row, col, in_band, lev_P = nest->parent[lev];
+	int r0, r1, c0, c1, ri0, ri1, ci0, ci1;
+	size_t ij;
+	struct grd_header hdr = nest->hdr[lev_P];
+
+	r0  = MAX(nest->LLrow[lev] - WAKE_RING, 0);	r1  = MIN(nest->URrow[lev] + WAKE_RING, hdr.ny - 1);
+	c0  = MAX(nest->LLcol[lev] - WAKE_RING, 0);	c1  = MIN(nest->URcol[lev] + WAKE_RING, hdr.nx - 1);
+	ri0 = nest->LLrow[lev] + WAKE_RING;		ri1 = nest->URrow[lev] - WAKE_RING;	/* The inside of the band */
+	ci0 = nest->LLcol[lev] + WAKE_RING;		ci1 = nest->URcol[lev] - WAKE_RING;
+
+	for (row = r0; row <= r1; row++) {
+		in_band = whole || row <= ri0 || row >= ri1;
+		for (col = c0; col <= c1; col++) {
+			if (!in_band && col > ci0 && col < ci1) {
+				col = ci1 - 1;			/* Jump over the inside */
+				continue;
+			}
+			ij = ij_grd(col, row, hdr);
+			if (nest->bat[lev_P][ij] < 0) continue;
+			if (fabs(eta[ij]) > nest->wake_eta)
+				return(TRUE);
+		}
+	}
+	return(FALSE);
+}
+
+/* ------------------------------------------------------------------------------ */
+void nest_sleep(struct nestContainer *nest, int nNg) {
+	/* Put to sleep the nested grids that have no wave on them nor around them. Those start only when
+	   nestify() sees the wave near their borders. A grid can only be awake if its parent is too. */
+	int k;
+	for (k = 1; k <= nNg; k++)
+		nest->asleep[k] = nest->asleep[nest->parent[k]] || !wave_near_nest(nest, k, nest->etaa[nest->parent[k]], TRUE);
+}
+
+/* ------------------------------------------------------------------------------ */
+void edge_communication(struct nestContainer *nest, int lev, int i_time) {
+	interp_edges(nest, nest->fluxm_a[nest->parent[lev]], nest->fluxm_a[lev], "M", lev, i_time);
+	interp_edges(nest, nest->fluxn_a[nest->parent[lev]], nest->fluxn_a[lev], "N", lev, i_time);
+}
+
+/* ------------------------------------------------------------------------------ */
+void mass_conservation(struct nestContainer *nest, int isGeog, int m) {
+	/* m is the level of nesting which starts counting at one for FIRST nesting level */
+	if (isGeog == 0)
+		run_tiles((PFV)mass, nest, m);
+	else
+		run_tiles((PFV)mass_sp, nest, m);
+}
+
+/* ------------------------------------------------------------------------------ */
+void moment_conservation(struct nestContainer *nest, int isGeog, int m) {
+	/* m is the level of nesting which starts counting at one for FIRST nesting level */
+	if (nest->linear_depth > 0) {		/* The split kernels pick the others themselves */
+		run_tiles((PFV)moment_M_split, nest, m);
+		run_tiles((PFV)moment_N_split, nest, m);
+	}
+	else if (isGeog == 0 && nest->simd_level) {
+		run_tiles((PFV)moment_M_simd, nest, m);
+		run_tiles((PFV)moment_N_simd, nest, m);
+	}
+	else if (isGeog == 0) {
+		run_tiles((PFV)moment_M, nest, m);
+		run_tiles((PFV)moment_N, nest, m);
 	}
 	else {
-		for (i = 0; i < 2; i++) {
-			Arg_p           = &Arg_List[i];
-			Arg_p->nest     = nest;
-			Arg_p->iThread  = i;
-			Arg_p->lev      = m;
-			ThreadList[i] = (HANDLE)_beginthreadex(NULL, 0, MT_sp, Arg_p, 0, NULL);
+		run_tiles((PFV)moment_sp_M, nest, m);
+		run_tiles((PFV)moment_sp_N, nest, m);
+	}
+}
+
+/* ------------------------------------------------------------------------------ */
+void fused_conservation(struct nestContainer *nest, int m, int with_openb) {
+	/* Do the mass conservation, open boundary condition and momentum conservation of grid M in
+	   a single sweep over memory instead of the mass_conservation(), openb(), moment_conservation()
+	   sequence that streams the whole grid three times. The grid is cut in bands of rows that are
+	   swept with the moment of row r computed right after the mass of row r + 2, that is, while the
+	   rows it needs are still in cache. The moment of the rows that depend on the mass of a
+	   neighbor band (the seams) is done once all bands are swept. Results are the same as the
+	   unfused sequence. Only valid when there are no nested grids nor wave maker between the
+	   mass and moment phases. */
+	int band_ny;
+
+	band_ny = nest->act_row1[m] - nest->act_row0[m];
+	band_ny = MAX((band_ny + 4 * nest->n_threads - 1) / (4 * nest->n_threads), FUSED_BAND_NY);
+	nest->fused_openb = with_openb;
+	run_blocks((PFV)fused_sweep, nest, m, band_ny, nest->hdr[m].nx);	/* Bands as wide as the active box */
+	run_blocks((PFV)fused_seams, nest, m, band_ny, nest->hdr[m].nx);
+}
+
+/* ------------------------------------------------------------------------------ */
+void fused_sweep(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	/* Sweep the band [row_start, row_end[ of grid LEV. The moment of row r needs the mass of rows
+	   r-1 to r+2 so, except for the top band, the first and two last rows are left to fused_seams() */
+	int row;
+	PFV mass_k, moment_M_k, moment_N_k;
+
+	if (nest->isGeog) {
+		mass_k = (PFV)mass_sp;    moment_M_k = (PFV)moment_sp_M;    moment_N_k = (PFV)moment_sp_N;
+	}
+	else if (nest->simd_level) {
+		mass_k = (PFV)mass;       moment_M_k = (PFV)moment_M_simd;  moment_N_k = (PFV)moment_N_simd;
+	}
+	else {
+		mass_k = (PFV)mass;       moment_M_k = (PFV)moment_M;       moment_N_k = (PFV)moment_N;
+	}
+	if (nest->linear_depth > 0) {
+		moment_M_k = (PFV)moment_M_split;    moment_N_k = (PFV)moment_N_split;
+	}
+
+	for (row = row_start; row < row_end; row++) {
+		mass_k(nest, lev, row, row + 1, col_start, col_end);
+		if (nest->fused_openb)
+			openb_rows(nest->hdr[lev], nest->bat[lev], nest->fluxm_a[lev], nest->fluxn_a[lev], nest->etad[lev], nest, row, row + 1);
+		if (row - 2 > row_start) {
+			moment_M_k(nest, lev, row - 2, row - 1, col_start, col_end);
+			moment_N_k(nest, lev, row - 2, row - 1, col_start, col_end);
+		}
+	}
+	if (row_end == nest->hdr[lev].ny) {		/* Top band. No band above to wait for */
+		for (row = MAX(row_start + 1, row_end - 2); row < row_end; row++) {
+			moment_M_k(nest, lev, row, row + 1, col_start, col_end);
+			moment_N_k(nest, lev, row, row + 1, col_start, col_end);
 		}
 	}
+}
+
+/* ------------------------------------------------------------------------------ */
+void fused_seams(struct nestContainer *nest, int lev, int row_start, int row_end, int col_start, int col_end) {
+	/* Compute the moment of the rows left undone by fused_sweep() in the band [row_start, row_end[.
+	   Row 0 is left to here too. */
+	int row;
+	PFV moment_M_k, moment_N_k;
+
+	moment_M_k = (nest->isGeog) ? (PFV)moment_sp_M : ((nest->simd_level) ? (PFV)moment_M_simd : (PFV)moment_M);
+	moment_N_k = (nest->isGeog) ? (PFV)moment_sp_N : ((nest->simd_level) ? (PFV)moment_N_simd : (PFV)moment_N);
+	if (nest->linear_depth > 0) {
+		moment_M_k = (PFV)moment_M_split;    moment_N_k = (PFV)moment_N_split;
+	}
 
-	/* Wait until all threads are ready and close the handles */
-	WaitForMultipleObjects(2, ThreadList, TRUE, INFINITE);
-	for (i = 0; i < 2; i++)
-		CloseHandle(ThreadList[i]);
+	moment_M_k(nest, lev, row_start, row_start + 1, col_start, col_end);
+	moment_N_k(nest, lev, row_start, row_start + 1, col_start, col_end);
+	if (row_end < nest->hdr[lev].ny) {
+		for (row = MAX(row_start + 1, row_end - 2); row < row_end; row++) {
+			moment_M_k(nest, lev, row, row + 1, col_start, col_end);
+			moment_N_k(nest, lev, row, row + 1, col_start, col_end);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------------ */
+void run_tiles(PFV kernel, struct nestContainer *nest, int lev) {
+	/* Split grid LEV in tiles of TILE_NY x TILE_NX cells and let KERNEL(nest, lev, row_start, row_end,
+	   col_start, col_end) compute each of them. The tiles are handed out dynamically, one at a time, so
+	   threads that get fast open ocean tiles keep on picking new ones while others are still busy on the
+	   costlier wet/dry ones. The kernels only write on the cells of their own tile and read the
+	   neighbors (the one cell halo) from arrays that are not written during the call, so the tiles
+	   need no synchronization. Only the active box of the grid (see active_region()) is tiled. */
+	run_blocks(kernel, nest, lev, TILE_NY, TILE_NX);
+}
+
+/* ------------------------------------------------------------------------------ */
+void run_blocks(PFV kernel, struct nestContainer *nest, int lev, int tile_ny, int tile_nx) {
+	/* Worker of run_tiles() that accepts any tiles size */
+	int n_tiles, n_tiles_x, ny, nx;
+
+	ny = nest->act_row1[lev] - nest->act_row0[lev];
+	nx = nest->act_col1[lev] - nest->act_col0[lev];
+	if (ny <= 0 || nx <= 0) return;		/* All at rest */
+
+	n_tiles_x = (nx + tile_nx - 1) / tile_nx;
+	n_tiles   = n_tiles_x * ((ny + tile_ny - 1) / tile_ny);
+	if (nest->n_threads <= 1 || n_tiles == 1 || nest->in_task) {
+		kernel(nest, lev, nest->act_row0[lev], nest->act_row1[lev], nest->act_col0[lev], nest->act_col1[lev]);
+		return;
+	}
+
+#if HAVE_OPENMP
+	{
+	int i;
+#pragma omp parallel for schedule(dynamic, 1) num_threads(MIN(nest->n_threads, n_tiles))
+	for (i = 0; i < n_tiles; i++)
+		run_tile(kernel, nest, lev, i, n_tiles_x, tile_ny, tile_nx);
+	}
+#elif defined(DO_MULTI_THREAD)
+	if (nest->pool) {
+		long i;
+		struct thread_pool *pool = nest->pool;
+		MUTEX_LOCK(&pool->lock);
+		pool->kernel    = kernel;
+		pool->lev       = lev;
+		pool->n_tiles   = n_tiles;
+		pool->n_tiles_x = n_tiles_x;
+		pool->tile_ny   = tile_ny;
+		pool->tile_nx   = tile_nx;
+		pool->next_tile = 0;
+		pool->n_pending = pool->n_workers;
+		pool->generation++;
+		COND_BROADCAST(&pool->work_ready);
+		MUTEX_UNLOCK(&pool->lock);
+
+		while ((i = ATOMIC_NEXT(&pool->next_tile)) < n_tiles)	/* We compute tiles too */
+			run_tile(kernel, nest, lev, (int)i, n_tiles_x, tile_ny, tile_nx);
+
+		MUTEX_LOCK(&pool->lock);	/* Wait until all workers are parked again */
+		while (pool->n_pending > 0)
+			COND_WAIT(&pool->work_done, &pool->lock);
+		MUTEX_UNLOCK(&pool->lock);
+	}
+	else
+		kernel(nest, lev, nest->act_row0[lev], nest->act_row1[lev], nest->act_col0[lev], nest->act_col1[lev]);
 #else
-	if (isGeog == 0) { 
-		for (i = 0; i < 2; i++)
-			call_moment[i](nest, m);
+	kernel(nest, lev, nest->act_row0[lev], nest->act_row1[lev], nest->act_col0[lev], nest->act_col1[lev]);
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+void run_tile(PFV kernel, struct nestContainer *nest, int lev, int tile, int n_tiles_x, int tile_ny, int tile_nx) {
+	/* Compute the tile number TILE (counted row wise) of the active box of grid LEV */
+	int row_start, col_start;
+
+	row_start = nest->act_row0[lev] + (tile / n_tiles_x) * tile_ny;
+	col_start = nest->act_col0[lev] + (tile % n_tiles_x) * tile_nx;
+	kernel(nest, lev, row_start, MIN(row_start + tile_ny, nest->act_row1[lev]),
+	       col_start, MIN(col_start + tile_nx, nest->act_col1[lev]));
+}
+
+/* ------------------------------------------------------------------------------ */
+void run_levels(PFV task, struct nestContainer *nest, int *levs, int n) {
+	/* Run TASK(nest, lev) for each of the N grids in LEVS, one per thread at a time. Used for the
+	   sibling nested grids, whose sub-steps are independent. Meanwhile the kernels called by the
+	   tasks compute their whole grid in the thread of the task (see run_blocks()). Called from inside
+	   a task (siblings that have siblings of their own), the pool is busy, so run them in this thread. */
+	int i;
+
+	if (nest->n_threads <= 1 || n == 1 || nest->in_task) {
+		for (i = 0; i < n; i++) task(nest, levs[i]);
+		return;
 	}
-	else {
-		for (i = 0; i < 2; i++)
-			call_moment_sp[i](nest, m);
+
+	nest->in_task = TRUE;
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1) num_threads(MIN(nest->n_threads, n))
+	for (i = 0; i < n; i++)
+		task(nest, levs[i]);
+#elif defined(DO_MULTI_THREAD)
+	if (nest->pool) {
+		long j;
+		struct thread_pool *pool = nest->pool;
+		MUTEX_LOCK(&pool->lock);
+		pool->kernel    = task;
+		pool->task_lev  = levs;
+		pool->n_tiles   = n;
+		pool->next_tile = 0;
+		pool->n_pending = pool->n_workers;
+		pool->generation++;
+		COND_BROADCAST(&pool->work_ready);
+		MUTEX_UNLOCK(&pool->lock);
+
+		while ((j = ATOMIC_NEXT(&pool->next_tile)) < n)	/* We take our share too */
+			task(nest, levs[j]);
+
+		MUTEX_LOCK(&pool->lock);
+		while (pool->n_pending > 0)
+			COND_WAIT(&pool->work_done, &pool->lock);
+		pool->task_lev = NULL;
+		MUTEX_UNLOCK(&pool->lock);
 	}
+	else
+		for (i = 0; i < n; i++) task(nest, levs[i]);
+#else
+	for (i = 0; i < n; i++) task(nest, levs[i]);
 #endif
+	nest->in_task = FALSE;
 }
 
+/* ------------------------------------------------------------------------------ */
+void start_pool(struct nestContainer *nest) {
+	/* Create the n_threads - 1 workers that, together with the calling thread, will compute the
+	   tiles of every kernel, of every level, for the whole run. */
 #ifdef DO_MULTI_THREAD
+	int i;
+	struct thread_pool *pool;
+
+	if (nest->n_threads <= 1) return;
+	pool = (struct thread_pool *)mxCalloc(1, sizeof(struct thread_pool));
+	pool->n_workers = MIN(nest->n_threads, MAX_THREADS) - 1;
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	InitializeCriticalSection(&pool->lock);
+	InitializeConditionVariable(&pool->work_ready);
+	InitializeConditionVariable(&pool->work_done);
+#	else
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+#	endif
+	for (i = 0; i <= pool->n_workers; i++) {
+		pool->args[i].nest    = nest;
+		pool->args[i].iThread = i;
+	}
+	nest->pool = pool;		/* Must be set before the workers start */
+	for (i = 1; i <= pool->n_workers; i++) {	/* Worker i computes band i */
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+		pool->threads[i] = (HANDLE)_beginthreadex(NULL, 0, MT_rows, &pool->args[i], 0, NULL);
+#	else
+		pthread_create(&pool->threads[i], NULL, MT_rows, &pool->args[i]);
+#	endif
+	}
+#else
+	(void)nest;
+#endif
+}
+
 /* ------------------------------------------------------------------------------ */
-unsigned __stdcall MT_cart(void *Arg_p) {
-	/* Convert input from (void *) to (ThreadArg *), call the moment and stop the thread. */
-  
-	ThreadArg *Arg = (ThreadArg *)Arg_p;
-	call_moment[Arg->iThread](Arg->nest, Arg->lev);
+void stop_pool(struct nestContainer *nest) {
+	/* Wake up the parked workers, tell them to exit, and free the pool */
+#ifdef DO_MULTI_THREAD
+	int i;
+	struct thread_pool *pool = nest->pool;
+
+	if (pool == NULL) return;
+	MUTEX_LOCK(&pool->lock);
+	pool->quit = TRUE;
+	COND_BROADCAST(&pool->work_ready);
+	MUTEX_UNLOCK(&pool->lock);
+	for (i = 1; i <= pool->n_workers; i++) {
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+#	else
+		pthread_join(pool->threads[i], NULL);
+#	endif
+	}
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	DeleteCriticalSection(&pool->lock);
+#	else
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_ready);
+	pthread_cond_destroy(&pool->work_done);
+#	endif
+	mxFree((void *)pool);
+	nest->pool = NULL;
+#else
+	(void)nest;
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+void start_writer(struct nestContainer *nest) {
+	/* Create the thread that writes the output grids and netCDF slices while the main loop goes on
+	   computing. Only one, because the netCDF library is not thread safe. Without it (no threads
+	   support, or a MEX, or the thread could not be created) the out_*() functions write the files themselves. */
+#ifdef DO_ASYNC_WRITE
+	struct out_queue *q;
+
+	if (nest->out) return;		/* Already running */
+	if ((q = (struct out_queue *)mxCalloc(1, sizeof(struct out_queue))) == NULL) return;
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	InitializeCriticalSection(&q->lock);
+	InitializeConditionVariable(&q->posted);
+	InitializeConditionVariable(&q->written);
+	if ((q->thread = (HANDLE)_beginthreadex(NULL, 0, out_writer, q, 0, NULL)) == 0) {
+		DeleteCriticalSection(&q->lock);
+		mxFree((void *)q);
+		return;
+	}
+#	else
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->posted, NULL);
+	pthread_cond_init(&q->written, NULL);
+	if (pthread_create(&q->thread, NULL, out_writer, q)) {
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->posted);
+		pthread_cond_destroy(&q->written);
+		mxFree((void *)q);
+		return;
+	}
+#	endif
+	nest->out = q;
+#else
+	(void)nest;
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+void stop_writer(struct nestContainer *nest) {
+	/* Let the writer finish the queued jobs, wait for it to exit and free the queue */
+#ifdef DO_ASYNC_WRITE
+	int i;
+	struct out_queue *q = nest->out;
+
+	if (q == NULL) return;
+	MUTEX_LOCK(&q->lock);
+	q->quit = TRUE;
+	COND_SIGNAL(&q->posted);
+	MUTEX_UNLOCK(&q->lock);
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	WaitForSingleObject(q->thread, INFINITE);
+	CloseHandle(q->thread);
+	DeleteCriticalSection(&q->lock);
+#	else
+	pthread_join(q->thread, NULL);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->posted);
+	pthread_cond_destroy(&q->written);
+#	endif
+	for (i = 0; i < OUT_SLOTS; i++)
+		if (q->jobs[i].buf) mxFree(q->jobs[i].buf);
+	mxFree((void *)q);
+	nest->out = NULL;
+#else
+	(void)nest;
+#endif
+}
+
+/* ------------------------------------------------------------------------------ */
+void out_sync(struct nestContainer *nest) {
+	/* Wait until all the queued output has been written. Needed before the main thread touches
+	   the same files (closing the netCDF ones, or a checkpoint that must see complete outputs). */
+#ifdef DO_ASYNC_WRITE
+	struct out_queue *q = nest->out;
+
+	if (q == NULL) return;
+	MUTEX_LOCK(&q->lock);
+	while (q->n_queued > 0)
+		COND_WAIT(&q->written, &q->lock);
+	MUTEX_UNLOCK(&q->lock);
+#else
+	(void)nest;
+#endif
+}
+
+#ifdef DO_ASYNC_WRITE
+/* ------------------------------------------------------------------------------ */
+struct out_job *out_slot(struct out_queue *q, size_t n) {
+	/* Return the next free slot of the ring with room for N floats, waiting for the writer if
+	   the ring is full. The job is only seen by the writer after out_post(). */
+	struct out_job *job;
+
+	MUTEX_LOCK(&q->lock);
+	while (q->n_queued == OUT_SLOTS)
+		COND_WAIT(&q->written, &q->lock);
+	MUTEX_UNLOCK(&q->lock);
+	job = &q->jobs[q->head];
+	if (n > job->n_alloc) {
+		if (job->buf) mxFree(job->buf);
+		if ((job->buf = (float *)mxMalloc(n * sizeof(float))) == NULL) {
+			job->n_alloc = 0;
+			return(NULL);
+		}
+		job->n_alloc = n;
+	}
+	return(job);
+}
+
+/* ------------------------------------------------------------------------------ */
+void out_post(struct out_queue *q) {
+	/* Hand the job filled in the head slot over to the writer */
+	MUTEX_LOCK(&q->lock);
+	q->head = (q->head + 1) % OUT_SLOTS;
+	q->n_queued++;
+	COND_SIGNAL(&q->posted);
+	MUTEX_UNLOCK(&q->lock);
+}
+
+/* ------------------------------------------------------------------------------ */
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+unsigned __stdcall out_writer(void *Arg_p) {
+#else
+void *out_writer(void *Arg_p) {
+#endif
+	/* Loop of the writer thread. Write the queued jobs in the order they were posted */
+	struct out_queue *q = (struct out_queue *)Arg_p;
+	struct out_job *job;
+
+	for (;;) {
+		MUTEX_LOCK(&q->lock);
+		while (q->n_queued == 0 && !q->quit)
+			COND_WAIT(&q->posted, &q->lock);
+		if (q->n_queued == 0) {		/* quit and nothing left to write */
+			MUTEX_UNLOCK(&q->lock);
+			break;
+		}
+		job = &q->jobs[q->tail];
+		MUTEX_UNLOCK(&q->lock);
+
+		if (job->kind == OUT_GRD)
+			write_grd_bin(job->name, job->x_min, job->y_min, job->x_inc, job->y_inc, 0, 0, job->nx, job->ny,
+			              job->nx, job->buf);
+#ifdef HAVE_NETCDF
+		else if (job->kind == OUT_VARA) {
+			err_trap(nc_put_vara_float(job->ncid, job->varid, job->start, job->count, job->buf));
+		}
+		else {
+			err_trap(nc_put_vara_double(job->ncid, job->varid, job->start, job->count, &job->value));
+		}
+#endif
+
+		MUTEX_LOCK(&q->lock);		/* Only now the slot, and its buffer, may be reused */
+		q->tail = (q->tail + 1) % OUT_SLOTS;
+		q->n_queued--;
+		COND_SIGNAL(&q->written);
+		MUTEX_UNLOCK(&q->lock);
+	}
+#if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
 	_endthreadex(0);
-	return (0);
+	return(0);
+#else
+	return(NULL);
+#endif
 }
+#endif
+
+/* ------------------------------------------------------------------------------ */
+void out_grd(struct nestContainer *nest, char *name, double x_min, double y_min, double x_inc, double y_inc,
+             unsigned int i_start, unsigned int j_start, unsigned int i_end, unsigned int j_end, unsigned int nX, float *work) {
+	/* Same as write_grd_bin() but, when there is a writer thread, only copy the I_START:I_END x
+	   J_START:J_END nodes of WORK to the queue. So WORK may be changed as soon as this returns. */
+#ifdef DO_ASYNC_WRITE
+	unsigned int j, nx = i_end - i_start, ny = j_end - j_start;
+	struct out_job *job;
+
+	if (nest->out && (job = out_slot(nest->out, (size_t)nx * ny)) != NULL) {
+		for (j = 0; j < ny; j++)
+			memcpy(&job->buf[(size_t)j * nx], &work[ijs(i_start, j + j_start, nX)], nx * sizeof(float));
+		job->kind  = OUT_GRD;
+		strncpy(job->name, name, 255);	job->name[255] = '\0';
+		job->x_min = x_min;	job->y_min = y_min;
+		job->x_inc = x_inc;	job->y_inc = y_inc;
+		job->nx = nx;		job->ny = ny;
+		out_post(nest->out);
+		return;
+	}
+#else
+	(void)nest;
+#endif
+	write_grd_bin(name, x_min, y_min, x_inc, y_inc, i_start, j_start, i_end, j_end, nX, work);
+}
+
+#ifdef HAVE_NETCDF
 /* ------------------------------------------------------------------------------ */
-unsigned __stdcall MT_sp(void *Arg_p) {
-	/* Convert input from (void *) to (ThreadArg *), call the moment and stop the thread. */
+void out_vara(struct nestContainer *nest, int ncid, int varid, int ndims, size_t *start, size_t *count, float *work) {
+	/* Same as nc_put_vara_float() for a variable with NDIMS dimensions, but queued for the writer thread */
+#ifdef DO_ASYNC_WRITE
+	int i;
+	size_t n = 1;
+	struct out_job *job;
+
+	for (i = 0; i < ndims; i++) n *= count[i];
+	if (nest->out && (job = out_slot(nest->out, n)) != NULL) {
+		memcpy(job->buf, work, n * sizeof(float));
+		job->kind  = OUT_VARA;
+		job->ncid  = ncid;	job->varid = varid;
+		for (i = 0; i < ndims; i++) {
+			job->start[i] = start[i];	job->count[i] = count[i];
+		}
+		out_post(nest->out);
+		return;
+	}
+	out_sync(nest);		/* No memory for the copy. Write it here, but not while the writer is in netCDF */
+#else
+	(void)nest;
+#endif
+	err_trap(nc_put_vara_float(ncid, varid, start, count, work));
+}
+
+/* ------------------------------------------------------------------------------ */
+void out_vara_d(struct nestContainer *nest, int ncid, int varid, size_t start, double value) {
+	/* Same as nc_put_vara_double() of one VALUE at START, but queued for the writer thread */
+	size_t count = 1;
+#ifdef DO_ASYNC_WRITE
+	struct out_job *job;
+
+	if (nest->out && (job = out_slot(nest->out, 0)) != NULL) {
+		job->kind  = OUT_VARA_D;
+		job->ncid  = ncid;	job->varid = varid;
+		job->start[0] = start;	job->count[0] = count;
+		job->value = value;
+		out_post(nest->out);
+		return;
+	}
+#else
+	(void)nest;
+#endif
+	err_trap(nc_put_vara_double(ncid, varid, &start, &count, &value));
+}
+#endif
+
+#ifdef DO_MULTI_THREAD
+/* ------------------------------------------------------------------------------ */
+void pool_worker(ThreadArg *Arg) {
+	/* Loop of a pool worker. Sleep until a new job is posted, grab tiles until there are no more left,
+	   report that we are done and go back to sleep. */
+	int generation = 0;
+	long i;
+	struct thread_pool *pool = Arg->nest->pool;
+
+	for (;;) {
+		MUTEX_LOCK(&pool->lock);
+		while (pool->generation == generation && !pool->quit)
+			COND_WAIT(&pool->work_ready, &pool->lock);
+		if (pool->quit) {
+			MUTEX_UNLOCK(&pool->lock);
+			break;
+		}
+		generation = pool->generation;
+		MUTEX_UNLOCK(&pool->lock);
+
+		while ((i = ATOMIC_NEXT(&pool->next_tile)) < pool->n_tiles) {
+			if (pool->task_lev)
+				pool->kernel(Arg->nest, pool->task_lev[i]);
+			else
+				run_tile(pool->kernel, Arg->nest, pool->lev, (int)i, pool->n_tiles_x, pool->tile_ny, pool->tile_nx);
+		}
+
+		MUTEX_LOCK(&pool->lock);
+		if (--pool->n_pending == 0)
+			COND_SIGNAL(&pool->work_done);
+		MUTEX_UNLOCK(&pool->lock);
+	}
+}
+
+/* ------------------------------------------------------------------------------ */
+#	if defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+unsigned __stdcall MT_rows(void *Arg_p) {
+	/* Convert input from (void *) to (ThreadArg *), run the worker loop and stop the thread. */
   
-	ThreadArg *Arg = (ThreadArg *)Arg_p;
-	call_moment_sp[Arg->iThread](Arg->nest, Arg->lev);
+	pool_worker((ThreadArg *)Arg_p);
 	_endthreadex(0);
 	return (0);
 }
+#	else
+void *MT_rows(void *Arg_p) {
+	/* Convert input from (void *) to (ThreadArg *) and run the worker loop. */
+  
+	pool_worker((ThreadArg *)Arg_p);
+	return (NULL);
+}
+#	endif
+#endif
 
 /* ------------------------------------------------------------------------------ */
 int GetLocalNThread(void) {
-	/* Get number of processors from the environment variable NUMBER_OF_PROCESSORS. */
+	/* Get number of processors. On Windows from the environment variable NUMBER_OF_PROCESSORS. */
   
-	char *pStr;
 	int   localNThread = 1;  /* Default */
-  
+#if HAVE_OPENMP
+	localNThread = omp_get_max_threads();
+#elif defined(WIN32) || defined(_WIN32) || defined(_WIN64)
+	char *pStr;
 	if ((pStr = getenv("NUMBER_OF_PROCESSORS")) != NULL)
 		sscanf(pStr, "%d", &localNThread);
+#elif defined(_SC_NPROCESSORS_ONLN)
+	localNThread = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (localNThread < 1) localNThread = 1;
   
 	return (localNThread);
 }
 
-#endif
-
 
 /* ---------------------------------------------------------------------------------------- */
 void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min, double x_max,
-	double y_min, double y_max, int type, double *z) {
+	double y_min, double y_max, int type, real *z) {
 	/* Create a prismatic source (a Kaba) to use as source for the Green's functions method.
 	   when type = 1, all variables represent what their names say
 	   when type = 2, x_min/x_max are instead the prism's center and y_min/y_max its half widths
@@ -5411,7 +8400,7 @@ void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min
 		row1 = irint((y_min - hdr.y_min) / y_inc) - ny2;
 		row2 = row1 + 2*ny2;
 	}
-	memset(z, 0, hdr.nx * hdr.ny * sizeof(double));		/* Need because this function may be called recursivly */
+	memset(z, 0, hdr.nx * hdr.ny * sizeof(real));		/* Need because this function may be called recursivly */
 	for (row = row1; row <= row2; row++) {
 		for (col = col1; col <= col2; col++) {
 			z[ij_grd(col,row,hdr)] = 1;
@@ -5419,10 +8408,653 @@ void kaba_source(struct srf_header hdr, double x_inc, double y_inc, double x_min
 	}
 }
 
+/* ---------------------------------------------------------------------------------------- */
+void kaba_reset(struct nestContainer *nest, int nNg) {
+	/* Put all levels at rest before computing the next prism of a -Fk grid.
+	   Level 0 already has the new source in etaa */
+	unsigned int nm;
+	int lev;
+
+	for (lev = 0; lev <= nNg; lev++) {
+		nm = nest->hdr[lev].nm * nest->n_pack;		/* Packs have no nested grids */
+		nest->new_state[lev] = FALSE;	/* The new start state is in the _a arrays */
+		nest->act_step[lev]  = 0;		/* And the rest state changed too */
+		if (lev > 0)                    /* Level 0 has the new source */
+			memset(nest->etaa[lev], 0, (size_t)(nm * sizeof(real)));
+		memset(nest->etad[lev],     0, (size_t)(nm * sizeof(real)));
+		memset(nest->fluxm_a[lev],  0, (size_t)(nm * sizeof(real)));
+		memset(nest->fluxm_d[lev],  0, (size_t)(nm * sizeof(real)));
+		memset(nest->fluxn_a[lev],  0, (size_t)(nm * sizeof(real)));
+		memset(nest->fluxn_d[lev],  0, (size_t)(nm * sizeof(real)));
+		memset(nest->htotal_a[lev], 0, (size_t)(nm * sizeof(real)));
+		memset(nest->htotal_d[lev], 0, (size_t)(nm * sizeof(real)));
+	}
+	nest->time_h = 0;
+	if (nest->wake_eta > 0)
+		nest_sleep(nest, nNg);	/* The new prism may be far from the nested grids */
+}
+
+/* ---------------------------------------------------------------------------------------- */
+int kaba_lanes(struct nestContainer *nest, struct kaba_grid *kb) {
+	/* Make the KB->n_lanes copies of the container in which the prisms are computed concurrently.
+	   Each copy has its own state arrays but shares the bathymetry, friction, cells classes
+	   and the spherical coefficients (r0..r4n) with NEST, which are only read during the run. */
+	unsigned int nm, n;
+	int i, lev;
+	struct nestContainer *L;
+
+	kb->lane    = (struct nestContainer *) mxCalloc((size_t)kb->n_lanes, sizeof(struct nestContainer));
+	kb->lane_id = (int *) mxCalloc((size_t)kb->n_lanes, sizeof(int));
+	kb->mar     = (real **) mxCalloc((size_t)(kb->n_lanes * kb->n_pack), sizeof(real *));
+	if (kb->lane == NULL || kb->lane_id == NULL || kb->mar == NULL)
+		{no_sys_mem("(kaba_lanes)", kb->n_lanes); return(-1);}
+
+	for (i = 0; i < kb->n_lanes; i++) {
+		L  = &kb->lane[i];
+		*L = *nest;
+		L->n_threads = 1;		/* Each prism runs in the thread that picked it */
+		L->pool      = NULL;
+		L->out       = NULL;		/* The writer belongs to the main container */
+		L->kb        = NULL;
+		L->n_pack    = kb->n_pack;
+		kb->lane_id[i] = i;
+		for (lev = 0; lev < kb->n_pack; lev++) {
+			if ((kb->mar[i * kb->n_pack + lev] = (real *) mxCalloc((size_t)(kb->n_samples * kb->n_mareg), sizeof(real)) ) == NULL)
+				{no_sys_mem("(kaba_lanes)", kb->n_samples * kb->n_mareg); return(-1);}
+		}
+
+		for (lev = 0; lev <= nest->n_nested; lev++) {
+			nm = nest->hdr[lev].nm * kb->n_pack;		/* Packs have no nested grids */
+			if ((L->etaa[lev] = (real *)       mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(etaa)", nm); return(-1);}
+			if ((L->etad[lev] = (real *)       mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(etad)", nm); return(-1);}
+			if ((L->fluxm_a[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(fluxm_a)", nm); return(-1);}
+			if ((L->fluxm_d[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(fluxm_d)", nm); return(-1);}
+			if ((L->fluxn_a[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(fluxn_a)", nm); return(-1);}
+			if ((L->fluxn_d[lev] = (real *)    mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(fluxn_d)", nm); return(-1);}
+			if ((L->htotal_a[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(htotal_a)", nm); return(-1);}
+			if ((L->htotal_d[lev] = (real *)   mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(htotal_d)", nm); return(-1);}
+
+			/* The kernels write on these too when they exist */
+			if (nest->long_beach[lev] && (L->long_beach[lev] = (short int *) mxCalloc ((size_t)nm, sizeof(short int)) ) == NULL)
+				{no_sys_mem("(long_beach)", nm); return(-1);}
+			if (nest->short_beach[lev] && (L->short_beach[lev] = (short int *) mxCalloc ((size_t)nm, sizeof(short int)) ) == NULL)
+				{no_sys_mem("(short_beach)", nm); return(-1);}
+			if (nest->vex[lev] && (L->vex[lev] = (real *) mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(vex)", nm); return(-1);}
+			if (nest->vey[lev] && (L->vey[lev] = (real *) mxCalloc ((size_t)nm, sizeof(real)) ) == NULL)
+				{no_sys_mem("(vey)", nm); return(-1);}
+
+			if (lev == 0) continue;
+			/* The boundary conditions of the nested grids are interpolated in these */
+			n = nest->hdr[lev].nx;
+			L->edge_rowTmp[lev]   = (double *) mxCalloc((size_t)n, sizeof(double));
+			n = nest->hdr[lev].ny;
+			L->edge_colTmp[lev]   = (double *) mxCalloc((size_t)n, sizeof(double));
+			n = nest->LRcol[lev] - nest->LLcol[lev] + 1;
+			L->edge_row_Ptmp[lev] = (double *) mxCalloc((size_t)n, sizeof(double));
+			n = nest->ULrow[lev] - nest->LLrow[lev] + 1;
+			L->edge_col_Ptmp[lev] = (double *) mxCalloc((size_t)n, sizeof(double));
+			if (!L->edge_rowTmp[lev] || !L->edge_colTmp[lev] || !L->edge_row_Ptmp[lev] || !L->edge_col_Ptmp[lev])
+				{no_sys_mem("(edges)", n); return(-1);}
+		}
+	}
+	nest->kb = kb;
+	return(0);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+void kaba_lanes_free(struct kaba_grid *kb) {
+	int i, lev;
+	struct nestContainer *L;
+
+	for (i = 0; i < kb->n_lanes; i++) {
+		L = &kb->lane[i];
+		for (lev = 0; lev <= L->n_nested; lev++) {
+			if (L->etaa[lev]) mxFree(L->etaa[lev]);
+			if (L->etad[lev]) mxFree(L->etad[lev]);
+			if (L->fluxm_a[lev]) mxFree(L->fluxm_a[lev]);
+			if (L->fluxm_d[lev]) mxFree(L->fluxm_d[lev]);
+			if (L->fluxn_a[lev]) mxFree(L->fluxn_a[lev]);
+			if (L->fluxn_d[lev]) mxFree(L->fluxn_d[lev]);
+			if (L->htotal_a[lev]) mxFree(L->htotal_a[lev]);
+			if (L->htotal_d[lev]) mxFree(L->htotal_d[lev]);
+			if (L->long_beach[lev]) mxFree(L->long_beach[lev]);
+			if (L->short_beach[lev]) mxFree(L->short_beach[lev]);
+			if (L->vex[lev]) mxFree(L->vex[lev]);
+			if (L->vey[lev]) mxFree(L->vey[lev]);
+			if (lev == 0) continue;
+			if (L->edge_rowTmp[lev]) mxFree(L->edge_rowTmp[lev]);
+			if (L->edge_colTmp[lev]) mxFree(L->edge_colTmp[lev]);
+			if (L->edge_row_Ptmp[lev]) mxFree(L->edge_row_Ptmp[lev]);
+			if (L->edge_col_Ptmp[lev]) mxFree(L->edge_col_Ptmp[lev]);
+		}
+	}
+	for (i = 0; i < kb->n_lanes * kb->n_pack; i++)
+		if (kb->mar[i]) mxFree(kb->mar[i]);
+	mxFree(kb->lane);	mxFree(kb->lane_id);	mxFree(kb->mar);
+	kb->lane = NULL;	kb->lane_id = NULL;	kb->mar = NULL;
+}
+
+/* ---------------------------------------------------------------------------------------- */
+void kaba_lane(struct nestContainer *nest, int i) {
+	/* Compute prism KB->first + I of a -Fk grid (or that -Fb scenario) in the I-th copy of the container
+	   and keep its maregraphs in KB->mar[I]. This is the main loop stripped of everything but the
+	   maregraphs, which is all that kaba_lanes() is used for. Called by run_levels(). */
+	int    k, ij, n = 0, row, col, prism;
+	double x1, x2, y1, y2;
+	struct kaba_grid *kb = nest->kb;
+	struct nestContainer *L = &kb->lane[i];
+
+	prism = kb->first + i;
+	if (kb->fault) {
+		double *f = &kb->fault[9 * prism];		/* dip/azim/rake/slip/length/width/topDepth/x_epic/y_epic */
+		deform(kb->hdr, kb->dx, kb->dy, L->isGeog, f[4], f[5], f[1], f[0], f[2], f[3], f[6], f[7], f[8], L->etaa[0]);
+	}
+	else {
+		col = prism % kb->n_cols;		row = prism / kb->n_cols;
+		x1 = kb->x_min + col * kb->x_inc;		x2 = kb->x_max + col * kb->x_inc;
+		y1 = kb->y_min + row * kb->y_inc;		y2 = kb->y_max + row * kb->y_inc;
+		kaba_source(kb->hdr, kb->dx, kb->dy, x1, x2, y1, y2, kb->type, L->etaa[0]);
+	}
+	kaba_reset(L, L->n_nested);
+	if (kb->fault && L->n_nested) {		/* As main() does at setup, the nested grids start from the new source */
+		resamplegrid(L, L->n_nested);
+		if (L->wake_eta > 0)
+			nest_sleep(L, L->n_nested);
+	}
+
+	for (k = 0; k < kb->n_cycles; k++) {
+		update(L, 0);
+		active_region(L, 0);
+
+		if (kb->do_fused)
+			fused_conservation(L, 0, (k != 0));
+		else
+			mass_conservation(L, L->isGeog, 0);
+
+		if (k && !kb->do_fused)
+			openb(L->hdr[0], L->bat[0], L->fluxm_a[0], L->fluxn_a[0], L->etad[0], L);
+
+		if (L->n_nested) nestify_children(L, L->n_nested, 0, L->isGeog);
+
+		if (!kb->do_fused) moment_conservation(L, L->isGeog, 0);
+
+		L->new_state[0] = TRUE;
+
+		if (k % kb->cumint == 0 && n < kb->n_samples * kb->n_mareg) {
+			for (ij = 0; ij < kb->n_mareg; ij++)
+				kb->mar[i][n++] = L->etad[kb->writeLevel][kb->lcum_p[ij]];
+		}
+		L->time_h += kb->dt;
+	}
+}
+
+/* ---------------------------------------------------------------------------------------- */
+void pack_lane(struct nestContainer *nest, int i) {
+	/* Same as kaba_lane() for the pack of SCEN_PACK -Fb scenarios that starts at KB->first + I * SCEN_PACK,
+	   whose maregraphs go to KB->mar[I * SCEN_PACK + s]. A last pack that is not full repeats its last
+	   scenario in the spare slots, which are then not written. Called by run_levels(). */
+	int    k, ij, n = 0, s, scen;
+	size_t c, nm;
+	struct kaba_grid *kb = nest->kb;
+	struct nestContainer *L = &kb->lane[i];
+	double *f;
+
+	nm = (size_t)L->hdr[0].nm;
+	for (s = 0; s < SCEN_PACK; s++) {
+		scen = MIN(kb->first + i * SCEN_PACK + s, kb->n_runs - 1);
+		f = &kb->fault[9 * scen];
+		deform(kb->hdr, kb->dx, kb->dy, L->isGeog, f[4], f[5], f[1], f[0], f[2], f[3], f[6], f[7], f[8], L->etad[0]);
+		for (c = 0; c < nm; c++)		/* etad is only scratch before kaba_reset() */
+			L->etaa[0][c * SCEN_PACK + s] = L->etad[0][c];
+	}
+	kaba_reset(L, 0);
+
+	for (k = 0; k < kb->n_cycles; k++) {
+		update(L, 0);
+		mass_pack(L, 0, 0, L->hdr[0].ny, 0, L->hdr[0].nx);
+		if (k) {
+			for (s = 0; s < SCEN_PACK; s++)
+				openb_strided(L->hdr[0], L->bat[0], L->fluxm_a[0], L->fluxn_a[0], L->etad[0], L, 0, L->hdr[0].ny, SCEN_PACK, s);
+		}
+		moment_M_pack(L, 0, 0, L->hdr[0].ny, 0, L->hdr[0].nx);
+		moment_N_pack(L, 0, 0, L->hdr[0].ny, 0, L->hdr[0].nx);
+		L->new_state[0] = TRUE;
+
+		if (k % kb->cumint == 0 && n < kb->n_samples * kb->n_mareg) {
+			for (ij = 0; ij < kb->n_mareg; ij++, n++)
+				for (s = 0; s < SCEN_PACK; s++)
+					kb->mar[i * SCEN_PACK + s][n] = L->etad[0][(size_t)kb->lcum_p[ij] * SCEN_PACK + s];
+		}
+		L->time_h += kb->dt;
+	}
+}
+
+/* ---------------------------------------------------------------------------------------- */
+int run_scenarios(struct nestContainer *nest, struct kaba_grid *kb, int n_scen, char *scen_names[],
+                  char *mareg_names[], char *fname, char hist[], int out_nc, float *work, double *t) {
+	/* -Fb. Run the N_SCEN fault scenarios of KB, KB->n_lanes at a time (or KB->n_lanes packs of
+	   KB->n_pack when that is > 1), on the domain that was set up only once by main(), and write
+	   the maregraphs of each one in its own file. That is the -T file name, FNAME, with
+	   "_<scenario name>" inserted before the extension. WORK and T are buffers for
+	   the netCDF output, of the size of the main() maregs_array and maregs_timeout. */
+	int    i, j, k, ij, n, s;
+	char   name[512], *pch;
+	double time_h;
+	FILE  *fp;
+
+	if (kaba_lanes(nest, kb)) return(-1);
+
+	if ((pch = strrchr(fname, '.')) == NULL || strpbrk(pch, "/\\") != NULL)
+		pch = &fname[strlen(fname)];		/* No extension */
+
+	for (kb->first = 0; kb->first < n_scen; kb->first += kb->n_lanes * kb->n_pack) {
+		n = MIN(kb->n_lanes * kb->n_pack, n_scen - kb->first);		/* Scenarios in this batch */
+		fprintf(stderr, "Computing scenarios %d to %d out of %d\n", kb->first + 1, kb->first + n, n_scen);
+		run_levels((kb->n_pack > 1) ? (PFV)pack_lane : (PFV)kaba_lane, nest, kb->lane_id, (n + kb->n_pack - 1) / kb->n_pack);
+
+		for (i = 0; i < n; i++) {	/* Only this thread writes the files */
+			s = kb->first + i;
+			sprintf(name, "%.*s_%s%s", (int)(pch - fname), fname, scen_names[s], pch);
+			if (!out_nc) {
+				if ((fp = fopen (name, "w")) == NULL) {
+					mexPrintf("%s: Unable to create file %s - exiting\n", "nswing", name);
+					kaba_lanes_free(kb);
+					return(-1);
+				}
+				write_maregs_header(fp, nest, kb->lcum_p, mareg_names, kb->n_mareg, kb->writeLevel);
+				for (k = j = 0, time_h = 0; k < kb->n_cycles; k++) {	/* Same times as in the main loop */
+					if (k % kb->cumint == 0) {
+						fprintf (fp, "%.3f", (time_h + kb->dt/2));
+						for (ij = 0; ij < kb->n_mareg; ij++)
+							fprintf (fp, "\t%.5f", kb->mar[i][j++]);
+						fprintf (fp, "\n");
+					}
+					time_h += kb->dt;
+				}
+				fclose (fp);
+			}
+#ifdef HAVE_NETCDF
+			else {
+				for (k = j = 0, time_h = 0; k < kb->n_cycles; k++) {
+					if (k % kb->cumint == 0) t[j++] = time_h + kb->dt/2;
+					time_h += kb->dt;
+				}
+				for (ij = 0; ij < kb->n_samples * kb->n_mareg; ij++)
+					work[ij] = (float)kb->mar[i][ij];
+				write_maregs_nc(nest, name, work, t, kb->lcum_p, mareg_names, hist, kb->n_mareg,
+				                kb->n_samples, kb->writeLevel);
+			}
+#else
+			(void)hist;	(void)work;	(void)t;	/* Only for the netCDF output */
+#endif
+		}
+	}
+
+	kaba_lanes_free(kb);
+	nest->kb = NULL;
+	return(0);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+int checkpoint_rw(FILE *fp, void *p, size_t n, int writing) {
+	/* Write (or read) N bytes of P and the padding to the next multiple of CHK_ALIGN. Returns 1 on error */
+	static char zeros[CHK_ALIGN];
+	size_t pad = (CHK_ALIGN - n % CHK_ALIGN) % CHK_ALIGN;
+
+	if (writing)
+		return (fwrite(p, 1, n, fp) != n || fwrite(zeros, 1, pad, fp) != pad);
+	return (fread(p, 1, n, fp) != n || fseek(fp, (long)pad, SEEK_CUR) != 0);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+int checkpoint_io(FILE *fp, struct nestContainer *nest, int nNg, struct checkpoint *chk, float *wmax, float *vmax,
+                  float *maregs, double *maregs_t, struct tracers *oranges, int writing) {
+	/* Write (or read) the arrays of a checkpoint, after its header CHK. The state of every level
+	   and then whichever of the max grids, the netCDF maregraphs buffers and the tracers the
+	   run has. That is all the state a run carries from one cycle to the next. */
+	int    lev, n, err = 0;
+	size_t nm;
+
+	for (lev = 0; lev <= nNg; lev++) {
+		nm = (size_t)nest->hdr[lev].nm * sizeof(real);
+		err += checkpoint_rw(fp, nest->etaa[lev],     nm, writing);
+		err += checkpoint_rw(fp, nest->etad[lev],     nm, writing);
+		err += checkpoint_rw(fp, nest->fluxm_a[lev],  nm, writing);
+		err += checkpoint_rw(fp, nest->fluxm_d[lev],  nm, writing);
+		err += checkpoint_rw(fp, nest->fluxn_a[lev],  nm, writing);
+		err += checkpoint_rw(fp, nest->fluxn_d[lev],  nm, writing);
+		err += checkpoint_rw(fp, nest->htotal_a[lev], nm, writing);
+		err += checkpoint_rw(fp, nest->htotal_d[lev], nm, writing);
+		if (chk->arrays[lev] & CHK_VEX) err += checkpoint_rw(fp, nest->vex[lev], nm, writing);
+		if (chk->arrays[lev] & CHK_VEY) err += checkpoint_rw(fp, nest->vey[lev], nm, writing);
+		nm = (size_t)nest->hdr[lev].nm * sizeof(short);
+		if (chk->arrays[lev] & CHK_LBEACH) err += checkpoint_rw(fp, nest->long_beach[lev],  nm, writing);
+		if (chk->arrays[lev] & CHK_SBEACH) err += checkpoint_rw(fp, nest->short_beach[lev], nm, writing);
+	}
+
+	nm = (size_t)nest->hdr[nest->writeLevel].nm * sizeof(float);
+	if (chk->contents & CHK_WMAX) err += checkpoint_rw(fp, wmax, nm, writing);
+	if (chk->contents & CHK_VMAX) err += checkpoint_rw(fp, vmax, nm, writing);
+	if (chk->contents & CHK_MAREGS) {
+		err += checkpoint_rw(fp, maregs,   (size_t)chk->count_maregs * sizeof(float), writing);
+		err += checkpoint_rw(fp, maregs_t, (size_t)chk->count_time_maregs * sizeof(double), writing);
+	}
+	if (chk->contents & CHK_TRACERS) {		/* Their positions at the cycles done */
+		for (n = 0; n < chk->n_oranges; n++) {
+			err += checkpoint_rw(fp, oranges[n].x, (size_t)chk->k * sizeof(double), writing);
+			err += checkpoint_rw(fp, oranges[n].y, (size_t)chk->k * sizeof(double), writing);
+		}
+	}
+	return (err);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+void checkpoint_head(struct nestContainer *nest, int nNg, struct checkpoint *chk) {
+	/* Fill the fields of the header CHK that describe the grids and the state of NEST. The
+	   others (the cycle, maregraphs counters, and optional contents) are set by main() */
+	int lev;
+
+	memcpy(chk->magic, "NSWCHK01", 8);
+	chk->real_size = (int)sizeof(real);
+	chk->n_levels  = nNg + 1;
+	for (lev = 0; lev < 10; lev++) {
+		chk->nx[lev] = (lev <= nNg) ? nest->hdr[lev].nx : 0;
+		chk->ny[lev] = (lev <= nNg) ? nest->hdr[lev].ny : 0;
+		chk->arrays[lev] = 0;
+		if (lev > nNg) continue;
+		if (nest->vex[lev])         chk->arrays[lev] |= CHK_VEX;
+		if (nest->vey[lev])         chk->arrays[lev] |= CHK_VEY;
+		if (nest->long_beach[lev])  chk->arrays[lev] |= CHK_LBEACH;
+		if (nest->short_beach[lev]) chk->arrays[lev] |= CHK_SBEACH;
+	}
+	memcpy(chk->new_state, nest->new_state, sizeof(chk->new_state));
+	memcpy(chk->asleep,    nest->asleep,    sizeof(chk->asleep));
+	memcpy(chk->act_step,  nest->act_step,  sizeof(chk->act_step));
+	memcpy(chk->act_row0,  nest->act_row0,  sizeof(chk->act_row0));
+	memcpy(chk->act_row1,  nest->act_row1,  sizeof(chk->act_row1));
+	memcpy(chk->act_col0,  nest->act_col0,  sizeof(chk->act_col0));
+	memcpy(chk->act_col1,  nest->act_col1,  sizeof(chk->act_col1));
+	memcpy(chk->dt,        nest->dt,        sizeof(chk->dt));
+	chk->time_h = nest->time_h;
+}
+
+/* ---------------------------------------------------------------------------------------- */
+int write_checkpoint(char *file, struct nestContainer *nest, int nNg, struct checkpoint *chk, float *wmax,
+                     float *vmax, float *maregs, double *maregs_t, struct tracers *oranges) {
+	/* -K. Save the run, whose next cycle is CHK->k, so that -I can resume it. The file is the header
+	   CHK followed by the arrays, each at a multiple of CHK_ALIGN bytes and in the native binary
+	   format, so that it can also be memory mapped. It is written to <file>.tmp and then renamed,
+	   so a run killed in the middle leaves the previous checkpoint intact. */
+	int   err;
+	char  tmp[512];
+	FILE *fp;
+
+	checkpoint_head(nest, nNg, chk);
+	sprintf(tmp, "%.500s.tmp", file);
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		mexPrintf("NSWING: Unable to create file %s\n", tmp);
+		return(-1);
+	}
+	err  = checkpoint_rw(fp, chk, sizeof(struct checkpoint), TRUE);
+	err += checkpoint_io(fp, nest, nNg, chk, wmax, vmax, maregs, maregs_t, oranges, TRUE);
+	err += (fclose(fp) != 0);
+	if (!err && rename(tmp, file) != 0) {		/* Windows does not rename over an existing file */
+		remove(file);
+		err = (rename(tmp, file) != 0);
+	}
+	if (err) {
+		mexPrintf("NSWING: Error writing the checkpoint file %s\n", file);
+		remove(tmp);
+		return(-1);
+	}
+	return(0);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+int read_checkpoint(char *file, struct nestContainer *nest, int nNg, struct checkpoint *chk, float *wmax,
+                    float *vmax, float *maregs, double *maregs_t, struct tracers *oranges) {
+	/* -I. Load the checkpoint FILE into NEST and the run buffers. On input CHK has the contents and
+	   counts of this run (as write_checkpoint() would save them), and the file must have been
+	   written by a run with the same grids and outputs. On output it has the counters saved. */
+	int   lev, err;
+	struct checkpoint me, *F = chk;
+	FILE *fp;
+
+	me = *chk;
+	checkpoint_head(nest, nNg, &me);		/* What this run would write */
+	if ((fp = fopen(file, "rb")) == NULL) {
+		mexPrintf("NSWING: Unable to open file %s - exiting\n", file);
+		return(-1);
+	}
+	if (checkpoint_rw(fp, F, sizeof(struct checkpoint), FALSE) || memcmp(F->magic, me.magic, 8)) {
+		mexPrintf("NSWING: %s is not a checkpoint file\n", file);
+		fclose(fp);
+		return(-1);
+	}
+	err = (F->real_size != me.real_size || F->n_levels != me.n_levels || F->contents != me.contents ||
+	       F->n_mareg != me.n_mareg || F->n_oranges != me.n_oranges);
+	for (lev = 0; lev < 10; lev++)
+		err += (F->nx[lev] != me.nx[lev] || F->ny[lev] != me.ny[lev] || F->arrays[lev] != me.arrays[lev]);
+	if (err) {
+		mexPrintf("NSWING: The checkpoint %s was written by a run with other grids, outputs or precision\n", file);
+		fclose(fp);
+		return(-1);
+	}
+	if (checkpoint_io(fp, nest, nNg, F, wmax, vmax, maregs, maregs_t, oranges, FALSE)) {
+		mexPrintf("NSWING: The checkpoint %s is truncated\n", file);
+		fclose(fp);
+		return(-1);
+	}
+	fclose(fp);
+
+	memcpy(nest->new_state, F->new_state, sizeof(F->new_state));
+	memcpy(nest->asleep,    F->asleep,    sizeof(F->asleep));
+	memcpy(nest->act_step,  F->act_step,  sizeof(F->act_step));
+	memcpy(nest->act_row0,  F->act_row0,  sizeof(F->act_row0));
+	memcpy(nest->act_row1,  F->act_row1,  sizeof(F->act_row1));
+	memcpy(nest->act_col0,  F->act_col0,  sizeof(F->act_col0));
+	memcpy(nest->act_col1,  F->act_col1,  sizeof(F->act_col1));
+	memcpy(nest->dt,        F->dt,        sizeof(F->dt));
+	nest->time_h = F->time_h;
+	return(0);
+}
+
+/* ---------------------------------------------------------------------------------------- */
+void checkpoint_signal(int sig) {
+	/* -K. Only take note of SIG. The main loop writes the checkpoint at the end of the current cycle */
+	chk_signal = sig;
+	signal(sig, checkpoint_signal);
+}
+
+#ifdef HAVE_NETCDF
+/* ---------------------------------------------------------------------------------------- */
+int synth_greens(char *arg, int verbose) {
+	/* -Fg<greens.nc>,<heights>[,<out>][+m]. Build the maregraphs of a source made of the prisms of a -Fk
+	   grid, each with its own height, as the sum of their Green's functions weighted by those heights.
+	   Nothing is simulated, the maregraphs are only read from the file that -Fk wrote (write_greens_nc()).
+	   Only the rows of the prisms with a non zero height are read, one at a time, so the cost is that of
+	   the source and not of the whole database. With +m the max water level at each maregraph, and its
+	   time, also go to <out> with "_max" inserted before the extension. */
+	int     k = 0, n_out = 0, n_used = 0, do_max = FALSE, geog = FALSE, status, ncid, id, id_G, dim, row, col;
+	char    *str, *gfile, *sfile, *ofile, *pch, line[256], name[512], fmt[16], **names;
+	size_t  ij, n_m, n_t, n_p, n_prism, tm, km, kp, start[2] = {0, 0}, count[2] = {1, 0};
+	float   *g;
+	double  BB[8], x, y, h, *w, *acc, *t, *xm, *ym;
+	clock_t tic = clock();
+	FILE   *fp;
+
+	str = strdup(arg);
+	if ((ij = strlen(str)) > 2 && !strcmp(&str[ij-2], "+m")) {
+		do_max = TRUE;
+		str[ij-2] = '\0';
+	}
+	gfile = str;
+	if ((sfile = strchr(gfile, ',')) == NULL) {
+		mexPrintf("NSWING: Error, -Fg option, must provide the Green's functions file and the prism heights file\n");
+		free(str);
+		return(-1);
+	}
+	*sfile++ = '\0';
+	if ((ofile = strchr(sfile, ',')) != NULL)
+		*ofile++ = '\0';
+	else {		/* As -T, append '_synth.dat' to the heights file name (without its extension) */
+		strcpy(name, sfile);
+		if ((pch = strrchr(name, '.')) != NULL && strpbrk(pch, "/\\") == NULL) pch[0] = '\0';
+		ofile = strcat(name, "_synth.dat");
+	}
+
+	if ((status = nc_open(gfile, NC_NOWRITE, &ncid)) != NC_NOERR) {
+		mexPrintf("NSWING: Unable to open file -- %s -- exiting\n", gfile);
+		free(str);
+		return(-1);
+	}
+	if (nc_inq_dimid(ncid, "countMareg", &dim) || nc_inq_dimlen(ncid, dim, &n_m) ||
+	    nc_inq_dimid(ncid, "time", &dim)       || nc_inq_dimlen(ncid, dim, &n_t) ||
+	    nc_inq_dimid(ncid, "binIndex", &dim)   || nc_inq_dimlen(ncid, dim, &n_p) ||
+	    nc_inq_varid(ncid, "Greens", &id_G)    || nc_get_att_double(ncid, id_G, "BB_inc_RC", BB)) {
+		mexPrintf("NSWING: File %s was not written by -Fk (no Greens variable or BB_inc_RC attribute)\n", gfile);
+		nc_close(ncid);		free(str);
+		return(-1);
+	}
+	n_prism = (size_t)(BB[6] * BB[7]);
+	if (n_p < n_prism)
+		mexPrintf("NSWING: WARNING, file %s only has %d of the %d prisms. The others count as zero\n",
+		          gfile, (int)n_p, (int)n_prism);
+
+	t  = (double *) mxCalloc(n_t, sizeof(double));
+	xm = (double *) mxCalloc(n_m, sizeof(double));
+	ym = (double *) mxCalloc(n_m, sizeof(double));
+	w  = (double *) mxCalloc(n_prism, sizeof(double));
+	names = (char **) mxCalloc(n_m, sizeof(char *));
+	if (nc_inq_varid(ncid, "lonMareg", &id) == NC_NOERR)
+		geog = TRUE;
+	else
+		err_trap(nc_inq_varid(ncid, "xMareg", &id));
+	err_trap(nc_get_var_double(ncid, id, xm));
+	err_trap(nc_inq_varid(ncid, (geog) ? "latMareg" : "yMareg", &id));
+	err_trap(nc_get_var_double(ncid, id, ym));
+	err_trap(nc_inq_varid(ncid, "time", &id));
+	err_trap(nc_get_var_double(ncid, id, t));
+	err_trap(nc_inq_varid(ncid, "namesMareg", &id));
+	err_trap(nc_get_var_string(ncid, id, names));
+
+	/* The heights. One "x y height" per line, added to the prism that contains x,y */
+	if ((fp = fopen(sfile, "r")) == NULL) {
+		mexPrintf("NSWING: Unable to open file %s - exiting\n", sfile);
+		status = -1;
+		goto Done;
+	}
+	while (fgets(line, 256, fp) != NULL) {
+		k++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;	/* Jump comment and empty lines */
+		if (sscanf(line, "%lf %lf %lf", &x, &y, &h) != 3) {
+			mexPrintf("NSWING: Error reading prism heights file at line %d Expected 3 values\n", k);
+			continue;
+		}
+		col = (int)floor((x - BB[0]) / BB[4]);		row = (int)floor((y - BB[2]) / BB[5]);
+		if (col < 0 || col >= (int)BB[7] || row < 0 || row >= (int)BB[6]) {
+			n_out++;
+			continue;
+		}
+		w[row * (int)BB[7] + col] += h;
+	}
+	fclose(fp);
+	if (n_out)
+		mexPrintf("NSWING: WARNING, %d points of %s are outside the prisms grid. Ignored\n", n_out, sfile);
+
+	/* The sum. The Greens rows have the n_t times of one maregraph after the other */
+	tm  = n_m * n_t;
+	g   = (float *)  mxCalloc(tm, sizeof(float));
+	acc = (double *) mxCalloc(tm, sizeof(double));
+	count[1] = tm;
+	for (ij = 0; ij < MIN(n_prism, n_p); ij++) {
+		if (w[ij] == 0) continue;
+		start[0] = ij;
+		if ((status = nc_get_vara_float(ncid, id_G, start, count, g)) != NC_NOERR) {
+			err_trap(status);
+			break;
+		}
+		h = w[ij];
+		SIMD_LOOP
+		for (km = 0; km < tm; km++) acc[km] += h * g[km];
+		n_used++;
+	}
+
+	if (status == NC_NOERR && (fp = fopen(ofile, "w")) == NULL) {
+		mexPrintf("%s: Unable to create file %s - exiting\n", "nswing", ofile);
+		status = -1;
+	}
+	if (status == NC_NOERR) {
+		strcpy(fmt, (geog) ? "\t%.5f" : "\t%.2f");
+		/* The header of write_maregs_header(), but the depths are not in the file */
+		fprintf(fp, "#\t");
+		for (km = 0; km < n_m; km++) fprintf(fp, "%8s", names[km]);
+		for (k = 0; k < 5; k++) {
+			fprintf(fp, (k < 3) ? "\n#\t" : (k == 3) ? "\n# X\t" : "\n# Y\t");
+			for (km = 0; km < n_m; km++) {
+				if (k == 2)
+					fprintf(fp, "\tNaN");
+				else
+					fprintf(fp, fmt, (k == 0 || k == 3) ? xm[km] : ym[km]);
+			}
+		}
+		fprintf(fp, "\n>XY\n");
+		for (kp = 0; kp < n_t; kp++) {
+			fprintf(fp, "%.3f", t[kp]);
+			for (km = 0; km < n_m; km++)
+				fprintf(fp, "\t%.5f", acc[km * n_t + kp]);
+			fprintf(fp, "\n");
+		}
+		fclose(fp);
+
+		if (do_max) {
+			strcpy(line, ofile);
+			if ((pch = strrchr(line, '.')) == NULL || strpbrk(pch, "/\\") != NULL)
+				pch = &line[strlen(line)];		/* No extension */
+			sprintf(name, "%.*s_max%s", (int)(pch - line), line, &ofile[pch - line]);
+			if ((fp = fopen(name, "w")) == NULL) {
+				mexPrintf("%s: Unable to create file %s - exiting\n", "nswing", name);
+				status = -1;
+			}
+			else {
+				fprintf(fp, "# X\tY\tmax\ttime\tname\n");
+				for (km = 0; km < n_m; km++) {
+					for (kp = ij = 0; kp < n_t; kp++)
+						if (acc[km * n_t + kp] > acc[km * n_t + ij]) ij = kp;
+					fprintf(fp, (geog) ? "%.5f\t%.5f" : "%.2f\t%.2f", xm[km], ym[km]);
+					fprintf(fp, "\t%.5f\t%.3f\t%s\n", acc[km * n_t + ij], t[ij], names[km]);
+				}
+				fclose(fp);
+			}
+		}
+		if (verbose)
+			mexPrintf("Added the Green's functions of %d prisms (out of %d) in %.3f s\n", n_used, (int)n_prism,
+			          (double)(clock() - tic) / CLOCKS_PER_SEC);
+	}
+	mxFree(g);		mxFree(acc);
+
+Done:
+	nc_free_string(n_m, names);
+	nc_close(ncid);
+	mxFree(names);	mxFree(t);	mxFree(xm);	mxFree(ym);	mxFree(w);
+	free(str);
+	return((status == NC_NOERR) ? 0 : -1);
+}
+#endif
+
 /* ---------------------------------------------------------------------------------------- */
 void deform(struct srf_header hdr, double x_inc, double y_inc, int isGeog, double fault_length,
 	double fault_width, double th, double dip, double rake, double d, double top_depth,
-	double xl, double yl, double *z) {
+	double xl, double yl, real *z) {
 
 	/*	Compute the vertical deformation component according to Okada formulation */
 
@@ -5591,7 +9223,7 @@ void tm(double lon, double lat, double *x, double *y, double central_meridian, d
 }
 
 /* ---------------------------------------------------------------------------------------- */
-double GMT_get_bcr_z(double *grd, struct grd_header hdr, double xx, double yy) {
+double GMT_get_bcr_z(real *grd, struct grd_header hdr, double xx, double yy) {
 	/* Given xx, yy in user's grid file (in non-normalized units)
 	   this routine returns the desired bicubic interpolated value at xx, yy
 	   ADAPTED from GMT's routine with the same name. */
@@ -5689,10 +9321,14 @@ void update_max(struct nestContainer *nest) {
 
 	unsigned int ij;
 	int writeLevel = nest->writeLevel;
+	real *etaa;
+
+	/* Between steps the last state is in etad and etaa is not updated yet */
+	etaa = (nest->new_state[writeLevel]) ? nest->etad[writeLevel] : nest->etaa[writeLevel];
 	for (ij = 0; ij < nest->hdr[writeLevel].nm; ij++) {
 		nest->work[ij] = (float)nest->etad[writeLevel][ij];
 		if (nest->bat[writeLevel][ij] < 0) {
-			if ((nest->work[ij] = (float)(nest->etaa[writeLevel][ij] + nest->bat[writeLevel][ij])) < 0)
+			if ((nest->work[ij] = (float)(etaa[ij] + nest->bat[writeLevel][ij])) < 0)
 				nest->work[ij] = 0;
 		}
 		if (nest->wmax[ij] < nest->work[ij])